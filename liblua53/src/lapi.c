@@ -1013,6 +1013,34 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
 }
 
 
+/*
+** push a new closure of the Lua function at 'idx', sharing its
+** prototype but with fresh closed upvalues; as in 'lua_load', the
+** first upvalue is set to the global table and the others are nil.
+** Re-running a loaded chunk this way costs no compilation.
+*/
+LUA_API void lua_clonefunction (lua_State *L, int idx) {
+  TValue *o;
+  LClosure *f, *cl;
+  lua_lock(L);
+  luaC_checkGC(L);
+  o = index2addr(L, idx);
+  api_check(L, ttisLclosure(o), "Lua function expected");
+  f = clLvalue(o);
+  cl = luaF_newLclosure(L, f->nupvalues);
+  cl->p = f->p;
+  setclLvalue(L, L->top, cl);
+  api_incr_top(L);
+  luaF_initupvals(L, cl);
+  if (cl->nupvalues >= 1) {
+    Table *reg = hvalue(&G(L)->l_registry);
+    setobj(L, cl->upvals[0]->v, luaH_getint(reg, LUA_RIDX_GLOBALS));
+    luaC_upvalbarrier(L, cl->upvals[0]);
+  }
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data, int strip) {
   int status;
   TValue *o;
@@ -1037,6 +1065,48 @@ LUA_API int lua_status (lua_State *L) {
 ** Garbage-collection function
 */
 
+/*
+** make the object at 'idx' (and everything reachable from it) permanent,
+** out of the work of all following collections; see 'luaC_freeze'
+*/
+LUA_API void lua_freeze (lua_State *L, int idx) {
+  TValue *o;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  if (iscollectable(o)) {
+    GCObject *obj = gcvalue(o);  /* collection below may move the stack */
+    luaC_freeze(L, obj);
+  }
+  lua_unlock(L);
+}
+
+
+/*
+** Account for 'delta' bytes of memory owned by Lua objects but allocated
+** outside Lua (negative to give it back). External memory counts as
+** allocated memory for GC pacing and in LUA_GCCOUNT. Returns the total
+** external memory currently accounted.
+*/
+LUA_API lua_Integer lua_gcaccount (lua_State *L, lua_Integer delta) {
+  global_State *g;
+  lua_Integer res;
+  lua_lock(L);
+  g = G(L);
+  if (delta < 0 && cast(lu_mem, -delta) > g->GCexternal)
+    delta = -cast(lua_Integer, g->GCexternal);  /* cannot give back more */
+  g->GCexternal += delta;
+  g->GCdebt += cast(l_mem, delta);
+  if (delta < 0)  /* released memory is no longer live */
+    g->GCestimate -= (g->GCestimate > cast(lu_mem, -delta))
+                     ? cast(lu_mem, -delta) : g->GCestimate;
+  res = cast(lua_Integer, g->GCexternal);
+  if (delta > 0)
+    luaC_checkGC(L);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API int lua_gc (lua_State *L, int what, int data) {
   int res = 0;
   global_State *g;
@@ -1098,6 +1168,27 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCSINGLE: {  /* one collector step; returns work done (bytes) */
+      lu_mem work = luaC_singlestep(L);
+      res = (work > (lu_mem)MAX_INT) ? MAX_INT : cast_int(work);
+      break;
+    }
+    case LUA_GCSTATE: {  /* current collector phase */
+      res = g->gcstate;
+      break;
+    }
+    case LUA_GCGEN: {  /* 'data' (if > 0) is the minor multiplier */
+      res = g->genmode ? LUA_GCGEN : LUA_GCINC;
+      if (data > 0)
+        g->genminormul = data;
+      luaC_changemode(L, 1);
+      break;
+    }
+    case LUA_GCINC: {
+      res = g->genmode ? LUA_GCGEN : LUA_GCINC;
+      luaC_changemode(L, 0);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
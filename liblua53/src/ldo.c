@@ -221,11 +221,13 @@ static int stackinuse (lua_State *L) {
 void luaD_shrinkstack (lua_State *L) {
   int inuse = stackinuse(L);
   int goodsize = inuse + (inuse / 8) + 2*EXTRA_STACK;
+  if (goodsize < L->stackreserve)
+    goodsize = L->stackreserve;  /* keep reserved size (see 'lua_reservethread') */
   if (goodsize > LUAI_MAXSTACK)
     goodsize = LUAI_MAXSTACK;  /* respect stack limit */
   if (L->stacksize > LUAI_MAXSTACK)  /* had been handling stack overflow? */
     luaE_freeCI(L);  /* free all CIs (list grew because of an error) */
-  else
+  else if (L->stackreserve == 0)  /* reserved threads keep their CIs */
     luaE_shrinkCI(L);  /* shrink list */
   /* if thread is currently not handling a stack overflow and its
      good size is smaller than current size, shrink its stack */
@@ -648,6 +650,7 @@ static void resume (lua_State *L, void *ud) {
 LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   int status;
   unsigned short oldnny = L->nny;  /* save "number of non-yieldable" calls */
+  lua_State *oldrunning;
   lua_lock(L);
   if (L->status == LUA_OK) {  /* may be starting a coroutine */
     if (L->ci != &L->base_ci)  /* not in base level? */
@@ -659,6 +662,8 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   if (L->nCcalls >= LUAI_MAXCCALLS)
     return resume_error(L, "C stack overflow", nargs);
   luai_userstateresume(L, nargs);
+  oldrunning = G(L)->running;
+  G(L)->running = L;
   L->nny = 0;  /* allow yields */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
   status = luaD_rawrunprotected(L, resume, &nargs);
@@ -677,6 +682,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
     else lua_assert(status == L->status);  /* normal end or yield */
   }
   L->nny = oldnny;  /* restore 'nny' */
+  G(L)->running = oldrunning;
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
   lua_unlock(L);
@@ -689,6 +695,99 @@ LUA_API int lua_isyieldable (lua_State *L) {
 }
 
 
+/*
+** The thread currently running in the state of 'L': the innermost
+** thread being resumed, or the main thread.
+*/
+LUA_API lua_State *lua_running (lua_State *L) {
+  lua_State *running = G(L)->running;
+  return (running != NULL) ? running : G(L)->mainthread;
+}
+
+
+/*
+** Bring a thread that is not running (finished, dead by an error, or
+** suspended) back to the state of a new thread, so it can be reused by
+** 'lua_resume' or to call functions. The stack and the CallInfo list
+** are kept. Returns the status the thread had.
+*/
+LUA_API int lua_resetthread (lua_State *L) {
+  CallInfo *ci;
+  StkId o;
+  int status;
+  lua_lock(L);
+  status = L->status;
+  luaF_close(L, L->stack);  /* close all upvalues */
+  for (o = L->stack; o < L->top; o++)  /* release stack values */
+    setnilvalue(o);
+  L->ci = ci = &L->base_ci;
+  ci->func = L->stack;
+  ci->callstatus = 0;
+  L->top = L->stack + 1;
+  ci->top = L->top + LUA_MINSTACK;
+  L->status = LUA_OK;
+  L->errfunc = 0;
+  L->oldpc = NULL;
+  L->nny = 1;
+  L->nCcalls = 0;
+  L->allowhook = 1;
+  L->hook = NULL;  /* drop hooks left by the previous user (e.g. a budget) */
+  L->hookmask = 0;
+  L->basehookcount = 0;
+  L->hookcount = 0;
+  if (L->stacksize > LUAI_MAXSTACK)  /* died of a stack overflow? */
+    luaD_shrinkstack(L);  /* drop the error stack */
+  lua_unlock(L);
+  return status;
+}
+
+
+/*
+** Grow the stack of a thread to at least 'stacksize' slots and its
+** CallInfo list to at least 'nci' entries, and keep them: later
+** shrinking (by the collector or after errors) does not go below
+** these sizes. Allocation runs in protected mode; returns LUA_OK, or
+** LUA_ERRMEM with the thread still usable (the reserve is then only
+** partially applied).
+*/
+struct Reserve {
+  int stacksize;
+  int nci;
+};
+
+
+static void reserve (lua_State *L, void *ud) {
+  struct Reserve *r = (struct Reserve *)ud;
+  CallInfo *ci;
+  if (L->stacksize <= LUAI_MAXSTACK && L->stacksize < r->stacksize)
+    luaD_reallocstack(L, r->stacksize);
+  L->stackreserve = r->stacksize;
+  for (ci = L->ci; ci->next != NULL; ci = ci->next) ;  /* last CI */
+  while (L->nci < r->nci && L->nci < USHRT_MAX) {
+    CallInfo *newci = luaM_new(L, CallInfo);
+    ci->next = newci;
+    newci->previous = ci;
+    newci->next = NULL;
+    L->nci++;
+    ci = newci;
+  }
+}
+
+
+LUA_API int lua_reservethread (lua_State *L, int stacksize, int nci) {
+  struct Reserve r;
+  int status;
+  lua_lock(L);
+  r.stacksize = stacksize + EXTRA_STACK;
+  if (r.stacksize > LUAI_MAXSTACK)
+    r.stacksize = LUAI_MAXSTACK;
+  r.nci = nci;
+  status = luaD_rawrunprotected(L, reserve, &r);
+  lua_unlock(L);
+  return status;
+}
+
+
 LUA_API int lua_yieldk (lua_State *L, int nresults, lua_KContext ctx,
                         lua_KFunction k) {
   CallInfo *ci = L->ci;
@@ -769,7 +868,8 @@ static void f_parser (lua_State *L, void *ud) {
   int c = zgetc(p->z);  /* read first character */
   if (c == LUA_SIGNATURE[0]) {
     checkmode(L, p->mode, "binary");
-    cl = luaU_undump(L, p->z, p->name);
+    cl = luaU_undump(L, p->z, p->name,
+                     p->mode != NULL && strchr(p->mode, 'F') != NULL);
   }
   else {
     checkmode(L, p->mode, "text");
@@ -24,6 +24,8 @@ typedef struct {
   lua_Writer writer;
   void *data;
   int strip;
+  int aligned;  /* pad arrays to their alignment (LUAC_FORMATALIGNED) */
+  size_t offset;  /* bytes written so far */
   int status;
 } DumpState;
 
@@ -42,6 +44,7 @@ static void DumpBlock (const void *b, size_t size, DumpState *D) {
     lua_unlock(D->L);
     D->status = (*D->writer)(D->L, b, size, D->data);
     lua_lock(D->L);
+    D->offset += size;
   }
 }
 
@@ -60,6 +63,22 @@ static void DumpInt (int x, DumpState *D) {
 }
 
 
+/*
+** In aligned chunks, an array is preceded by a byte with the number of
+** zero bytes that follow it, so that the array starts at a multiple of
+** 'align' from the start of the chunk
+*/
+static void DumpAlign (size_t align, DumpState *D) {
+  if (D->aligned) {
+    static const char zeros[16] = {0};
+    size_t pad = (align - (D->offset + 1) % align) % align;
+    lua_assert(align <= sizeof(zeros));
+    DumpByte(cast_int(pad), D);
+    DumpBlock(zeros, pad, D);
+  }
+}
+
+
 static void DumpNumber (lua_Number x, DumpState *D) {
   DumpVar(x, D);
 }
@@ -89,6 +108,7 @@ static void DumpString (const TString *s, DumpState *D) {
 
 static void DumpCode (const Proto *f, DumpState *D) {
   DumpInt(f->sizecode, D);
+  DumpAlign(sizeof(Instruction), D);
   DumpVector(f->code, f->sizecode, D);
 }
 
@@ -148,6 +168,7 @@ static void DumpDebug (const Proto *f, DumpState *D) {
   int i, n;
   n = (D->strip) ? 0 : f->sizelineinfo;
   DumpInt(n, D);
+  DumpAlign(sizeof(int), D);
   DumpVector(f->lineinfo, n, D);
   n = (D->strip) ? 0 : f->sizelocvars;
   DumpInt(n, D);
@@ -184,7 +205,7 @@ static void DumpFunction (const Proto *f, TString *psource, DumpState *D) {
 static void DumpHeader (DumpState *D) {
   DumpLiteral(LUA_SIGNATURE, D);
   DumpByte(LUAC_VERSION, D);
-  DumpByte(LUAC_FORMAT, D);
+  DumpByte(D->aligned ? LUAC_FORMATALIGNED : LUAC_FORMAT, D);
   DumpLiteral(LUAC_DATA, D);
   DumpByte(sizeof(int), D);
   DumpByte(sizeof(size_t), D);
@@ -205,7 +226,9 @@ int luaU_dump(lua_State *L, const Proto *f, lua_Writer w, void *data,
   D.L = L;
   D.writer = w;
   D.data = data;
-  D.strip = strip;
+  D.strip = strip & 1;
+  D.aligned = (strip & LUA_DUMPALIGNED) != 0;
+  D.offset = 0;
   D.status = 0;
   DumpHeader(&D);
   DumpByte(f->sizeupvalues, &D);
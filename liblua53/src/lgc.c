@@ -60,10 +60,10 @@
 
 
 /*
-** 'makewhite' erases all color bits then sets only the current white
-** bit
+** 'makewhite' erases all color bits (and the age) then sets only the
+** current white bit
 */
-#define maskcolors	(~(bitmask(BLACKBIT) | WHITEBITS))
+#define maskcolors	(~(bitmask(BLACKBIT) | WHITEBITS | bitmask(OLDBIT)))
 #define makewhite(g,x)	\
  (x->marked = cast_byte((x->marked & maskcolors) | luaC_white(g)))
 
@@ -146,6 +146,28 @@ static int iscleared (global_State *g, const TValue *o) {
 }
 
 
+/*
+** a frozen object got a reference to a non-frozen one: move it to the
+** 'thawed' list, whose objects are traversed as roots in every cycle.
+** (The search is linear in the number of frozen objects, but each
+** object is thawed at most once.) All its references are frozen (or
+** are being handled by the barrier), so it may remain black while the
+** invariant is kept; otherwise it becomes white, as objects are after
+** the sweep.
+*/
+static void thaw (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
+  GCObject **p;
+  for (p = &g->frozen; *p != o; p = &(*p)->next) { /* empty */ }
+  *p = o->next;  /* remove 'o' from 'frozen' list */
+  o->next = g->thawed;  /* link it in 'thawed' list */
+  g->thawed = o;
+  resetbit(o->marked, FROZENBIT);
+  if (!keepinvariant(g))
+    makewhite(g, o);
+}
+
+
 /*
 ** barrier that moves collector forward, that is, mark the white object
 ** being pointed by a black object. (If in sweep phase, clear the black
@@ -154,8 +176,13 @@ static int iscleared (global_State *g, const TValue *o) {
 */
 void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v) {
   global_State *g = G(L);
-  lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
-  if (keepinvariant(g))  /* must keep invariant? */
+  lua_assert(isblack(o) && !isdead(g, v) && !isdead(g, o));
+  if (isfrozen(o)) {
+    thaw(L, o);
+    if (isblack(o) && iswhite(v))
+      reallymarkobject(g, v);  /* restore invariant */
+  }
+  else if (keepinvariant(g))  /* must keep invariant? */
     reallymarkobject(g, v);  /* restore invariant */
   else {  /* sweep phase */
     lua_assert(issweepphase(g));
@@ -171,6 +198,11 @@ void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v) {
 void luaC_barrierback_ (lua_State *L, Table *t) {
   global_State *g = G(L);
   lua_assert(isblack(t) && !isdead(g, t));
+  if (isfrozen(t)) {
+    thaw(L, obj2gco(t));
+    if (iswhite(t))
+      return;  /* will be traversed as a root */
+  }
   black2gray(t);  /* make table gray (again) */
   linkgclist(t, g->grayagain);
 }
@@ -293,6 +325,16 @@ static void markmt (global_State *g) {
 }
 
 
+/*
+** mark all permanent objects that are not frozen (they are roots)
+*/
+static void markthawed (global_State *g) {
+  GCObject *o;
+  for (o = g->thawed; o != NULL; o = o->next)
+    markobject(g, o);
+}
+
+
 /*
 ** mark all objects in list of being-finalized
 */
@@ -332,15 +374,20 @@ static void remarkupvals (global_State *g) {
 
 
 /*
-** mark root set and reset all gray lists, to start a new collection
+** mark root set and reset all gray lists, to start a new collection.
+** In generational mode, 'gray' and 'grayagain' are kept: they hold old
+** objects touched by barriers, threads and weak tables, which must be
+** traversed again in every minor collection.
 */
 static void restartcollection (global_State *g) {
-  g->gray = g->grayagain = NULL;
+  if (!g->genmode)
+    g->gray = g->grayagain = NULL;
   g->weak = g->allweak = g->ephemeron = NULL;
   markobject(g, g->mainthread);
   markvalue(g, &g->l_registry);
   markmt(g);
   markbeingfnz(g);  /* mark any finalizing object left from previous cycle */
+  markthawed(g);
 }
 
 /* }====================================================== */
@@ -378,6 +425,8 @@ static void traverseweakvalue (global_State *g, Table *h) {
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
   else if (hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
+  else if (g->genmode)
+    linkgclist(h, g->grayagain);  /* keep it gray for next collection */
 }
 
 
@@ -426,6 +475,8 @@ static int traverseephemeron (global_State *g, Table *h) {
     linkgclist(h, g->ephemeron);  /* have to propagate again */
   else if (hasclears)  /* table has white keys? */
     linkgclist(h, g->allweak);  /* may have to clean white keys */
+  else if (g->genmode)
+    linkgclist(h, g->grayagain);  /* keep it gray for next collection */
   return marked;
 }
 
@@ -755,6 +806,17 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
 /*
 ** sweep a list until a live object (or end of list)
 */
+/*
+** make all objects in a list white, without freeing any of them (for
+** lists that are not swept)
+*/
+static void whitelist (global_State *g, GCObject *p) {
+  int white = luaC_white(g);
+  for (; p != NULL; p = p->next)
+    p->marked = cast_byte((p->marked & maskcolors) | white);
+}
+
+
 static GCObject **sweeptolive (lua_State *L, GCObject **p) {
   GCObject **old = p;
   do {
@@ -792,8 +854,8 @@ static GCObject *udata2finalize (global_State *g) {
   o->next = g->allgc;  /* return it to 'allgc' list */
   g->allgc = o;
   resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
-  if (issweepphase(g))
-    makewhite(g, o);  /* "sweep" object */
+  if (issweepphase(g) || g->genmode)
+    makewhite(g, o);  /* "sweep" object (in generational mode, make it young) */
   return o;
 }
 
@@ -902,6 +964,7 @@ static void separatetobefnz (global_State *g, int all) {
 void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
   global_State *g = G(L);
   if (tofinalize(o) ||                 /* obj. is already marked... */
+      ispermanent(o) ||                /* or is never collected... */
       gfasttm(g, mt, TM_GC) == NULL)   /* or has no finalizer? */
     return;  /* nothing to be done */
   else {  /* move 'o' to 'finobj' list */
@@ -917,6 +980,7 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
     o->next = g->finobj;  /* link it in 'finobj' list */
     g->finobj = o;
     l_setbit(o->marked, FINALIZEDBIT);  /* mark it as such */
+    resetbit(o->marked, OLDBIT);  /* young objects must precede old ones */
   }
 }
 
@@ -964,12 +1028,37 @@ static void entersweep (lua_State *L) {
 }
 
 
+/*
+** return all permanent objects in list 'p' to the regular lists, so that
+** they are finalized and freed with all others
+*/
+static void unfreezelist (global_State *g, GCObject **p) {
+  GCObject *curr;
+  while ((curr = *p) != NULL) {
+    *p = curr->next;
+    resetbits(curr->marked, bit2mask(FROZENBIT, PERMBIT));
+    makewhite(g, curr);
+    if (tofinalize(curr)) {
+      curr->next = g->finobj;
+      g->finobj = curr;
+    }
+    else {
+      curr->next = g->allgc;
+      g->allgc = curr;
+    }
+  }
+}
+
+
 void luaC_freeallobjects (lua_State *L) {
   global_State *g = G(L);
+  unfreezelist(g, &g->frozen);
+  unfreezelist(g, &g->thawed);
   separatetobefnz(g, 1);  /* separate all objects with finalizers */
   lua_assert(g->finobj == NULL);
   callallpendingfinalizers(L);
   lua_assert(g->tobefnz == NULL);
+  g->genmode = 0;
   g->currentwhite = WHITEBITS; /* this "white" makes all objects look dead */
   g->gckind = KGC_NORMAL;
   sweepwholelist(L, &g->finobj);
@@ -979,11 +1068,32 @@ void luaC_freeallobjects (lua_State *L) {
 }
 
 
+/*
+** in generational mode, weak tables stay gray between collections: move
+** them from the lists used by 'atomic' to 'grayagain', so that the next
+** minor collection traverses (and clears) them again
+*/
+static void linkweaklists (global_State *g) {
+  GCObject **lists[] = {&g->weak, &g->allweak, &g->ephemeron};
+  int i;
+  for (i = 0; i < 3; i++) {
+    GCObject *o;
+    while ((o = *lists[i]) != NULL) {
+      Table *h = gco2t(o);
+      *lists[i] = h->gclist;
+      linkgclist(h, g->grayagain);
+    }
+  }
+}
+
+
 static l_mem atomic (lua_State *L) {
   global_State *g = G(L);
   l_mem work;
   GCObject *origweak, *origall;
   GCObject *grayagain = g->grayagain;  /* save original list */
+  if (g->genmode)
+    g->grayagain = NULL;  /* it will be rebuilt for next collection */
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(g->mainthread));
   g->gcstate = GCSinsideatomic;
@@ -1020,6 +1130,8 @@ static l_mem atomic (lua_State *L) {
   clearvalues(g, g->weak, origweak);
   clearvalues(g, g->allweak, origall);
   luaS_clearcache(g);
+  if (g->genmode)
+    linkweaklists(g);
   g->currentwhite = cast_byte(otherwhite(g));  /* flip current white */
   work += g->GCmemtrav;  /* complete counting */
   return work;  /* estimate of memory marked by 'atomic' */
@@ -1078,6 +1190,7 @@ static lu_mem singlestep (lua_State *L) {
     }
     case GCSswpend: {  /* finish sweeps */
       makewhite(g, g->mainthread);  /* sweep main thread */
+      whitelist(g, g->thawed);  /* "sweep" permanent roots */
       checkSizes(L, g);
       g->gcstate = GCScallfin;
       return 0;
@@ -1097,6 +1210,392 @@ static lu_mem singlestep (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Freeze
+** =======================================================
+*/
+
+/*
+** Freezing makes objects permanent: they are moved to list 'frozen',
+** turned black, and never traversed nor swept again, which takes them
+** out of the work of every following cycle. Everything reachable from
+** a frozen object must be frozen too (the collector will not see those
+** references), except objects whose contents keep changing without a
+** barrier on them: Lua closures (their upvalues), threads and weak
+** tables. These are moved to list 'thawed' instead, whose objects are
+** permanent too but are marked as roots in every cycle; their contents
+** are not frozen (but a Lua closure's prototype is). The registry and
+** the table of globals are always live and often modified: freezing
+** goes through them but leaves them as they are. A frozen object that
+** gets a reference to a non-frozen one is thawed by the barriers.
+** Frozen objects with finalizers are finalized only when the state is
+** closed.
+*/
+
+
+static int cannotfreeze (global_State *g, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TLCL: case LUA_TTHREAD: return 1;
+    case LUA_TTABLE: {
+      const TValue *mode = gfasttm(g, gco2t(o)->metatable, TM_MODE);
+      return (mode && ttisstring(mode) &&
+              (strchr(svalue(mode), 'k') || strchr(svalue(mode), 'v')));
+    }
+    default: return 0;
+  }
+}
+
+
+static int istransparent (global_State *g, GCObject *o) {
+  Table *reg = hvalue(&g->l_registry);
+  return (o == obj2gco(reg) ||
+          (reg->sizearray >= LUA_RIDX_GLOBALS &&
+           ttistable(&reg->array[LUA_RIDX_GLOBALS - 1]) &&
+           o == gcvalue(&reg->array[LUA_RIDX_GLOBALS - 1])));
+}
+
+
+/*
+** visit an object reachable from the one being frozen. Objects with
+** contents are linked in 'gray' to be traversed by 'freezetraverse'.
+** Objects to be frozen become black (with bits FROZENBIT and PERMBIT);
+** the ones to become roots only get PERMBIT; transparent ones become
+** black, to be whitened back by 'separatefrozen'.
+*/
+static void freezemark (global_State *g, GCObject *o) {
+  if (o == NULL || !iswhite(o) || ispermanent(o) ||
+      o == obj2gco(g->mainthread))
+    return;  /* fixed, frozen, already visited or main thread */
+  if (cannotfreeze(g, o)) {
+    l_setbit(o->marked, PERMBIT);
+    if (o->tt == LUA_TLCL)
+      freezemark(g, obj2gco(gco2lcl(o)->p));
+    return;
+  }
+  o->marked = cast_byte((o->marked & maskcolors) | bitmask(BLACKBIT));
+  if (istransparent(g, o)) {
+    linkgclist(gco2t(o), g->gray);
+    return;
+  }
+  l_setbit(o->marked, FROZENBIT);
+  l_setbit(o->marked, PERMBIT);
+  switch (o->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: break;
+    case LUA_TUSERDATA: {
+      TValue uvalue;
+      if (gco2u(o)->metatable)
+        freezemark(g, obj2gco(gco2u(o)->metatable));
+      getuservalue(g->mainthread, gco2u(o), &uvalue);
+      if (iscollectable(&uvalue))
+        freezemark(g, gcvalue(&uvalue));
+      break;
+    }
+    case LUA_TCCL: linkgclist(gco2ccl(o), g->gray); break;
+    case LUA_TTABLE: linkgclist(gco2t(o), g->gray); break;
+    case LUA_TPROTO: linkgclist(gco2p(o), g->gray); break;
+    default: lua_assert(0); break;
+  }
+}
+
+
+#define freezevalue(g,o)  \
+	{ if (iscollectable(o)) freezemark(g, gcvalue(o)); }
+
+#define freezestring(g,s)  { if (s) freezemark(g, obj2gco(s)); }
+
+
+static void freezetraverse (global_State *g, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      Node *n, *limit = gnodelast(h);
+      unsigned int i;
+      g->gray = h->gclist;
+      if (h->metatable)
+        freezemark(g, obj2gco(h->metatable));
+      for (i = 0; i < h->sizearray; i++)
+        freezevalue(g, &h->array[i]);
+      for (n = gnode(h, 0); n < limit; n++) {
+        checkdeadkey(n);
+        if (ttisnil(gval(n)))  /* entry is empty? */
+          removeentry(n);  /* its key may die: make it dead */
+        else {
+          freezevalue(g, gkey(n));
+          freezevalue(g, gval(n));
+        }
+      }
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      int i;
+      g->gray = cl->gclist;
+      for (i = 0; i < cl->nupvalues; i++)
+        freezevalue(g, &cl->upvalue[i]);
+      break;
+    }
+    case LUA_TPROTO: {
+      Proto *f = gco2p(o);
+      int i;
+      g->gray = f->gclist;
+      f->cache = NULL;  /* cached closure is not frozen */
+      freezestring(g, f->source);
+      for (i = 0; i < f->sizek; i++)
+        freezevalue(g, &f->k[i]);
+      for (i = 0; i < f->sizeupvalues; i++)
+        freezestring(g, f->upvalues[i].name);
+      for (i = 0; i < f->sizep; i++)
+        if (f->p[i])
+          freezemark(g, obj2gco(f->p[i]));
+      for (i = 0; i < f->sizelocvars; i++)
+        freezestring(g, f->locvars[i].varname);
+      break;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+/*
+** move the objects marked by 'freezemark' from list 'p' to lists
+** 'frozen' and 'thawed'; restore the others to white
+*/
+static void separatefrozen (global_State *g, GCObject **p) {
+  GCObject *curr;
+  while ((curr = *p) != NULL) {
+    if (ispermanent(curr)) {
+      *p = curr->next;
+      if (isfrozen(curr)) {
+        curr->next = g->frozen;
+        g->frozen = curr;
+      }
+      else {
+        curr->next = g->thawed;
+        g->thawed = curr;
+      }
+    }
+    else {
+      makewhite(g, curr);
+      p = &curr->next;
+    }
+  }
+}
+
+
+/*
+** freeze 'o' and everything reachable from it. Starts from a full
+** incremental collection, so that all live objects are white, no gray
+** list is in use and no object is pending finalization.
+*/
+void luaC_freeze (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
+  int gen = g->genmode;
+  if (gen)
+    luaC_changemode(L, 0);
+  luaC_fullgc(L, 0);
+  lua_assert(g->gcstate == GCSpause && g->gray == NULL);
+  freezemark(g, o);
+  while (g->gray)
+    freezetraverse(g, g->gray);
+  separatefrozen(g, &g->allgc);
+  separatefrozen(g, &g->finobj);
+  if (gen)
+    luaC_changemode(L, 1);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Generational mode
+** =======================================================
+*/
+
+/*
+** A simple two-generation collector on top of the incremental one. A
+** minor collection marks and sweeps only young objects, in one atomic
+** step: objects that survive it keep their color (black) and become
+** old, so the next minor collection neither traverses nor sweeps them.
+** New objects are linked at the head of 'allgc'/'finobj', therefore
+** the young ones always form a prefix of these lists and the sweep
+** stops at the first old object. The barriers keep old objects that
+** receive young references (and all threads and weak tables) gray,
+** in 'gray'/'grayagain', to be traversed again by the next minor
+** collection. Old objects are collected only by major collections,
+** which turn every object young and run a minor collection over all
+** of them; a major collection happens when memory use grows
+** 'genmajormul'% beyond its value after the previous major one.
+*/
+
+
+/*
+** sweep a list in generational mode: free dead objects and make the
+** survivors old, keeping their colors. If 'stopatold', stop at the
+** first old object (all others are old too).
+*/
+static void sweepgen (lua_State *L, GCObject **p, int stopatold) {
+  global_State *g = G(L);
+  int ow = otherwhite(g);
+  GCObject *curr;
+  while ((curr = *p) != NULL) {
+    int marked = curr->marked;
+    if (isdeadm(ow, marked)) {  /* is 'curr' dead? */
+      *p = curr->next;  /* remove 'curr' from list */
+      freeobj(L, curr);  /* erase 'curr' */
+    }
+    else {
+      if (stopatold && testbit(marked, OLDBIT))
+        break;  /* the remainder of the list is old */
+      curr->marked = cast_byte(marked | bitmask(OLDBIT));
+      p = &curr->next;  /* go to next element */
+    }
+  }
+}
+
+
+/*
+** turn all objects white and young (as after an incremental sweep) and
+** reset all gray lists
+*/
+static void whiteall (global_State *g) {
+  whitelist(g, g->allgc);
+  whitelist(g, g->finobj);
+  whitelist(g, g->tobefnz);
+  whitelist(g, g->thawed);
+  makewhite(g, g->mainthread);  /* main thread is not in 'allgc' */
+  g->gray = g->grayagain = NULL;
+  g->weak = g->allweak = g->ephemeron = NULL;
+}
+
+
+/*
+** a minor collection, as one atomic step. Finalizers are not called
+** here: see 'callgenfinalizers'.
+*/
+static lu_mem youngcollection (lua_State *L) {
+  global_State *g = G(L);
+  lu_mem work;
+  lua_assert(g->gcstate == GCSpause);
+  g->GCmemtrav = 0;
+  restartcollection(g);
+  g->gcstate = GCSpropagate;
+  propagateall(g);
+  work = g->GCmemtrav;
+  g->gcstate = GCSatomic;
+  work += atomic(L);
+  g->gcstate = GCSswpallgc;
+  sweepgen(L, &g->allgc, 1);
+  g->gcstate = GCSswpfinobj;
+  sweepgen(L, &g->finobj, 1);
+  g->gcstate = GCSswptobefnz;
+  sweepgen(L, &g->tobefnz, 0);
+  g->gcstate = GCSswpend;
+  checkSizes(L, g);
+  g->GCestimate = gettotalbytes(g);
+  g->gcstate = GCSpause;
+  return work;
+}
+
+
+/*
+** a major collection: everything becomes young, so the minor collection
+** traverses and sweeps the whole heap
+*/
+static lu_mem fullgen (lua_State *L) {
+  global_State *g = G(L);
+  lu_mem work;
+  whiteall(g);
+  work = youngcollection(L);
+  g->lastmajor = gettotalbytes(g);
+  return work;
+}
+
+
+/*
+** next minor collection after memory grows 'genminormul'%
+*/
+static void setminordebt (global_State *g) {
+  luaE_setdebt(g, -(cast(l_mem, (gettotalbytes(g) / 100)) * g->genminormul));
+}
+
+
+/*
+** call finalizers of objects separated by the last collection. The
+** collector is already in pause, so errors can propagate safely.
+*/
+static int callgenfinalizers (lua_State *L) {
+  global_State *g = G(L);
+  int n = 0;
+  for (; g->tobefnz; n++)
+    GCTM(L, 1);
+  return n;
+}
+
+
+/*
+** a generational step: a major collection if memory has grown too much
+** since the last one, a minor collection otherwise
+*/
+static lu_mem genstep (lua_State *L) {
+  global_State *g = G(L);
+  lu_mem work;
+  if (gettotalbytes(g) > g->lastmajor + (g->lastmajor / 100) * g->genmajormul)
+    work = fullgen(L);
+  else
+    work = youngcollection(L);
+  setminordebt(g);
+  work += callgenfinalizers(L) * GCFINALIZECOST;
+  return work;
+}
+
+
+/*
+** change collector mode: entering generational mode finishes the
+** current incremental cycle and does a major collection to build the
+** old generation; leaving it turns all objects white, as in the pause
+** of an incremental cycle
+*/
+void luaC_changemode (lua_State *L, int gen) {
+  global_State *g = G(L);
+  if (gen == g->genmode)
+    return;  /* nothing to change */
+  if (gen) {
+    luaC_runtilstate(L, bitmask(GCSpause));
+    g->genmode = 1;
+    fullgen(L);
+    setminordebt(g);
+  }
+  else {
+    whiteall(g);
+    g->genmode = 0;
+    g->GCestimate = gettotalbytes(g);
+    setpause(g);
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** performs exactly one collector step, regardless of debt, and
+** returns the work done; resets the pause when a cycle completes.
+** Lets a host spend a time budget on the collector step by step. In
+** generational mode a step is a whole minor (or major) collection.
+*/
+lu_mem luaC_singlestep (lua_State *L) {
+  global_State *g = G(L);
+  lu_mem work;
+  if (g->genmode)
+    return genstep(L);
+  work = singlestep(L);
+  if (g->gcstate == GCSpause)
+    setpause(g);  /* cycle finished; pause until next one */
+  return work;
+}
+
+
 /*
 ** advances the garbage collector until it reaches a state allowed
 ** by 'statemask'
@@ -1133,6 +1632,10 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  if (g->genmode) {
+    genstep(L);
+    return;
+  }
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1160,6 +1663,14 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(g->gckind == KGC_NORMAL);
   if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
+  if (g->genmode) {  /* a major collection */
+    fullgen(L);
+    setminordebt(g);
+    g->gckind = KGC_NORMAL;
+    if (!isemergency)
+      callgenfinalizers(L);
+    return;
+  }
   if (keepinvariant(g)) {  /* black objects? */
     entersweep(L); /* sweep everything to turn them back to white */
   }
@@ -55,10 +55,11 @@
 ** ones) must be kept. During a collection, the sweep
 ** phase may break the invariant, as objects turned white may point to
 ** still-black objects. The invariant is restored when sweep ends and
-** all objects are white again.
+** all objects are white again. In generational mode the invariant is
+** always kept, as old objects stay black between collections.
 */
 
-#define keepinvariant(g)	((g)->gcstate <= GCSatomic)
+#define keepinvariant(g)	((g)->genmode || (g)->gcstate <= GCSatomic)
 
 
 /*
@@ -79,6 +80,9 @@
 #define WHITE1BIT	1  /* object is white (type 1) */
 #define BLACKBIT	2  /* object is black */
 #define FINALIZEDBIT	3  /* object has been marked for finalization */
+#define OLDBIT		4  /* object survived a generational collection */
+#define FROZENBIT	5  /* object is frozen: neither traversed nor swept */
+#define PERMBIT		6  /* object is never collected (frozen or thawed) */
 /* bit 7 is currently used by tests (luaL_checkmemory) */
 
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
@@ -90,6 +94,9 @@
 	(!testbits((x)->marked, WHITEBITS | bitmask(BLACKBIT)))
 
 #define tofinalize(x)	testbit((x)->marked, FINALIZEDBIT)
+#define isold(x)	testbit((x)->marked, OLDBIT)
+#define isfrozen(x)	testbit((x)->marked, FROZENBIT)
+#define ispermanent(x)	testbit((x)->marked, PERMBIT)
 
 #define otherwhite(g)	((g)->currentwhite ^ WHITEBITS)
 #define isdeadm(ow,m)	(!(((m) ^ WHITEBITS) & (ow)))
@@ -115,16 +122,23 @@
 #define luaC_checkGC(L)		luaC_condGC(L,(void)0,(void)0)
 
 
+/*
+** a black object pointing to a white one breaks the invariant; a frozen
+** object is never traversed again, so it must be thawed when it gets
+** any reference to a non-frozen object
+*/
+#define needbarrier(p,o)	(iswhite(o) || (isfrozen(p) && !isfrozen(o)))
+
 #define luaC_barrier(L,p,v) (  \
-	(iscollectable(v) && isblack(p) && iswhite(gcvalue(v))) ?  \
+	(iscollectable(v) && isblack(p) && needbarrier(p, gcvalue(v))) ?  \
 	luaC_barrier_(L,obj2gco(p),gcvalue(v)) : cast_void(0))
 
 #define luaC_barrierback(L,p,v) (  \
-	(iscollectable(v) && isblack(p) && iswhite(gcvalue(v))) ? \
+	(iscollectable(v) && isblack(p) && needbarrier(p, gcvalue(v))) ? \
 	luaC_barrierback_(L,p) : cast_void(0))
 
 #define luaC_objbarrier(L,p,o) (  \
-	(isblack(p) && iswhite(o)) ? \
+	(isblack(p) && needbarrier(p, o)) ? \
 	luaC_barrier_(L,obj2gco(p),obj2gco(o)) : cast_void(0))
 
 #define luaC_upvalbarrier(L,uv) ( \
@@ -135,7 +149,10 @@ LUAI_FUNC void luaC_fix (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_freeallobjects (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
 LUAI_FUNC void luaC_runtilstate (lua_State *L, int statesmask);
+LUAI_FUNC lu_mem luaC_singlestep (lua_State *L);
+LUAI_FUNC void luaC_changemode (lua_State *L, int gen);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
+LUAI_FUNC void luaC_freeze (lua_State *L, GCObject *o);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, int tt, size_t sz);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_ (lua_State *L, Table *o);
@@ -404,11 +404,16 @@ typedef struct LocVar {
 /*
 ** Function Prototypes
 */
+/* bits in 'Proto.fixed' (arrays not owned by the prototype) */
+#define PF_FIXEDCODE	1	/* 'code' points into a fixed chunk buffer */
+#define PF_FIXEDLINE	2	/* 'lineinfo' points into a fixed chunk buffer */
+
 typedef struct Proto {
   CommonHeader;
   lu_byte numparams;  /* number of fixed parameters */
   lu_byte is_vararg;
   lu_byte maxstacksize;  /* number of registers needed by this function */
+  lu_byte fixed;  /* PF_* bits: arrays referencing a loaded buffer */
   int sizeupvalues;  /* size of 'upvalues' */
   int sizek;  /* size of 'k' */
   int sizecode;
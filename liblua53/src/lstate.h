@@ -141,6 +141,7 @@ typedef struct global_State {
   l_mem GCdebt;  /* bytes allocated not yet compensated by the collector */
   lu_mem GCmemtrav;  /* memory traversed by the GC */
   lu_mem GCestimate;  /* an estimate of the non-garbage memory in use */
+  lu_mem GCexternal;  /* memory owned by userdata outside Lua, counted as debt */
   stringtable strt;  /* hash table for strings */
   TValue l_registry;
   unsigned int seed;  /* randomized seed for hashes */
@@ -148,6 +149,7 @@ typedef struct global_State {
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcrunning;  /* true if GC is running */
+  lu_byte genmode;  /* true if collector is in generational mode */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
@@ -158,12 +160,18 @@ typedef struct global_State {
   GCObject *allweak;  /* list of all-weak tables */
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
+  GCObject *frozen;  /* list of frozen objects (neither traversed nor swept) */
+  GCObject *thawed;  /* list of permanent objects traversed as roots */
   struct lua_State *twups;  /* list of threads with open upvalues */
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int genminormul;  /* control for minor generational collections */
+  int genmajormul;  /* control for major generational collections */
+  lu_mem lastmajor;  /* memory in use after last major collection */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
+  struct lua_State *running;  /* innermost thread in 'lua_resume' (NULL: main) */
   const lua_Number *version;  /* pointer to version number */
   TString *memerrmsg;  /* memory-error message */
   TString *tmname[TM_N];  /* array with tag-method names */
@@ -193,6 +201,7 @@ struct lua_State {
   volatile lua_Hook hook;
   ptrdiff_t errfunc;  /* current error handling function (stack index) */
   int stacksize;
+  int stackreserve;  /* stack size (and CallInfo list) kept when shrinking */
   int basehookcount;
   int hookcount;
   unsigned short nny;  /* number of non-yieldable calls in stack */
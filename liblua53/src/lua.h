@@ -280,6 +280,14 @@ LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                           const char *chunkname, const char *mode);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data, int strip);
+LUA_API void (lua_clonefunction) (lua_State *L, int idx);
+
+/*
+** 'strip' flag for lua_dump: pad code and line info to their alignment.
+** Loading such a chunk with mode 'F' (fixed buffer, which must outlive
+** every function loaded from it) references these arrays in place.
+*/
+#define LUA_DUMPALIGNED	2
 
 
 /*
@@ -289,7 +297,10 @@ LUA_API int  (lua_yieldk)     (lua_State *L, int nresults, lua_KContext ctx,
                                lua_KFunction k);
 LUA_API int  (lua_resume)     (lua_State *L, lua_State *from, int narg);
 LUA_API int  (lua_status)     (lua_State *L);
+LUA_API int  (lua_resetthread) (lua_State *L);
+LUA_API int  (lua_reservethread) (lua_State *L, int stacksize, int nci);
 LUA_API int (lua_isyieldable) (lua_State *L);
+LUA_API lua_State *(lua_running) (lua_State *L);
 
 #define lua_yield(L,n)		lua_yieldk(L, (n), 0, NULL)
 
@@ -307,8 +318,14 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCSINGLE		10
+#define LUA_GCSTATE		11
+#define LUA_GCGEN		12
+#define LUA_GCINC		13
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
+LUA_API void (lua_freeze) (lua_State *L, int idx);
+LUA_API lua_Integer (lua_gcaccount) (lua_State *L, lua_Integer delta);
 
 
 /*
@@ -33,6 +33,8 @@ typedef struct {
   lua_State *L;
   ZIO *Z;
   const char *name;
+  int aligned;  /* chunk has padded arrays (LUAC_FORMATALIGNED) */
+  int fixed;  /* buffer outlives the loaded functions (mode 'F') */
 } LoadState;
 
 
@@ -110,11 +112,42 @@ static TString *LoadString (LoadState *S, Proto *p) {
 }
 
 
+/*
+** Skip the padding before an array of an aligned chunk. If the buffer
+** is fixed and holds the whole array at an aligned address, return the
+** array in place and consume it; otherwise return NULL.
+*/
+static const void *LoadAligned (LoadState *S, size_t size, size_t align) {
+  if (S->aligned) {
+    char pad[16];
+    size_t n = LoadByte(S);
+    if (n >= align)
+      error(S, "bad padding in");
+    LoadBlock(S, pad, n);
+  }
+  if (S->fixed && size > 0 && S->Z->n >= size &&
+      point2uint(S->Z->p) % align == 0) {
+    const void *b = S->Z->p;
+    S->Z->p += size;
+    S->Z->n -= size;
+    return b;
+  }
+  return NULL;
+}
+
+
 static void LoadCode (LoadState *S, Proto *f) {
   int n = LoadInt(S);
-  f->code = luaM_newvector(S->L, n, Instruction);
+  const void *b = LoadAligned(S, n * sizeof(Instruction), sizeof(Instruction));
   f->sizecode = n;
-  LoadVector(S, f->code, n);
+  if (b != NULL) {
+    f->code = cast(Instruction *, b);
+    f->fixed |= PF_FIXEDCODE;
+  }
+  else {
+    f->code = luaM_newvector(S->L, n, Instruction);
+    LoadVector(S, f->code, n);
+  }
 }
 
 
@@ -186,10 +219,18 @@ static void LoadUpvalues (LoadState *S, Proto *f) {
 
 static void LoadDebug (LoadState *S, Proto *f) {
   int i, n;
+  const void *b;
   n = LoadInt(S);
-  f->lineinfo = luaM_newvector(S->L, n, int);
+  b = LoadAligned(S, n * sizeof(int), sizeof(int));
   f->sizelineinfo = n;
-  LoadVector(S, f->lineinfo, n);
+  if (b != NULL) {
+    f->lineinfo = cast(int *, b);
+    f->fixed |= PF_FIXEDLINE;
+  }
+  else {
+    f->lineinfo = luaM_newvector(S->L, n, int);
+    LoadVector(S, f->lineinfo, n);
+  }
   n = LoadInt(S);
   f->locvars = luaM_newvector(S->L, n, LocVar);
   f->sizelocvars = n;
@@ -244,8 +285,11 @@ static void checkHeader (LoadState *S) {
   checkliteral(S, LUA_SIGNATURE + 1, "not a");  /* 1st char already checked */
   if (LoadByte(S) != LUAC_VERSION)
     error(S, "version mismatch in");
-  if (LoadByte(S) != LUAC_FORMAT)
-    error(S, "format mismatch in");
+  switch (LoadByte(S)) {
+    case LUAC_FORMAT: S->aligned = 0; break;
+    case LUAC_FORMATALIGNED: S->aligned = 1; break;
+    default: error(S, "format mismatch in");
+  }
   checkliteral(S, LUAC_DATA, "corrupted");
   checksize(S, int);
   checksize(S, size_t);
@@ -262,7 +306,7 @@ static void checkHeader (LoadState *S) {
 /*
 ** load precompiled chunk
 */
-LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
+LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name, int fixed) {
   LoadState S;
   LClosure *cl;
   if (*name == '@' || *name == '=')
@@ -273,6 +317,7 @@ LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
     S.name = name;
   S.L = L;
   S.Z = Z;
+  S.fixed = fixed;
   checkHeader(&S);
   cl = luaF_newLclosure(L, LoadByte(&S));
   setclLvalue(L, L->top, cl);
@@ -755,8 +755,13 @@ void luaV_finishOp (lua_State *L) {
 /* fetch an instruction and prepare its execution */
 #define vmfetch()	{ \
   i = *(ci->u.l.savedpc++); \
-  if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) \
-    Protect(luaG_traceexec(L)); \
+  if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) { \
+    /* count-only hook that does not fire now: same as luaG_traceexec */ \
+    if (!(L->hookmask & LUA_MASKLINE) && L->hookcount != 1) \
+      L->hookcount--; \
+    else \
+      Protect(luaG_traceexec(L)); \
+  } \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
   lua_assert(base == ci->u.l.base); \
   lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <iterator>
+
+#include "mix_util.h"
+#include "external_mix.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// 内存分配策略：lua_newstate 的分配函数转发到此处，统一记录存活字节数与分配次数
+	// 一个策略对象只服务一个 lua_State，状态机是单线程的，因此统计与实现都不需要加锁
+	class AllocPolicy {
+	public:
+		struct Stats {
+			std::size_t live_bytes;		// 当前存活字节数
+			std::size_t peak_bytes;		// 存活字节数峰值
+			std::size_t allocs;			// 累计分配次数
+			std::size_t frees;			// 累计释放次数
+			std::size_t reallocs;		// 累计原地调整次数
+			std::size_t soft_limit;		// 软上限，0 表示不限制
+			std::size_t hard_limit;		// 硬上限，0 表示不限制
+			std::size_t soft_hits;		// 触及软上限次数
+			std::size_t hard_hits;		// 因硬上限拒绝分配的次数
+		};
+
+		// 在分配函数内调用，此时状态机正在分配内存，不能调用任何 lua API
+		using SoftLimitHandler = std::function<void(const Stats&)>;
+
+	public:
+		virtual ~AllocPolicy() = default;
+
+		const Stats& GetStats() const {
+			return stats_;
+		}
+
+		/* 内存上限，单位字节，0 表示不限制：
+		 * 超过硬上限的增长直接失败，lua 会先做一次紧急全量回收再重试，仍失败则抛出内存错误；
+		 * 第一次超过软上限时先让分配失败一次以触发紧急全量回收，重试时放行并通知回调，
+		 * 之后存活字节数回落到软上限的四分之三以下才会再次触发。
+		*/
+		void SetLimits(std::size_t soft_limit, std::size_t hard_limit) {
+			stats_.soft_limit = soft_limit;
+			stats_.hard_limit = hard_limit;
+			soft_tripped_ = false;
+			soft_collecting_ = false;
+		}
+
+		void SetSoftLimitHandler(SoftLimitHandler handler) {
+			soft_handler_ = std::move(handler);
+		}
+
+		// 状态机使用 AllocPolicy 分配时返回策略对象，否则返回 nullptr
+		static AllocPolicy* Find(lua_State* L) {
+			void* ud = nullptr;
+			if (lua_getallocf(L, &ud) != &Alloc) {
+				return nullptr;
+			}
+			return static_cast<AllocPolicy*>(ud);
+		}
+
+		// lua_Alloc，ud 为策略对象
+		static void* Alloc(void* ud, void* ptr, std::size_t osize, std::size_t nsize) {
+			auto policy = static_cast<AllocPolicy*>(ud);
+			auto& stats = policy->stats_;
+			// ptr 为空时 osize 表示对象类型，不是大小
+			if (!ptr) {
+				osize = 0;
+			}
+			if (nsize == 0) {
+				if (ptr) {
+					policy->Free(ptr, osize);
+					stats.live_bytes -= osize;
+					++stats.frees;
+					if (policy->soft_tripped_ && stats.live_bytes < stats.soft_limit - stats.soft_limit / 4) {
+						policy->soft_tripped_ = false;
+					}
+				}
+				return nullptr;
+			}
+
+			bool soft_hit = false;
+			if (nsize > osize) {
+				std::size_t want = stats.live_bytes - osize + nsize;
+				bool retry = policy->soft_collecting_;
+				policy->soft_collecting_ = false;
+				if (stats.hard_limit && want > stats.hard_limit) {
+					++stats.hard_hits;
+					return nullptr;
+				}
+				if (stats.soft_limit && want > stats.soft_limit && !policy->soft_tripped_) {
+					if (!retry) {
+						// 返回空让 lua 做紧急全量回收，随后会以同样的参数重试
+						policy->soft_collecting_ = true;
+						return nullptr;
+					}
+					policy->soft_tripped_ = true;
+					soft_hit = true;
+				}
+			}
+
+			void* nptr = policy->Realloc(ptr, osize, nsize);
+			if (!nptr) {
+				return nullptr;
+			}
+			stats.live_bytes = stats.live_bytes - osize + nsize;
+			if (stats.live_bytes > stats.peak_bytes) {
+				stats.peak_bytes = stats.live_bytes;
+			}
+			if (ptr) {
+				++stats.reallocs;
+			} else {
+				++stats.allocs;
+			}
+			if (soft_hit) {
+				++stats.soft_hits;
+				if (policy->soft_handler_) {
+					// 分配函数内不能抛出异常
+					try {
+						policy->soft_handler_(stats);
+					} catch (...) {}
+				}
+			}
+			return nptr;
+		}
+
+	protected:
+		// ptr 为空时分配 nsize 字节；否则调整大小并保留前 min(osize, nsize) 字节
+		// 失败时返回 nullptr 且不能改动原内存；lua 假定缩小（nsize <= osize）不会失败
+		virtual void* Realloc(void* ptr, std::size_t osize, std::size_t nsize) = 0;
+		virtual void Free(void* ptr, std::size_t osize) = 0;
+
+	private:
+		Stats stats_{};
+		bool soft_tripped_ = false;
+		bool soft_collecting_ = false;
+		SoftLimitHandler soft_handler_;
+	};
+
+	// LuaMix.MemoryStats()：返回内存统计表，状态机未使用 AllocPolicy 时只有 live_bytes 与 external_bytes
+	// live_bytes 只含lua分配的内存，external_bytes 为记账的外部内存
+	inline int MemoryStats(lua_State* L) {
+		auto policy = AllocPolicy::Find(L);
+		std::size_t external = ExternalBytes(L);
+		if (!policy) {
+			auto total = static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+			lua_createtable(L, 0, 2);
+			lua_pushinteger(L, static_cast<lua_Integer>(total - external));
+			lua_setfield(L, -2, "live_bytes");
+			lua_pushinteger(L, static_cast<lua_Integer>(external));
+			lua_setfield(L, -2, "external_bytes");
+			return 1;
+		}
+		auto& stats = policy->GetStats();
+		const std::pair<const char*, std::size_t> fields[] = {
+			{ "live_bytes", stats.live_bytes },
+			{ "peak_bytes", stats.peak_bytes },
+			{ "allocs", stats.allocs },
+			{ "frees", stats.frees },
+			{ "reallocs", stats.reallocs },
+			{ "soft_limit", stats.soft_limit },
+			{ "hard_limit", stats.hard_limit },
+			{ "soft_hits", stats.soft_hits },
+			{ "hard_hits", stats.hard_hits },
+			{ "external_bytes", external },
+		};
+		// 先取完全部数值再建表，建表本身的分配不会混入结果
+		lua_createtable(L, 0, static_cast<int>(std::size(fields)));
+		for (auto& field : fields) {
+			lua_pushinteger(L, static_cast<lua_Integer>(field.second));
+			lua_setfield(L, -2, field.first);
+		}
+		return 1;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 默认策略，与 luaL_newstate 相同，直接使用 realloc/free
+	class DefaultAlloc : public AllocPolicy {
+	protected:
+		void* Realloc(void* ptr, std::size_t osize, std::size_t nsize) override {
+			return std::realloc(ptr, nsize);
+		}
+
+		void Free(void* ptr, std::size_t osize) override {
+			std::free(ptr);
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	/* 按大小分级的池分配：
+	 * 不超过 kMaxBlock 的请求按 kGranularity 向上取整到对应级别，从该级别的空闲链表取块，
+	 * 链表为空时从整页中切分；页只在策略析构时归还系统。
+	 * lua 释放和调整大小时总会给出原大小，因此块上不需要额外的头部。
+	 * 超过 kMaxBlock 的请求直接转给 realloc/free。
+	*/
+	class PoolAlloc : public AllocPolicy {
+	public:
+		static constexpr std::size_t kGranularity = 16;
+		static constexpr std::size_t kMaxBlock = 512;
+		static constexpr std::size_t kClassCount = kMaxBlock / kGranularity;
+		static constexpr std::size_t kPageSize = 64 * 1024;
+
+		struct ClassStats {
+			std::size_t block_size;		// 块大小
+			std::size_t live_blocks;	// 当前使用中的块数
+			std::size_t free_blocks;	// 空闲链表中的块数
+			std::size_t allocs;			// 累计分配次数
+		};
+
+	public:
+		PoolAlloc() = default;
+		PoolAlloc(const PoolAlloc&) = delete;
+		PoolAlloc& operator = (const PoolAlloc&) = delete;
+
+		~PoolAlloc() override {
+			for (auto page : pages_) {
+				std::free(page);
+			}
+			for (auto block : adopted_) {
+				std::free(block);
+			}
+		}
+
+	public:
+		// 级别 index 对应的块大小为 (index + 1) * kGranularity
+		ClassStats GetClassStats(std::size_t index) const {
+			auto& sc = classes_[index];
+			return { (index + 1) * kGranularity, sc.live, sc.free, sc.allocs };
+		}
+
+		// 大块（直接使用 realloc/free）的存活数量
+		std::size_t GetLargeBlocks() const {
+			return large_blocks_;
+		}
+
+		// 已向系统申请的页内存字节数
+		std::size_t GetPageBytes() const {
+			return pages_.size() * kPageSize;
+		}
+
+	protected:
+		void* Realloc(void* ptr, std::size_t osize, std::size_t nsize) override {
+			if (!ptr) {
+				return allocate(nsize);
+			}
+			bool opooled = osize <= kMaxBlock;
+			bool npooled = nsize <= kMaxBlock;
+			if (!opooled && !npooled) {
+				void* nptr = std::realloc(ptr, nsize);
+				return (nptr || nsize > osize) ? nptr : ptr;
+			}
+			if (opooled && npooled && classOf(osize) == classOf(nsize)) {
+				return ptr;
+			}
+			void* nptr = allocate(nsize);
+			if (nptr) {
+				std::memcpy(nptr, ptr, (std::min)(osize, nsize));
+				Free(ptr, osize);
+			} else if (nsize <= osize) {
+				nptr = shrinkInPlace(ptr, osize, nsize);
+			}
+			return nptr;
+		}
+
+		void Free(void* ptr, std::size_t osize) override {
+			if (osize > kMaxBlock) {
+				std::free(ptr);
+				--large_blocks_;
+				return;
+			}
+			auto& sc = classes_[classOf(osize)];
+			auto block = static_cast<FreeBlock*>(ptr);
+			block->next = sc.head;
+			sc.head = block;
+			--sc.live;
+			++sc.free;
+		}
+
+	private:
+		struct FreeBlock {
+			FreeBlock* next;
+		};
+
+		struct SizeClass {
+			FreeBlock* head = nullptr;
+			std::size_t live = 0;
+			std::size_t free = 0;
+			std::size_t allocs = 0;
+		};
+
+		static std::size_t classOf(std::size_t size) {
+			return (size + kGranularity - 1) / kGranularity - 1;
+		}
+
+		void* allocate(std::size_t size) {
+			if (size > kMaxBlock) {
+				void* ptr = std::malloc(size);
+				if (ptr) {
+					++large_blocks_;
+				}
+				return ptr;
+			}
+			std::size_t index = classOf(size);
+			auto& sc = classes_[index];
+			if (!sc.head && !refill(sc, (index + 1) * kGranularity)) {
+				return nullptr;
+			}
+			auto block = sc.head;
+			sc.head = block->next;
+			--sc.free;
+			++sc.live;
+			++sc.allocs;
+			return block;
+		}
+
+		/* 缩小时无法取得新块，原块留在原处：
+		 * 之后 lua 会以 nsize 释放它，所以把它改记到 nsize 的级别，原块不小于该级别的块大小，放入其空闲链表是安全的；
+		 * 大块原本由 malloc 分配，改记后还要登记下来，在析构时与页一起归还系统
+		*/
+		void* shrinkInPlace(void* ptr, std::size_t osize, std::size_t nsize) {
+			auto& nc = classes_[classOf(nsize)];
+			if (osize > kMaxBlock) {
+				// 分配函数内不能抛出异常，登记失败时该块只在析构时无法归还
+				try {
+					adopted_.push_back(ptr);
+				} catch (...) {}
+				--large_blocks_;
+			} else {
+				--classes_[classOf(osize)].live;
+			}
+			++nc.live;
+			++nc.allocs;
+			return ptr;
+		}
+
+		// 申请一整页切分给该级别
+		bool refill(SizeClass& sc, std::size_t block_size) {
+			auto page = static_cast<char*>(std::malloc(kPageSize));
+			if (!page) {
+				return false;
+			}
+			// 分配函数内不能抛出异常
+			try {
+				pages_.push_back(page);
+			} catch (...) {
+				std::free(page);
+				return false;
+			}
+			std::size_t count = kPageSize / block_size;
+			for (std::size_t i = count; i > 0; --i) {
+				auto block = reinterpret_cast<FreeBlock*>(page + (i - 1) * block_size);
+				block->next = sc.head;
+				sc.head = block;
+			}
+			sc.free += count;
+			return true;
+		}
+
+	private:
+		std::array<SizeClass, kClassCount> classes_;
+		std::vector<void*> pages_;
+		std::vector<void*> adopted_;	// 缩小时改记到池中的大块
+		std::size_t large_blocks_ = 0;
+	};
+}
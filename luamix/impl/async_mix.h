@@ -0,0 +1,243 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include "type_mix.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 等待恢复的协程队列，由 Scheduler 创建并以 LUAMIX_KEY_SCHEDULER 登记在registry中：
+	 * 异步操作在任意线程上完成时把等待它的协程放入队列，Scheduler 在脚本线程上取出并恢复
+	*/
+	class AsyncQueue : public std::enable_shared_from_this<AsyncQueue> {
+	public:
+		// 放入完成的协程，可以在任意线程上调用；队列关闭后什么也不做
+		void Post(lua_State* co) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			if (!closed_) {
+				posted_.push_back(co);
+				cond_.notify_one();
+			}
+		}
+
+		// 取出所有完成的协程，追加到 out
+		void Drain(std::vector<lua_State*>& out) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			out.insert(out.end(), posted_.begin(), posted_.end());
+			posted_.clear();
+		}
+
+		// 等待到有协程完成或超时，返回是否有完成的协程
+		bool Wait(std::chrono::milliseconds timeout) {
+			std::unique_lock<std::mutex> _lock(mutex_);
+			return cond_.wait_for(_lock, timeout, [this] { return closed_ || !posted_.empty(); }) && !posted_.empty();
+		}
+
+		void Close() {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			closed_ = true;
+			posted_.clear();
+			cond_.notify_all();
+		}
+
+	public:
+		// 以下只在脚本线程上访问
+		std::unordered_set<lua_State*> tasks;		// Scheduler 运行的协程，只有它们可以等待异步操作
+		lua_State* suspending = nullptr;			// 因等待异步操作而让出的协程，与普通的 coroutine.yield 区分
+
+	private:
+		std::mutex mutex_;
+		std::condition_variable cond_;
+		std::vector<lua_State*> posted_;
+		bool closed_ = false;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// 异步操作的状态，完成一方与等待的协程共享
+	class AsyncState {
+	public:
+		using Pusher = std::function<int(lua_State*)>;
+
+		// 完成操作，只有第一次有效；可以在任意线程上调用
+		void Complete(Pusher pusher, std::string error, bool failed) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			if (done_) {
+				return;
+			}
+			pusher_ = std::move(pusher);
+			error_ = std::move(error);
+			failed_ = failed;
+			done_ = true;
+			if (queue_) {
+				queue_->Post(co_);
+			}
+		}
+
+		bool IsDone() {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			return done_;
+		}
+
+		// 登记等待的协程，已经完成时返回 false
+		bool Suspend(AsyncQueue& queue, lua_State* co) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			if (done_) {
+				return false;
+			}
+			queue_ = queue.shared_from_this();
+			co_ = co;
+			return true;
+		}
+
+		// 完成之后在脚本线程上调用：压入结果，或者以错误信息抛出脚本错误
+		static int Resume(lua_State* L, int status, lua_KContext ctx);
+
+	private:
+		std::mutex mutex_;
+		bool done_ = false;
+		bool failed_ = false;
+		Pusher pusher_;
+		std::string error_;
+		std::shared_ptr<AsyncQueue> queue_;
+		lua_State* co_ = nullptr;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	/* 异步结果，导出的C++函数返回 Async 时，调用它的 Scheduler 任务协程被挂起，
+	 * 直到 Resolve/Reject 之后由 Scheduler::Poll 恢复，Resolve 的值成为函数在脚本中的返回值。
+	 * 返回前已经完成时不挂起；不在 Scheduler 任务中调用时引发脚本错误。
+	 * Async 可以复制，所有副本共享同一个操作，Resolve/Reject 可以在任意线程上调用；
+	 * C++中的最后一个副本析构时操作仍未完成，则以 LUAMIX_ASYNC_DROPPED 拒绝，等待它的任务不会永远挂起
+	*/
+	inline constexpr const char* LUAMIX_ASYNC_DROPPED = "async operation dropped without being resolved";
+
+	class Async {
+	public:
+		Async()
+			: state_(std::make_shared<AsyncState>())
+			, owner_(std::make_shared<Owner>(state_))
+		{}
+
+	public:
+		template <typename... Ts>
+		void Resolve(Ts... values) const {
+			state_->Complete([values = std::make_tuple(std::move(values)...)](lua_State* L) {
+				std::apply([L](const auto&... value) {
+					(..., Push(L, value));
+					}, values);
+				return static_cast<int>(sizeof...(Ts));
+			}, std::string(), false);
+		}
+
+		void Reject(std::string error) const {
+			state_->Complete(nullptr, std::move(error), true);
+		}
+
+		bool IsDone() const {
+			return state_->IsDone();
+		}
+
+		const std::shared_ptr<AsyncState>& GetState() const {
+			return state_;
+		}
+
+	public:
+		static constexpr const char* Meta = "LuaMix.Async";
+
+	private:
+		// C++中的副本共享的持有者，不随压入栈中的副本存活
+		struct Owner {
+			std::shared_ptr<AsyncState> state;
+
+			explicit Owner(std::shared_ptr<AsyncState> s)
+				: state(std::move(s))
+			{}
+
+			~Owner() {
+				state->Complete(nullptr, LUAMIX_ASYNC_DROPPED, true);
+			}
+		};
+
+		// 栈上的副本，不计入持有者
+		explicit Async(std::shared_ptr<AsyncState> state)
+			: state_(std::move(state))
+		{}
+
+		friend struct _type_mix_spec<Async>;
+
+	private:
+		std::shared_ptr<AsyncState> state_;
+		std::shared_ptr<Owner> owner_;
+	};
+
+	template <typename T>
+	inline constexpr bool _is_async_v = std::is_same_v<std::decay_t<T>, Async>;
+
+	//////////////////////////////////////////////////////////////////////////
+	// 特化 Async，以完全用户数据持有共享状态
+	template <>
+	struct _type_mix_spec<Async> {
+		using ArgHoldType = Async;
+
+		static void Push(lua_State* L, const Async& value) {
+			::new (lua_newuserdata(L, sizeof(Async))) Async(value.GetState());
+			if (luaL_newmetatable(L, Async::Meta)) {
+				lua_pushcfunction(L, &destruct);
+				lua_setfield(L, -2, "__gc");
+			}
+			lua_setmetatable(L, -2);
+		}
+
+		template <bool CHECK = false>
+		static Async Fetch(lua_State* L, int index) {
+			return *static_cast<Async*>(luaL_checkudata(L, index, Async::Meta));
+		}
+
+	private:
+		static int destruct(lua_State* L) {
+			static_cast<Async*>(lua_touserdata(L, 1))->~Async();
+			return 0;
+		}
+	};
+
+	inline int AsyncState::Resume(lua_State* L, int status, lua_KContext ctx) {
+		auto& state = *static_cast<Async*>(lua_touserdata(L, static_cast<int>(ctx)))->GetState();
+		if (state.failed_) {
+			lua_pushlstring(L, state.error_.data(), state.error_.size());
+			return lua_error(L);
+		}
+		return state.pusher_ ? state.pusher_(L) : 0;
+	}
+
+	/* 导出函数返回 Async 后由函数代理调用，index 为栈上的 Async：
+	 * 已经完成时直接返回结果，否则登记到 Scheduler 的队列并让出当前协程
+	*/
+	inline int AsyncAwait(lua_State* L, int index) {
+		auto state = static_cast<Async*>(lua_touserdata(L, index))->GetState().get();
+		lua_rawgetp(L, LUA_REGISTRYINDEX, LUAMIX_KEY_SCHEDULER);
+		auto queue = static_cast<AsyncQueue*>(lua_touserdata(L, -1));
+		lua_pop(L, 1);
+		if (!state->IsDone()) {
+			if (!queue || !queue->tasks.count(L)) {
+				return luaL_error(L, "async function must be called in a scheduler task");
+			}
+			// 不能让出时（如在 table.sort 的比较函数中）先报错，不登记等待的协程，也不留下挂起标记
+			if (!lua_isyieldable(L)) {
+				return luaL_error(L, "async function cannot yield here (called across a C-call boundary)");
+			}
+			if (state->Suspend(*queue, L)) {
+				queue->suspending = L;
+				return lua_yieldk(L, 0, index, &AsyncState::Resume);
+			}
+		}
+		return AsyncState::Resume(L, LUA_OK, index);
+	}
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iterator>
+#include <filesystem>
+#include <unordered_map>
+
+#include "mix_util.h"
+#include "file_mapping.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 字节码缓存：
+	 * 源文件编译后以对齐格式（LUA_DUMPALIGNED）转储到缓存目录，之后直接映射缓存文件并以 'F' 模式加载，
+	 * 函数原型的指令与行号数组直接引用映射内存，只有常量、字符串与原型本身需要分配。
+	 * 缓存文件以源文件路径的哈希命名，文件头记录源文件的修改时间、大小与内容哈希：
+	 * 加载时只取源文件的修改时间与大小，都相同即命中；只有修改时间不同时才读取源文件比对内容哈希，其余情况重新编译。
+	 * 加载成功的映射直到缓存对象析构才解除，因此缓存必须比从中加载过函数的状态机活得更久（加载失败的映射立即解除）；
+	 * 同一个缓存对象可以被多个状态机（包括不同线程上的）共享。
+	*/
+	class BytecodeCache {
+	public:
+		struct Stats {
+			std::size_t hits;			// 从映射加载的次数
+			std::size_t misses;			// 编译源文件的次数
+			std::size_t writes;			// 写入缓存文件的次数
+			std::size_t mapped_bytes;	// 当前映射的字节数
+		};
+
+	public:
+		explicit BytecodeCache(std::string dir)
+			: dir_(std::move(dir))
+		{
+			std::error_code ec;
+			std::filesystem::create_directories(dir_, ec);
+		}
+
+		BytecodeCache(const BytecodeCache&) = delete;
+		BytecodeCache& operator = (const BytecodeCache&) = delete;
+
+	public:
+		Stats GetStats() const {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			return stats_;
+		}
+
+		// 与 luaL_loadfile 相同：成功时压入函数并返回 LUA_OK，否则压入错误信息并返回错误码
+		int Load(lua_State* L, const char* path) {
+			SourceKey key;
+			if (!statKey(path, key)) {
+				// 读不到源文件，交给 luaL_loadfile 处理（包括报错）
+				return luaL_loadfile(L, path);
+			}
+
+			std::string chunkname = std::string("@") + path;
+			if (auto mapping = find(path, key)) {
+				if (LUA_OK == luaL_loadbufferx(L, mapping->Data() + kHeaderSize, mapping->Size() - kHeaderSize, chunkname.c_str(), "bF")) {
+					std::lock_guard<std::mutex> _lock(mutex_);
+					++stats_.hits;
+					return LUA_OK;
+				}
+				// 缓存文件损坏或者lua版本不符，重新编译覆盖；加载失败没有留下引用映射的函数，先解除映射，覆盖失败时下次重新映射也不会累积
+				lua_pop(L, 1);
+				drop(path, mapping);
+			}
+
+			if (!hashSource(path, key)) {
+				// 源文件本身就是字节码，或者读取失败
+				return luaL_loadfile(L, path);
+			}
+			int status = luaL_loadfilex(L, path, "t");
+			if (LUA_OK != status) {
+				return status;
+			}
+			std::string dump(kHeaderSize, '\0');
+			key.Write(&dump[0]);
+			lua_dump(L, &writer, &dump, LUA_DUMPALIGNED);
+			bool written = write(cacheFile(path), dump);
+
+			std::lock_guard<std::mutex> _lock(mutex_);
+			++stats_.misses;
+			if (written) {
+				++stats_.writes;
+			}
+			return LUA_OK;
+		}
+
+		/* 替换 package.searchers 中的lua文件搜索器，使 require 的lua模块也经过缓存：
+		 * 搜索路径仍为 package.path，找到的文件通过 Load 加载；
+		 * index 为lua文件搜索器在 searchers 中的位置，其前面插入了其他搜索器（如脚本归档）时需要指定
+		*/
+		static void InstallSearcher(lua_State* L, BytecodeCache* cache, lua_Integer index = 2) {
+			StackGuard _guard(L);
+			luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);	// :loaded
+			if (LUA_TTABLE != lua_getfield(L, -1, LUA_LOADLIBNAME)) {	// :loaded, package
+				return;
+			}
+			if (LUA_TTABLE != lua_getfield(L, -1, "searchers")) {		// :loaded, package, searchers
+				return;
+			}
+			lua_pushlightuserdata(L, cache);					// :loaded, package, searchers, cache
+			lua_pushvalue(L, -3);								// :loaded, package, searchers, cache, package
+			lua_pushcclosure(L, &searcher, 2);					// :loaded, package, searchers, searcher
+			lua_rawseti(L, -2, index);							// :loaded, package, searchers
+		}
+
+	private:
+		static constexpr std::size_t kHeaderSize = 32;	// 保证其后的转储从对齐的地址开始
+		static constexpr char kMagic[8] = { 'L', 'M', 'X', 'B', 'C', '5', '3', '\0' };
+
+		// 缓存文件头，同时作为源文件的版本标识
+		struct SourceKey {
+			std::uint64_t mtime;
+			std::uint64_t size;
+			std::uint64_t hash;
+
+			// 修改时间与大小相同即视为同一个源文件，不比对内容
+			bool SameStat(const SourceKey& other) const {
+				return mtime == other.mtime && size == other.size;
+			}
+
+			void Write(char* header) const {
+				std::memcpy(header, kMagic, sizeof(kMagic));
+				std::memcpy(header + 8, &mtime, 8);
+				std::memcpy(header + 16, &size, 8);
+				std::memcpy(header + 24, &hash, 8);
+			}
+
+			bool Read(const char* header) {
+				if (std::memcmp(header, kMagic, sizeof(kMagic))) {
+					return false;
+				}
+				std::memcpy(&mtime, header + 8, 8);
+				std::memcpy(&size, header + 16, 8);
+				std::memcpy(&hash, header + 24, 8);
+				return true;
+			}
+		};
+
+		struct Entry {
+			SourceKey key;
+			std::shared_ptr<const FileMapping> mapping;
+		};
+
+		// 只取修改时间与大小，不读取内容
+		static bool statKey(const char* path, SourceKey& key) {
+			std::error_code ec;
+			auto mtime = std::filesystem::last_write_time(path, ec);
+			if (ec) {
+				return false;
+			}
+			auto size = std::filesystem::file_size(path, ec);
+			if (ec) {
+				return false;
+			}
+			key.mtime = static_cast<std::uint64_t>(mtime.time_since_epoch().count());
+			key.size = static_cast<std::uint64_t>(size);
+			key.hash = 0;
+			return true;
+		}
+
+		// 读取源文件计算内容哈希，源文件是字节码或者读取失败时返回 false
+		static bool hashSource(const char* path, SourceKey& key) {
+			std::ifstream ifs(path, std::ios::binary);
+			std::string source((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+			if (!ifs.good() && !ifs.eof()) {
+				return false;
+			}
+			if (!source.empty() && source[0] == LUA_SIGNATURE[0]) {
+				return false;
+			}
+			key.size = source.size();
+			key.hash = HashBytes(source.data(), source.size());
+			return true;
+		}
+
+		std::string cacheFile(const char* path) const {
+			static const char digits[] = "0123456789abcdef";
+			std::uint64_t hash = HashBytes(path, std::strlen(path));
+			std::string name(16, '0');
+			for (int i = 15; i >= 0; --i, hash >>= 4) {
+				name[i] = digits[hash & 0xf];
+			}
+			return dir_ + "/" + name + ".luac";
+		}
+
+		/* 查找与源文件匹配的映射，内存中没有时尝试映射缓存文件：
+		 * 缓存文件头与源文件只有修改时间不同（如重新检出）时，读取源文件比对内容哈希
+		*/
+		std::shared_ptr<const FileMapping> find(const char* path, SourceKey& key) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			auto it = entries_.find(path);
+			if (it != entries_.end() && it->second.key.SameStat(key)) {
+				return it->second.mapping;
+			}
+			auto mapping = std::make_shared<FileMapping>();
+			if (!mapping->Open(cacheFile(path))) {
+				return nullptr;
+			}
+			SourceKey cached;
+			if (mapping->Size() <= kHeaderSize || !cached.Read(mapping->Data()) || cached.size != key.size) {
+				return nullptr;
+			}
+			if (cached.mtime != key.mtime && (!hashSource(path, key) || key.hash != cached.hash)) {
+				return nullptr;
+			}
+			key.hash = cached.hash;
+			// 旧的映射可能仍被状态机中的函数引用，保留到缓存析构
+			stats_.mapped_bytes += mapping->Size();
+			mappings_.push_back(mapping);
+			entries_[path] = { key, mapping };
+			return mapping;
+		}
+
+		// 解除加载失败的映射；其他线程正在使用的映射在其加载结束后才解除
+		void drop(const char* path, const std::shared_ptr<const FileMapping>& mapping) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			auto it = entries_.find(path);
+			if (it != entries_.end() && it->second.mapping == mapping) {
+				entries_.erase(it);
+			}
+			for (auto m = mappings_.begin(); m != mappings_.end(); ++m) {
+				if (*m == mapping) {
+					stats_.mapped_bytes -= mapping->Size();
+					mappings_.erase(m);
+					break;
+				}
+			}
+		}
+
+		static int writer(lua_State* L, const void* p, std::size_t sz, void* ud) {
+			static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+			return 0;
+		}
+
+		// 先写临时文件再改名，其他进程或状态机不会读到写了一半的缓存
+		static bool write(const std::string& file, const std::string& dump) {
+			auto stamp = static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+			std::string tmp = file + "." + std::to_string(stamp ^ reinterpret_cast<std::uintptr_t>(&dump)) + ".tmp";
+			{
+				std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+				if (!ofs.write(dump.data(), dump.size())) {
+					return false;
+				}
+			}
+			std::error_code ec;
+			std::filesystem::rename(tmp, file, ec);
+			if (ec) {
+				std::filesystem::remove(tmp, ec);
+				return false;
+			}
+			return true;
+		}
+
+		// package.searchers 中的lua文件搜索器：upvalue(1) 为缓存，upvalue(2) 为 package 表
+		static int searcher(lua_State* L) {
+			auto cache = static_cast<BytecodeCache*>(lua_touserdata(L, lua_upvalueindex(1)));
+			const char* name = luaL_checkstring(L, 1);
+			lua_getfield(L, lua_upvalueindex(2), "searchpath");	// :name, searchpath
+			lua_pushvalue(L, 1);								// :name, searchpath, name
+			lua_getfield(L, lua_upvalueindex(2), "path");		// :name, searchpath, name, path
+			if (!lua_isstring(L, -1)) {
+				return luaL_error(L, "'package.path' must be a string");
+			}
+			lua_call(L, 2, 2);									// :name, filename|nil, err
+			if (lua_isnil(L, -2)) {
+				return 1;	// 返回搜索失败的说明
+			}
+			const char* filename = lua_tostring(L, -2);
+			if (LUA_OK != cache->Load(L, filename)) {
+				return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, filename, lua_tostring(L, -1));
+			}
+			lua_pushstring(L, filename);						// :name, filename, err, fn, filename
+			return 2;
+		}
+
+	private:
+		const std::string dir_;
+		mutable std::mutex mutex_;
+		std::unordered_map<std::string, Entry> entries_;
+		std::vector<std::shared_ptr<const FileMapping>> mappings_;
+		Stats stats_{};
+	};
+}
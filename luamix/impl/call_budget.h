@@ -0,0 +1,145 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "mix_util.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 脚本调用的预算，指令数与时间都为0时不限制：
+	 * 以 lua_sethook 的计数钩子每执行 granularity 条虚拟机指令检查一次，
+	 * 粒度越小越及时，开销也越大；时间预算同样在钩子中检查，所以精度也取决于粒度
+	*/
+	struct CallBudget {
+		std::uint64_t instructions = 0;				// 最多执行的指令数，按 granularity 取整
+		std::chrono::microseconds time{ 0 };		// 最长运行时间
+		int granularity = 1000;						// 钩子的计数间隔
+
+		explicit operator bool() const {
+			return instructions != 0 || time.count() != 0;
+		}
+
+		static CallBudget Instructions(std::uint64_t n, int granularity = 1000) {
+			return CallBudget{ n, std::chrono::microseconds(0), granularity };
+		}
+
+		static CallBudget Time(std::chrono::microseconds t, int granularity = 1000) {
+			return CallBudget{ 0, t, granularity };
+		}
+	};
+
+	inline constexpr const char* LUAMIX_BUDGET_EXCEEDED = "script call exceeded its budget";
+
+	/* 在作用域内以预算限制 L 上的脚本执行：
+	 * 构造时安装计数钩子，析构时恢复原来的钩子，所以不带预算的调用没有任何额外开销。
+	 * 预算用完时，yieldable 且 L 当前可以让出时让出 L（Preempted 为 true），否则引发脚本错误；
+	 * 脚本用 pcall 捕获错误后继续运行，会在下一次检查时再次出错。
+	 * 调用过程中创建的协程继承钩子，执行的指令计入同一个预算。
+	 * 当前预算以 host 登记在registry中，L 是挂起的协程时应传入其它线程（如主线程），避免在挂起的协程上压栈
+	*/
+	class BudgetScope {
+	public:
+		BudgetScope(lua_State* L, const CallBudget& budget, bool yieldable = false, lua_State* host = nullptr)
+			: state_(L)
+			, host_(host ? host : L)
+			, budget_(budget)
+			, yieldable_(yieldable)
+		{
+			if (!budget_) {
+				return;
+			}
+			if (budget_.granularity <= 0) {
+				budget_.granularity = 1;
+			}
+			if (budget_.time.count()) {
+				deadline_ = std::chrono::steady_clock::now() + budget_.time;
+			}
+			lua_rawgetp(host_, LUA_REGISTRYINDEX, LUAMIX_KEY_BUDGET);
+			prev_ = static_cast<BudgetScope*>(lua_touserdata(host_, -1));
+			lua_pop(host_, 1);
+			lua_pushlightuserdata(host_, this);
+			lua_rawsetp(host_, LUA_REGISTRYINDEX, LUAMIX_KEY_BUDGET);
+			prev_hook_ = lua_gethook(L);
+			prev_mask_ = lua_gethookmask(L);
+			prev_count_ = lua_gethookcount(L);
+			lua_sethook(L, &hook, LUA_MASKCOUNT, budget_.granularity);
+			active_ = true;
+		}
+
+		BudgetScope(const BudgetScope&) = delete;
+		BudgetScope& operator = (const BudgetScope&) = delete;
+
+		~BudgetScope() {
+			if (!active_) {
+				return;
+			}
+			lua_sethook(state_, prev_hook_, prev_mask_, prev_count_);
+			if (prev_) {
+				lua_pushlightuserdata(host_, prev_);
+			} else {
+				lua_pushnil(host_);
+			}
+			lua_rawsetp(host_, LUA_REGISTRYINDEX, LUAMIX_KEY_BUDGET);
+		}
+
+	public:
+		// 预算是否已经用完
+		bool Exhausted() const {
+			return exhausted_;
+		}
+
+		// 是否因预算用完而让出了协程
+		bool Preempted() const {
+			return preempted_;
+		}
+
+		// 已经执行的指令数，按 granularity 取整
+		std::uint64_t GetUsed() const {
+			return used_;
+		}
+
+	private:
+		static void hook(lua_State* L, lua_Debug*) {
+			lua_rawgetp(L, LUA_REGISTRYINDEX, LUAMIX_KEY_BUDGET);
+			auto scope = static_cast<BudgetScope*>(lua_touserdata(L, -1));
+			lua_pop(L, 1);
+			if (!scope) {
+				lua_sethook(L, nullptr, 0, 0);		// 预算结束后仍然运行的协程
+				return;
+			}
+			scope->used_ += static_cast<std::uint64_t>(scope->budget_.granularity);
+			if (!scope->exhausted_) {
+				bool over = scope->budget_.instructions && scope->used_ >= scope->budget_.instructions;
+				if (!over && scope->budget_.time.count()) {
+					over = std::chrono::steady_clock::now() >= scope->deadline_;
+				}
+				if (!over) {
+					return;
+				}
+				scope->exhausted_ = true;
+			}
+			if (scope->yieldable_ && L == scope->state_ && lua_isyieldable(L)) {	// 在脚本自己的协程中让出会被当作 coroutine.yield
+				scope->preempted_ = true;
+				lua_yield(L, 0);
+				return;
+			}
+			luaL_error(L, LUAMIX_BUDGET_EXCEEDED);
+		}
+
+	private:
+		lua_State* state_;
+		lua_State* host_;
+		CallBudget budget_;
+		bool yieldable_;
+		bool active_ = false;
+		bool exhausted_ = false;
+		bool preempted_ = false;
+		std::uint64_t used_ = 0;
+		std::chrono::steady_clock::time_point deadline_;
+		BudgetScope* prev_ = nullptr;
+		lua_Hook prev_hook_ = nullptr;
+		int prev_mask_ = 0;
+		int prev_count_ = 0;
+	};
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "mix_util.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 脚本调用路径的引用缓存，以 "a.b.c" 形式的路径为键：
+	 * 解析路径时按 MakeScriptValRef 的规则逐级取值，记下每一级的键、值的类型与地址，键与值保存在一张表中防止被回收；
+	 * 命中时逐级 rawget 比对类型与地址，全部相同才使用缓存的引用，省去字符串解析、ref与unref。
+	 * 脚本重新赋值了路径上的任何一级时比对失败，按未命中重新解析，因此缓存对调用结果没有影响；
+	 * 经过 __index 取得的级别或没有地址的值（数字、字符串等）比对总会失败，这样的路径每次都重新解析。
+	 * 只缓存非nil的值，路径尚未定义时每次调用都重新解析。
+	*/
+	class CallCache {
+	public:
+		struct Stats {
+			std::size_t hits;			// 命中次数
+			std::size_t misses;			// 解析路径的次数
+			std::size_t invalidations;	// 失效的路径数，包括比对失败的
+		};
+
+	public:
+		CallCache() = default;
+		CallCache(const CallCache&) = delete;
+		CallCache& operator = (const CallCache&) = delete;
+
+	public:
+		const Stats& GetStats() const {
+			return stats_;
+		}
+
+		std::size_t GetSize() const {
+			return entries_.size();
+		}
+
+		// 返回 path 处的值的registry引用，引用归缓存所有，调用者不能释放
+		int Get(lua_State* L, const char* path) {
+			auto it = entries_.find(path);
+			if (it != entries_.end()) {
+				if (validate(L, *it->second)) {
+					++stats_.hits;
+					return it->second->ref;
+				}
+				release(L, *it->second);
+				entries_.erase(it);
+				++stats_.invalidations;
+			}
+			++stats_.misses;
+			auto entry = std::make_unique<Entry>(Entry{ path, LUA_REFNIL, LUA_NOREF });
+			if (!resolve(L, *entry)) {
+				return LUA_REFNIL;
+			}
+			int ref = entry->ref;
+			std::string_view key = entry->path;
+			entries_.emplace(key, std::move(entry));
+			return ref;
+		}
+
+		// 使 path 及以 "path." 开头的路径失效，只用于释放引用，不影响调用结果
+		void Invalidate(lua_State* L, std::string_view path) {
+			for (auto it = entries_.begin(); it != entries_.end();) {
+				std::string_view key = it->first;
+				if (key.substr(0, path.size()) == path && (key.size() == path.size() || key[path.size()] == '.')) {
+					release(L, *it->second);
+					it = entries_.erase(it);
+					++stats_.invalidations;
+				} else {
+					++it;
+				}
+			}
+		}
+
+		void Clear(lua_State* L) {
+			for (auto& [_, entry] : entries_) {
+				release(L, *entry);
+			}
+			stats_.invalidations += entries_.size();
+			entries_.clear();
+		}
+
+	private:
+		struct Level {
+			const void* pointer;
+			int type;
+		};
+
+		struct Entry {
+			std::string path;
+			int ref;					// 路径末端的值
+			int chain;					// { k1, v1, k2, v2, ... }，从全局表开始每一级的键与值，值保存在此防止记录的地址被回收复用
+			std::vector<Level> levels;	// 每一级值的地址与类型
+		};
+
+		static void release(lua_State* L, const Entry& entry) {
+			luaL_unref(L, LUA_REGISTRYINDEX, entry.ref);
+			luaL_unref(L, LUA_REGISTRYINDEX, entry.chain);
+		}
+
+		// 与 MakeScriptValRef 相同：从全局表开始逐级 lua_gettable，中间级别不是表或末端为nil时失败
+		static bool resolve(lua_State* L, Entry& entry) {
+			StackGuard _guard(L);
+			lua_newtable(L);									// :chain
+			lua_pushglobaltable(L);								// :chain, tb
+			const char* key = entry.path.c_str();
+			for (;;) {
+				const char* pos = std::strchr(key, '.');
+				if (!entry.levels.empty() && !lua_istable(L, -1)) {
+					return false;
+				}
+				if (pos) {
+					lua_pushlstring(L, key, pos - key);			// :chain, tb, k
+				} else {
+					lua_pushstring(L, key);
+				}
+				auto index = 2 * static_cast<lua_Integer>(entry.levels.size());
+				lua_pushvalue(L, -1);							// :chain, tb, k, k
+				lua_rawseti(L, -4, index + 1);					// :chain, tb, k
+				int type = lua_gettable(L, -2);					// :chain, tb, v
+				lua_remove(L, -2);								// :chain, v
+				if (LUA_TNIL == type) {
+					return false;
+				}
+				lua_pushvalue(L, -1);							// :chain, v, v
+				lua_rawseti(L, -3, index + 2);					// :chain, v
+				entry.levels.push_back(Level{ lua_topointer(L, -1), type });
+				if (!pos) {
+					break;
+				}
+				key = pos + 1;
+			}
+			entry.ref = luaL_ref(L, LUA_REGISTRYINDEX);			// :chain
+			entry.chain = luaL_ref(L, LUA_REGISTRYINDEX);		// :
+			return true;
+		}
+
+		// 从全局表开始逐级 rawget，与记录的类型和地址逐一比对；地址相同且对象未被回收，即为同一个对象
+		static bool validate(lua_State* L, const Entry& entry) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, entry.chain);		// :chain
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);	// :chain, tb
+			bool same = true;
+			lua_Integer i = -1;
+			for (auto& level : entry.levels) {
+				lua_rawgeti(L, -2, i += 2);						// :chain, tb, k
+				int type = lua_rawget(L, -2);					// :chain, tb, v
+				lua_replace(L, -2);								// :chain, v
+				const void* pointer = lua_topointer(L, -1);
+				if (type != level.type || !pointer || pointer != level.pointer) {
+					same = false;
+					break;
+				}
+			}
+			lua_pop(L, 2);
+			return same;
+		}
+
+	private:
+		std::unordered_map<std::string_view, std::unique_ptr<Entry>> entries_;
+		Stats stats_{};
+	};
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "mix_util.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 已编译代码块的LRU缓存，以脚本源码为键：
+	 * 编译出的函数以registry引用保存，每次执行通过 lua_clonefunction 取得共享原型的新闭包，
+	 * 新闭包有自己的 _ENV 上值，因此绑定环境不会影响上一次执行中创建的函数，也允许同一脚本嵌套执行。
+	 * 超出容量时淘汰最久未用的代码块；引用只在状态机存活时释放，状态机关闭后缓存不再访问lua。
+	*/
+	class ChunkCache {
+	public:
+		struct Stats {
+			std::size_t hits;		// 命中次数
+			std::size_t misses;		// 编译次数
+			std::size_t evictions;	// 淘汰次数
+		};
+
+	public:
+		explicit ChunkCache(std::size_t capacity = 64)
+			: capacity_(capacity)
+		{}
+
+		ChunkCache(const ChunkCache&) = delete;
+		ChunkCache& operator = (const ChunkCache&) = delete;
+
+	public:
+		const Stats& GetStats() const {
+			return stats_;
+		}
+
+		std::size_t GetSize() const {
+			return lru_.size();
+		}
+
+		std::size_t GetCapacity() const {
+			return capacity_;
+		}
+
+		// 调整容量，0 表示不缓存
+		void SetCapacity(lua_State* L, std::size_t capacity) {
+			capacity_ = capacity;
+			shrink(L, capacity_);
+		}
+
+		void Clear(lua_State* L) {
+			shrink(L, 0);
+		}
+
+		/* 与 luaL_loadstring 相同，压入 script 编译出的函数并返回 LUA_OK，失败时压入错误信息：
+		 * 命中时不编译，只创建共享原型的新闭包，其 _ENV 为全局表
+		*/
+		int Load(lua_State* L, const std::string& script) {
+			if (auto it = index_.find(script); it != index_.end()) {
+				++stats_.hits;
+				lru_.splice(lru_.begin(), lru_, it->second);
+				lua_rawgeti(L, LUA_REGISTRYINDEX, it->second->ref);	// :proto_fn
+				lua_clonefunction(L, -1);							// :proto_fn, fn
+				lua_remove(L, -2);									// :fn
+				return LUA_OK;
+			}
+
+			++stats_.misses;
+			int status = luaL_loadbuffer(L, script.data(), script.size(), script.c_str());
+			if (LUA_OK != status || capacity_ == 0) {
+				return status;
+			}
+			shrink(L, capacity_ - 1);
+			// 缓存的函数只作为原型，执行的总是其新闭包，环境绑定不会留在缓存中
+			lua_clonefunction(L, -1);							// :proto_fn, fn
+			lua_insert(L, -2);									// :fn, proto_fn
+			lru_.push_front({ script, luaL_ref(L, LUA_REGISTRYINDEX) });	// :fn
+			index_.emplace(lru_.front().source, lru_.begin());
+			return LUA_OK;
+		}
+
+		/* 加载 script 并以 lua_pcall(L, 0, LUA_MULTRET, msgh) 执行，返回值留在栈上：
+		 * env 为环境表的栈索引，0 表示使用全局表
+		*/
+		int DoString(lua_State* L, const std::string& script, int env = 0, int msgh = 0) {
+			env = env ? lua_absindex(L, env) : 0;
+			msgh = msgh ? lua_absindex(L, msgh) : 0;
+			int status = Load(L, script);
+			if (LUA_OK != status) {
+				return status;
+			}
+			if (env) {
+				lua_pushvalue(L, env);
+				if (!lua_setupvalue(L, -2, 1)) {
+					lua_pop(L, 1);
+				}
+			}
+			return lua_pcall(L, 0, LUA_MULTRET, msgh);
+		}
+
+	private:
+		struct Entry {
+			std::string source;
+			int ref;
+		};
+
+		void shrink(lua_State* L, std::size_t size) {
+			while (lru_.size() > size) {
+				auto& entry = lru_.back();
+				index_.erase(entry.source);
+				luaL_unref(L, LUA_REGISTRYINDEX, entry.ref);
+				lru_.pop_back();
+				++stats_.evictions;
+			}
+		}
+
+	private:
+		std::size_t capacity_;
+		std::list<Entry> lru_;
+		std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+		Stats stats_{};
+	};
+}
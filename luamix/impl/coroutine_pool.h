@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+
+#include "mix_util.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 可复用的lua线程池：
+	 * 线程创建时以 lua_reservethread 预留栈与CallInfo链，之后GC与出错恢复都不会把它们收缩到预留大小以下；
+	 * Release 时以 lua_resetthread 复位线程（关闭upvalue、清空栈、清除钩子、回到初始状态），不释放任何内存，
+	 * 再次 Acquire 只是从空闲列表中取出。空闲线程超过 capacity 时释放引用，交给GC回收。
+	 * 线程由registry引用持有，取出的线程在 Release 之前由调用者负责；池必须在状态机关闭前析构
+	*/
+	class CoroutinePool {
+	public:
+		struct Thread {
+			lua_State* co = nullptr;
+			int ref = LUA_NOREF;		// 持有线程的registry引用
+
+			explicit operator bool() const {
+				return co != nullptr;
+			}
+		};
+
+		struct Stats {
+			std::size_t created;	// 创建的线程数
+			std::size_t reused;		// 从空闲列表取出的次数
+			std::size_t released;	// 放回空闲列表的次数
+			std::size_t dropped;	// 空闲列表已满而释放的线程数
+		};
+
+	public:
+		// stack_size 为预留的栈槽位数，nci 为预留的CallInfo个数，capacity 为最多保留的空闲线程数
+		explicit CoroutinePool(lua_State* L, int stack_size = 128, int nci = 8, std::size_t capacity = 256)
+			: stack_size_(stack_size)
+			, nci_(nci)
+			, capacity_(capacity)
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+			state_ = lua_tothread(L, -1);
+			lua_pop(L, 1);
+		}
+
+		CoroutinePool(const CoroutinePool&) = delete;
+		CoroutinePool& operator = (const CoroutinePool&) = delete;
+
+		~CoroutinePool() {
+			for (auto& t : idle_) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, t.ref);
+			}
+		}
+
+	public:
+		Thread Acquire() {
+			if (!idle_.empty()) {
+				Thread t = idle_.back();
+				idle_.pop_back();
+				++stats_.reused;
+				return t;
+			}
+			Thread t;
+			t.co = lua_newthread(state_);
+			// 预留失败（内存不足）时线程仍可使用，只是栈与CallInfo链按需增长
+			lua_reservethread(t.co, stack_size_, nci_);
+			t.ref = luaL_ref(state_, LUA_REGISTRYINDEX);
+			++stats_.created;
+			return t;
+		}
+
+		// 复位线程并放回空闲列表；线程不能正在运行
+		void Release(Thread t) {
+			if (!t) {
+				return;
+			}
+			if (idle_.size() >= capacity_) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, t.ref);
+				++stats_.dropped;
+				return;
+			}
+			lua_resetthread(t.co);
+			idle_.push_back(t);
+			++stats_.released;
+		}
+
+		// 预先创建 n 个空闲线程
+		void Prewarm(std::size_t n) {
+			std::vector<Thread> threads;
+			threads.reserve(n);
+			for (std::size_t i = 0; i < n; ++i) {
+				threads.push_back(Acquire());
+			}
+			for (auto& t : threads) {
+				Release(t);
+			}
+		}
+
+		std::size_t GetIdle() const {
+			return idle_.size();
+		}
+
+		const Stats& GetStats() const {
+			return stats_;
+		}
+
+	private:
+		lua_State* state_ = nullptr;
+		int stack_size_;
+		int nci_;
+		std::size_t capacity_;
+		std::vector<Thread> idle_;
+		Stats stats_{};
+	};
+}
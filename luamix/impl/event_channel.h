@@ -0,0 +1,300 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include "lua_function.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 事件通道，一个事件分发给所有订阅者：
+	 * 订阅者保存在registry中的一个数组表里，Fire 时事件参数只压栈一次，每个订阅者只需 lua_pushvalue 参数并 lua_pcall；
+	 * 订阅者之间互相隔离，出错的订阅者不影响其它订阅者，错误以 OnError 注册的回调通知。
+	 * 订阅返回的 Token 由槽位与序号组成，退订为 O(1)，分发过程中退订与订阅都是安全的：
+	 * 已退订的订阅者不再被调用，分发过程中新加入的订阅者从下一次 Fire 开始被调用。
+	 * GetProxy 返回给脚本使用的对象，脚本中以 ch:Subscribe(fn)、ch:Unsubscribe(token)、ch:Fire(...) 使用。
+	 * 通道必须在状态机关闭前析构，析构后脚本中的对象不再可用。
+	*/
+	class EventChannel {
+	public:
+		using Token = lua_Integer;
+		using ErrorHandler = std::function<void(Token, const ScriptError&)>;
+
+		struct Stats {
+			std::size_t fired;		// Fire 的次数
+			std::size_t calls;		// 调用订阅者的次数
+			std::size_t errors;		// 订阅者出错的次数
+		};
+
+	public:
+		explicit EventChannel(lua_State* L) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+			state_ = lua_tothread(L, -1);
+			lua_pop(L, 1);
+			lua_newtable(state_);
+			fns_ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+		}
+
+		EventChannel(const EventChannel&) = delete;
+		EventChannel& operator = (const EventChannel&) = delete;
+
+		~EventChannel() {
+			if (owner_) {
+				*owner_ = nullptr;
+				luaL_unref(state_, LUA_REGISTRYINDEX, owner_ref_);
+			}
+			luaL_unref(state_, LUA_REGISTRYINDEX, proxy_ref_);
+			luaL_unref(state_, LUA_REGISTRYINDEX, fns_ref_);
+			error_.Reset();
+		}
+
+	public:
+		// 订阅栈上 index 处的函数，不是函数时抛出 std::invalid_argument
+		Token Subscribe(lua_State* L, int index) {
+			if (!lua_isfunction(L, index)) {
+				throw std::invalid_argument("event listener is not a function");
+			}
+			index = lua_absindex(L, index);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, fns_ref_);	// :fns
+			lua_pushvalue(L, index);						// :fns, fn
+			Token token = subscribe(L);						// :fns
+			lua_pop(L, 1);
+			return token;
+		}
+
+		Token Subscribe(const LuaRef& fn) {
+			StackGuard _guard(state_);
+			if (fn.IsValid()) {
+				fn.Push();
+			} else {
+				lua_pushnil(state_);
+			}
+			return Subscribe(state_, -1);
+		}
+
+		template <typename F>
+		Token Subscribe(const LuaFunction<F>& fn) {
+			StackGuard _guard(state_);
+			if (fn) {
+				fn.Push();
+			} else {
+				lua_pushnil(state_);
+			}
+			return Subscribe(state_, -1);
+		}
+
+		Token Subscribe(lua_CFunction fn) {
+			StackGuard _guard(state_);
+			lua_pushcfunction(state_, fn);
+			return Subscribe(state_, -1);
+		}
+
+		// 退订，token 已经退订过或者不属于本通道时返回 false
+		bool Unsubscribe(Token token) {
+			auto slot = static_cast<std::size_t>(token & 0xffffffff);
+			auto serial = static_cast<std::uint32_t>(static_cast<std::uint64_t>(token) >> 32);
+			if (slot >= slots_.size() || !slots_[slot].live || slots_[slot].serial != serial) {
+				return false;
+			}
+			slots_[slot].live = false;
+			lua_rawgeti(state_, LUA_REGISTRYINDEX, fns_ref_);
+			lua_pushnil(state_);
+			lua_rawseti(state_, -2, static_cast<lua_Integer>(slot + 1));
+			lua_pop(state_, 1);
+			(depth_ ? pending_free_ : free_).push_back(static_cast<std::uint32_t>(slot));
+			--count_;
+			return true;
+		}
+
+		// 以 args 通知所有订阅者，返回出错的订阅者个数
+		template <typename... Ps>
+		std::size_t Fire(Ps&&... args) {
+			StackGuard _guard(state_);
+			// 参数压入一次，dispatch 再压入错误处理函数、订阅者表、订阅者与参数的副本
+			luaL_checkstack(state_, 2 * sizeof...(Ps) + 3, "too many event arguments");
+			int first = lua_gettop(state_) + 1;
+			(..., Push(state_, args));
+			return dispatch(state_, first, sizeof...(Ps));
+		}
+
+		void OnError(ErrorHandler handler) {
+			on_error_ = std::move(handler);
+		}
+
+		// 最近一次订阅者出错的错误
+		const ScriptError& GetLastError() const {
+			return error_;
+		}
+
+		std::size_t GetCount() const {
+			return count_;
+		}
+
+		const Stats& GetStats() const {
+			return stats_;
+		}
+
+		// 脚本使用的对象，多次调用返回同一个对象
+		LuaRef GetProxy() {
+			if (LUA_NOREF == proxy_ref_) {
+				createProxy();
+			}
+			lua_rawgeti(state_, LUA_REGISTRYINDEX, proxy_ref_);
+			LuaRef proxy(state_, -1);
+			lua_pop(state_, 1);
+			return proxy;
+		}
+
+	private:
+		struct Slot {
+			std::uint32_t serial;
+			bool live;
+		};
+
+		// 分发过程中递增，结束时把分发中退订的槽位放回空闲列表
+		struct DispatchScope {
+			explicit DispatchScope(EventChannel* ch) : ch_(ch) { ++ch_->depth_; }
+			~DispatchScope() {
+				if (0 == --ch_->depth_) {
+					ch_->free_.insert(ch_->free_.end(), ch_->pending_free_.begin(), ch_->pending_free_.end());
+					ch_->pending_free_.clear();
+				}
+			}
+			EventChannel* ch_;
+		};
+
+		// 栈顶为订阅者表与函数，弹出函数保存到空闲槽位中；分发过程中只追加新槽位，使新订阅者不被本次分发调用
+		Token subscribe(lua_State* L) {
+			std::uint32_t slot = 0;
+			if (!depth_ && !free_.empty()) {
+				slot = free_.back();
+				free_.pop_back();
+			} else {
+				slot = static_cast<std::uint32_t>(slots_.size());
+				slots_.push_back(Slot{ 0, false });
+			}
+			lua_rawseti(L, -2, static_cast<lua_Integer>(slot) + 1);
+			auto& s = slots_[slot];
+			++s.serial;
+			s.live = true;
+			++count_;
+			return static_cast<Token>((static_cast<std::uint64_t>(s.serial) << 32) | slot);
+		}
+
+		// 参数为栈上 first 开始的 nargs 个值，调用后恢复栈顶
+		std::size_t dispatch(lua_State* L, int first, int nargs) {
+			LuaException::PushTraceback(L);					// :args..., trace
+			int msgh = lua_gettop(L);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, fns_ref_);	// :args..., trace, fns
+			std::size_t failed = 0;
+			std::size_t count = slots_.size();
+			DispatchScope _scope(this);
+			++stats_.fired;
+			for (std::size_t i = 0; i < count; ++i) {
+				if (!slots_[i].live) {
+					continue;
+				}
+				lua_rawgeti(L, msgh + 1, static_cast<lua_Integer>(i) + 1);	// :args..., trace, fns, fn
+				for (int k = 0; k < nargs; ++k) {
+					lua_pushvalue(L, first + k);			// :args..., trace, fns, fn, args...
+				}
+				++stats_.calls;
+				if (int status = lua_pcall(L, nargs, 0, msgh)) {	// :args..., trace, fns, err
+					if (L != state_) {
+						lua_xmove(L, state_, 1);
+					}
+					error_.Set(state_, status);				// :args..., trace, fns
+					++stats_.errors;
+					++failed;
+					if (on_error_) {
+						on_error_(static_cast<Token>((static_cast<std::uint64_t>(slots_[i].serial) << 32) | i), error_);
+					}
+				}
+			}
+			lua_settop(L, first - 1);
+			return failed;
+		}
+
+		void createProxy() {
+			owner_ = static_cast<EventChannel**>(lua_newuserdata(state_, sizeof(EventChannel*)));
+			*owner_ = this;
+			owner_ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+
+			lua_createtable(state_, 0, 4);					// :proxy
+			const std::pair<const char*, lua_CFunction> methods[] = {
+				{ "Subscribe", &luaSubscribe },
+				{ "Unsubscribe", &luaUnsubscribe },
+				{ "Fire", &luaFire },
+				{ "Count", &luaCount },
+			};
+			for (auto& [name, fn] : methods) {
+				lua_rawgeti(state_, LUA_REGISTRYINDEX, owner_ref_);	// :proxy, owner
+				lua_pushcclosure(state_, fn, 1);			// :proxy, fn
+				lua_setfield(state_, -2, name);				// :proxy
+			}
+			proxy_ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+		}
+
+		static EventChannel* checkOwner(lua_State* L) {
+			auto ch = *static_cast<EventChannel**>(lua_touserdata(L, lua_upvalueindex(1)));
+			if (!ch) {
+				luaL_error(L, "event channel is closed");
+			}
+			return ch;
+		}
+
+		// ch:Subscribe(fn)
+		static int luaSubscribe(lua_State* L) {
+			auto ch = checkOwner(L);
+			luaL_checktype(L, 2, LUA_TFUNCTION);
+			lua_pushinteger(L, ch->Subscribe(L, 2));
+			return 1;
+		}
+
+		// ch:Unsubscribe(token)
+		static int luaUnsubscribe(lua_State* L) {
+			auto ch = checkOwner(L);
+			lua_pushboolean(L, ch->Unsubscribe(luaL_checkinteger(L, 2)));
+			return 1;
+		}
+
+		// ch:Fire(...)，返回出错的订阅者个数
+		static int luaFire(lua_State* L) {
+			auto ch = checkOwner(L);
+			int nargs = lua_gettop(L) - 1;
+			luaL_checkstack(L, nargs + 3, "too many event arguments");
+			std::size_t failed = 0;
+			try {
+				failed = ch->dispatch(L, 2, nargs);
+			} catch (std::exception& e) {
+				return luaL_error(L, "%s", e.what());
+			}
+			lua_pushinteger(L, static_cast<lua_Integer>(failed));
+			return 1;
+		}
+
+		// ch:Count()
+		static int luaCount(lua_State* L) {
+			auto ch = checkOwner(L);
+			lua_pushinteger(L, static_cast<lua_Integer>(ch->count_));
+			return 1;
+		}
+
+	private:
+		lua_State* state_ = nullptr;
+		int fns_ref_ = LUA_NOREF;
+		int proxy_ref_ = LUA_NOREF;
+		int owner_ref_ = LUA_NOREF;
+		EventChannel** owner_ = nullptr;
+		std::vector<Slot> slots_;
+		std::vector<std::uint32_t> free_;
+		std::vector<std::uint32_t> pending_free_;
+		std::size_t count_ = 0;
+		int depth_ = 0;
+		ErrorHandler on_error_;
+		ScriptError error_;
+		Stats stats_{};
+	};
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <functional>
+
+#include "mix_util.h"
+#include "type_mix.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 外部内存记账：ud只保存一个指针，其C++对象持有的内存（如容器的缓冲区）lua看不到，
+	 * 大量持有大块内存的小ud会让GC以为内存压力很小而迟迟不回收。
+	 * 记账的字节数通过 lua_gcaccount 计入GC债务及 LUA_GCCOUNT，GC按 lua内存 + 外部内存 推进；
+	 * 每个对象已记账的字节数保存在注册表的 luamix_external 表中，以C++对象指针为键，
+	 * 对象回收时按记录的字节数冲减，因此对象大小在记账之后发生变化也不会造成失衡。
+	*/
+
+	// 设置对象的外部内存字节数，与已记账字节数的差值计入GC债务；可能触发一次GC单步
+	inline void SetExternalSize(lua_State* L, const void* obj, std::size_t bytes) {
+		StackGuard _guard(L);
+		lua_pushstring(L, LUAMIX_KEY_EXTERNAL);		// :key
+		if (LUA_TTABLE != lua_rawget(L, LUA_REGISTRYINDEX)) {	// :nil
+			lua_pop(L, 1);
+			lua_newtable(L);						// :tb
+			lua_pushstring(L, LUAMIX_KEY_EXTERNAL);	// :tb, key
+			lua_pushvalue(L, -2);					// :tb, key, tb
+			lua_rawset(L, LUA_REGISTRYINDEX);		// :tb
+		}
+		lua_rawgetp(L, -1, obj);					// :tb, old
+		auto old = static_cast<lua_Integer>(lua_tointeger(L, -1));
+		lua_pop(L, 1);								// :tb
+		lua_pushinteger(L, static_cast<lua_Integer>(bytes));	// :tb, bytes
+		lua_rawsetp(L, -2, obj);					// :tb
+		// 先更新记录再计入债务，债务触发的GC单步可能回收其他对象并修改记录表
+		if (auto delta = static_cast<lua_Integer>(bytes) - old) {
+			lua_gcaccount(L, delta);
+		}
+	}
+
+	// 只更新已记账的对象，未记账的对象（不归脚本管理的C++对象）直接忽略；返回是否已记账
+	inline bool UpdateExternalSize(lua_State* L, const void* obj, std::size_t bytes) {
+		{
+			StackGuard _guard(L);
+			lua_pushstring(L, LUAMIX_KEY_EXTERNAL);	// :key
+			if (LUA_TTABLE != lua_rawget(L, LUA_REGISTRYINDEX) || LUA_TNUMBER != lua_rawgetp(L, -1, obj)) {
+				return false;
+			}
+		}
+		SetExternalSize(L, obj, bytes);
+		return true;
+	}
+
+	// 冲减对象的外部内存并删除记录，由 ClassMetaEvent::gc 在对象回收时调用
+	inline void ReleaseExternalSize(lua_State* L, const void* obj) {
+		StackGuard _guard(L);
+		lua_pushstring(L, LUAMIX_KEY_EXTERNAL);		// :key
+		if (LUA_TTABLE != lua_rawget(L, LUA_REGISTRYINDEX)) {	// :tb
+			return;
+		}
+		if (LUA_TNUMBER != lua_rawgetp(L, -1, obj)) {	// :tb, bytes
+			return;
+		}
+		auto bytes = static_cast<lua_Integer>(lua_tointeger(L, -1));
+		lua_pop(L, 1);								// :tb
+		lua_pushnil(L);								// :tb, nil
+		lua_rawsetp(L, -2, obj);					// :tb
+		lua_gcaccount(L, -bytes);
+	}
+
+	// 当前记账的外部内存总字节数
+	inline std::size_t ExternalBytes(lua_State* L) {
+		return static_cast<std::size_t>(lua_gcaccount(L, 0));
+	}
+
+	// 类的外部内存大小函数，保存在本状态机的类元表中，不影响其它状态机中的同一个类；工厂创建对象后据此记账
+	template <typename C>
+	class ClassExternalSize {
+	public:
+		using SizeFunc = std::function<std::size_t(const C*)>;
+
+		// 压入新建的ud
+		static void Create(lua_State* L, SizeFunc size_of) {
+			::new (lua_newuserdata(L, sizeof(ClassExternalSize))) ClassExternalSize(std::move(size_of));	// :ud
+			lua_createtable(L, 0, 1);						// :ud, mt
+			lua_pushcfunction(L, &destruct);				// :ud, mt, destruct
+			lua_setfield(L, -2, "__gc");					// :ud, mt
+			lua_setmetatable(L, -2);						// :ud
+		}
+
+		// 类元表中设置了大小函数时，按其计入对象的外部内存
+		static void Account(lua_State* L, const C* obj) {
+			std::size_t bytes = 0;
+			{
+				StackGuard _guard(L);
+				if (LUA_TTABLE != luaL_getmetatable(L, ClassTypeSignature<C>::Value())) {	// :mt
+					return;
+				}
+				lua_pushstring(L, MetaKeyExternalSize);		// :mt, ".extsize"
+				lua_rawget(L, -2);							// :mt, size
+				auto size = static_cast<ClassExternalSize*>(lua_touserdata(L, -1));
+				if (!size || !size->size_of_) {
+					return;
+				}
+				bytes = size->size_of_(obj);
+			}
+			SetExternalSize(L, obj, bytes);
+		}
+
+	private:
+		explicit ClassExternalSize(SizeFunc size_of)
+			: size_of_(std::move(size_of))
+		{}
+
+		static int destruct(lua_State* L) {
+			static_cast<ClassExternalSize*>(lua_touserdata(L, 1))->~ClassExternalSize();
+			return 0;
+		}
+
+	private:
+		SizeFunc size_of_;
+	};
+}
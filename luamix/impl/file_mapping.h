@@ -0,0 +1,128 @@
+#pragma once
+
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// 只读文件映射，析构时解除；映射的起始地址按页对齐
+	class FileMapping {
+	public:
+		FileMapping() = default;
+		FileMapping(const FileMapping&) = delete;
+		FileMapping& operator = (const FileMapping&) = delete;
+
+		~FileMapping() {
+			Close();
+		}
+
+	public:
+		const char* Data() const {
+			return data_;
+		}
+
+		std::size_t Size() const {
+			return size_;
+		}
+
+		explicit operator bool() const {
+			return data_ != nullptr;
+		}
+
+#ifdef _WIN32
+		// 映射整个文件，空文件视为失败
+		bool Open(const std::string& file) {
+			Close();
+			file_ = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file_ == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+				Close();
+				return false;
+			}
+			view_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!view_) {
+				Close();
+				return false;
+			}
+			data_ = static_cast<const char*>(MapViewOfFile(view_, FILE_MAP_READ, 0, 0, 0));
+			if (!data_) {
+				Close();
+				return false;
+			}
+			size_ = static_cast<std::size_t>(size.QuadPart);
+			return true;
+		}
+
+		void Close() {
+			if (data_) {
+				UnmapViewOfFile(data_);
+			}
+			if (view_) {
+				CloseHandle(view_);
+			}
+			if (file_ != INVALID_HANDLE_VALUE) {
+				CloseHandle(file_);
+			}
+			data_ = nullptr;
+			size_ = 0;
+			view_ = nullptr;
+			file_ = INVALID_HANDLE_VALUE;
+		}
+#else
+		// 映射整个文件，空文件视为失败
+		bool Open(const std::string& file) {
+			Close();
+			int fd = ::open(file.c_str(), O_RDONLY);
+			if (fd < 0) {
+				return false;
+			}
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+				::close(fd);
+				return false;
+			}
+			void* data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (data == MAP_FAILED) {
+				return false;
+			}
+			data_ = static_cast<const char*>(data);
+			size_ = static_cast<std::size_t>(st.st_size);
+			return true;
+		}
+
+		void Close() {
+			if (data_) {
+				::munmap(const_cast<char*>(data_), size_);
+			}
+			data_ = nullptr;
+			size_ = 0;
+		}
+#endif
+
+	private:
+		const char* data_ = nullptr;
+		std::size_t size_ = 0;
+#ifdef _WIN32
+		HANDLE file_ = INVALID_HANDLE_VALUE;
+		HANDLE view_ = nullptr;
+#endif
+	};
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include "mix_util.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// 延迟回收：__gc 只把对象指针放入队列，由后台线程或在安全点批量执行回收函数
+	class Finalizer {
+	public:
+		enum class Mode {
+			Batched,		// 只在调用 Drain() 时执行
+			Background,		// 由后台线程执行
+		};
+
+		struct Stats {
+			std::size_t queued;			// 累计入队数
+			std::size_t finalized;		// 累计回收数
+			std::size_t pending;		// 当前待回收数
+			std::size_t peak_pending;	// 待回收数峰值
+			std::size_t drains;			// 批量执行次数
+		};
+
+		// 队列元素，不含需要析构的成员，入队不会额外分配
+		struct Task {
+			void (*invoke)(const void* collector, void* obj);
+			const void* collector;
+			void* obj;
+		};
+
+	public:
+		explicit Finalizer(Mode mode = Mode::Background)
+			: mode_(mode)
+		{
+			if (mode_ == Mode::Background) {
+				worker_ = std::thread([this] { loop(); });
+			}
+		}
+
+		Finalizer(const Finalizer&) = delete;
+		Finalizer& operator = (const Finalizer&) = delete;
+
+		~Finalizer() {
+			Shutdown(drain_on_shutdown_);
+		}
+
+	public:
+		Mode GetMode() const {
+			return mode_;
+		}
+
+		void Push(const Task& task) {
+			std::size_t pending;
+			{
+				std::lock_guard<std::mutex> _lock(mutex_);
+				tasks_.push_back(task);
+				pending = tasks_.size();
+				queued_.fetch_add(1, std::memory_order_relaxed);
+			}
+			if (pending > peak_pending_.load(std::memory_order_relaxed)) {
+				peak_pending_.store(pending, std::memory_order_relaxed);
+			}
+			if (mode_ == Mode::Background) {
+				cond_.notify_one();
+			}
+		}
+
+		// 在调用线程上执行至多 max 个回收，返回执行数量
+		std::size_t Drain(std::size_t max = static_cast<std::size_t>(-1)) {
+			std::vector<Task> batch;
+			{
+				std::lock_guard<std::mutex> _lock(mutex_);
+				if (tasks_.empty()) {
+					return 0;
+				}
+				if (max >= tasks_.size()) {
+					batch.swap(tasks_);
+				} else {
+					batch.assign(tasks_.begin(), tasks_.begin() + max);
+					tasks_.erase(tasks_.begin(), tasks_.begin() + max);
+				}
+			}
+			run(batch);
+			return batch.size();
+		}
+
+		// 停止后台线程；drain 为 true 时在调用线程上执行完剩余回收，否则直接丢弃
+		void Shutdown(bool drain) {
+			{
+				std::lock_guard<std::mutex> _lock(mutex_);
+				stop_ = true;
+			}
+			cond_.notify_one();
+			if (worker_.joinable()) {
+				worker_.join();
+			}
+			if (drain) {
+				Drain();
+			} else {
+				std::lock_guard<std::mutex> _lock(mutex_);
+				tasks_.clear();
+			}
+		}
+
+		// 析构时是否执行剩余回收，默认执行
+		void SetDrainOnShutdown(bool drain) {
+			drain_on_shutdown_ = drain;
+		}
+
+		// 唯一编号，不会像地址一样在销毁后被新的对象复用
+		std::uint64_t GetId() const {
+			return id_;
+		}
+
+		// 持有回收函数直到本对象析构，队列中引用它的任务总能安全执行
+		void Retain(std::shared_ptr<const void> collector) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			retained_.push_back(std::move(collector));
+		}
+
+		Stats GetStats() const {
+			Stats stats;
+			{
+				// 入队计数在锁内增加，先读回收数再读入队数，待回收数不会为负
+				std::lock_guard<std::mutex> _lock(mutex_);
+				stats.finalized = finalized_.load(std::memory_order_relaxed);
+				stats.queued = queued_.load(std::memory_order_relaxed);
+			}
+			stats.pending = stats.queued > stats.finalized ? stats.queued - stats.finalized : 0;
+			stats.peak_pending = peak_pending_.load(std::memory_order_relaxed);
+			stats.drains = drains_.load(std::memory_order_relaxed);
+			return stats;
+		}
+
+	public:
+		static void Install(lua_State* L, Finalizer* finalizer) {
+			lua_pushstring(L, LUAMIX_KEY_FINALIZER);
+			if (finalizer) {
+				lua_pushlightuserdata(L, finalizer);
+			} else {
+				lua_pushnil(L);
+			}
+			lua_rawset(L, LUA_REGISTRYINDEX);
+		}
+
+		static Finalizer* Find(lua_State* L) {
+			lua_pushstring(L, LUAMIX_KEY_FINALIZER);
+			lua_rawget(L, LUA_REGISTRYINDEX);
+			auto finalizer = static_cast<Finalizer*>(lua_touserdata(L, -1));
+			lua_pop(L, 1);
+			return finalizer;
+		}
+
+	private:
+		static std::uint64_t nextId() {
+			static std::atomic<std::uint64_t> id{ 0 };
+			return ++id;
+		}
+
+		void loop() {
+			std::vector<Task> batch;
+			for (;;) {
+				{
+					std::unique_lock<std::mutex> _lock(mutex_);
+					cond_.wait(_lock, [this] { return stop_ || !tasks_.empty(); });
+					if (stop_) {
+						return;
+					}
+					batch.swap(tasks_);
+				}
+				run(batch);
+				batch.clear();
+			}
+		}
+
+		void run(const std::vector<Task>& batch) {
+			for (auto& task : batch) {
+				// 回收函数不应抛出异常，这里吞掉以免终止后台线程
+				try {
+					task.invoke(task.collector, task.obj);
+				} catch (...) {}
+			}
+			finalized_.fetch_add(batch.size(), std::memory_order_relaxed);
+			drains_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+	private:
+		const Mode mode_;
+		bool drain_on_shutdown_ = true;
+		bool stop_ = false;
+		const std::uint64_t id_ = nextId();
+		std::vector<Task> tasks_;
+		std::vector<std::shared_ptr<const void>> retained_;
+		mutable std::mutex mutex_;
+		std::condition_variable cond_;
+		std::thread worker_;
+		std::atomic<std::size_t> queued_{ 0 };
+		std::atomic<std::size_t> finalized_{ 0 };
+		std::atomic<std::size_t> peak_pending_{ 0 };
+		std::atomic<std::size_t> drains_{ 0 };
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	/* 类的原生回收函数，以ud保存在该状态机的类元表中（.gcn[gc_id]）：
+	 * 状态机关闭后队列中可能还有引用它的任务，因此第一次向某个 Finalizer 入队时交给它共同持有，
+	 * 回收函数在状态机与所有用过它的 Finalizer 都销毁后才释放
+	*/
+	template <typename C>
+	class ClassCollector {
+	public:
+		using Function = std::function<void(C*)>;
+
+		// 压入新建的ud
+		static void Create(lua_State* L, Function collect) {
+			::new (lua_newuserdata(L, sizeof(ClassCollector))) ClassCollector(std::move(collect));	// :ud
+			lua_createtable(L, 0, 1);						// :ud, mt
+			lua_pushcfunction(L, &destruct);				// :ud, mt, destruct
+			lua_setfield(L, -2, "__gc");					// :ud, mt
+			lua_setmetatable(L, -2);						// :ud
+		}
+
+		// 取得入队用的回收函数，保证其在 finalizer 执行完队列前有效
+		const void* Attach(Finalizer& finalizer) {
+			if (retained_by_ != finalizer.GetId()) {
+				finalizer.Retain(collect_);
+				retained_by_ = finalizer.GetId();
+			}
+			return collect_.get();
+		}
+
+		static void Invoke(const void* collector, void* obj) {
+			(*static_cast<const Function*>(collector))(static_cast<C*>(obj));
+		}
+
+	private:
+		explicit ClassCollector(Function collect)
+			: collect_(std::make_shared<Function>(std::move(collect)))
+		{}
+
+		static int destruct(lua_State* L) {
+			static_cast<ClassCollector*>(lua_touserdata(L, 1))->~ClassCollector();
+			return 0;
+		}
+
+	private:
+		std::shared_ptr<Function> collect_;
+		std::uint64_t retained_by_ = 0;		// 最近一个持有回收函数的 Finalizer 的编号
+	};
+}
@@ -4,18 +4,20 @@
 #include <functional>
 
 #include "type_mix.h"
+#include "external_mix.h"
+#include "async_mix.h"
 
 namespace LuaMix::Impl {
 	//////////////////////////////////////////////////////////////////////////
-	// װ
+	// 函数参数包装
 	/*
-	* βֻ֧֣ͼֵáָ뼰ֵָ
-	* TC*ջõֵholderΪֵ壬Ϊǳ
-	* T&C*& ջõֵholderΪ壬Ϊ
+	* 形参只支持：基本类型及其左值引用、类类型指针及其指针左值引用
+	* T、C*：从栈中拿到值，holder为值语义，为非出参
+	* T&、C*& ：从栈中拿到值，holder为引用语义，为出参
 	*/
 	template <typename T>
 	struct CppArg {
-		// ֵʵΣǻͻָ
+		// 总是以值语义持有实参，无论是基本类型还是类类型指针
 		using ArgHoldType = typename TypeMix<T>::ArgHoldType;
 
 		ArgHoldType hold_;
@@ -33,23 +35,24 @@ namespace LuaMix::Impl {
 			return 0;
 		}
 
-		// ֵãԱڱĺʵֳ
+		// 返回左值引用，以便于被代理的函数实现出参
 		std::add_lvalue_reference_t<ArgHoldType> Value() {
 			return hold_;
 		}
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// 
+	// 函数代理
 	template <typename F, typename R, typename... P>
 	struct CppFuncProxyImpl {
 		using SwapList = std::tuple<CppArg<P>...>;
 		using FuncType = std::add_const_t<std::conditional_t<std::is_function_v<std::remove_pointer_t<F>>, F, std::add_pointer_t<F>>>;
 
 		static int Proxy(lua_State* L) {
+			int nret = 0;
 			try {
 				SwapList swap_list;
-				return std::apply([L](auto &... args) {
+				nret = std::apply([L](auto &... args) {
 					int index = 0;
 					(..., args.Input(L, ++index));
 					FuncType func = static_cast<FuncType>(lua_touserdata(L, lua_upvalueindex(1)));
@@ -63,6 +66,11 @@ namespace LuaMix::Impl {
 			} catch (const std::exception &e) {
 				return luaL_error(L, "%s", e.what());
 			}
+			// 返回 Async 时在C++对象析构之后再让出协程，lua 以 longjmp 实现时不会跳过析构
+			if constexpr (_is_async_v<R>) {
+				return AsyncAwait(L, lua_gettop(L) - nret + 1);
+			}
+			return nret;
 		}
 
 		template <typename T>
@@ -74,14 +82,14 @@ namespace LuaMix::Impl {
 	template <typename F, typename ENABLE = void>
 	struct CppFuncProxy;
 
-	// 溯ָ
+	// 常规函数指针
 	template<typename R, typename... P>
 	struct CppFuncProxy<R(*)(P...)> : CppFuncProxyImpl<R(*)(P...), R, P...> {};
 
 	template<typename R, typename... P>
 	struct CppFuncProxy<R(*)(P...) noexcept> : CppFuncProxyImpl<R(*)(P...), R, P...> {};
 
-	// 溯˻Ϊָ봦
+	// 常规函数对象，退化为指针处理
 	template<typename F>
 	struct CppFuncProxy<F, std::enable_if_t<std::is_function_v<F>>> : CppFuncProxy<std::decay_t<F>> {};
 
@@ -89,7 +97,7 @@ namespace LuaMix::Impl {
 	template <typename R, typename... P>
 	struct CppFuncProxy<std::function<R(P...)>> : CppFuncProxyImpl<std::function<R(P...)>, R, P...> {};
 
-	// lambda  ɵö
+	// lambda 和 可调用对象
 	template <typename C>
 	struct CppCouldBeLambda {
 		static constexpr bool value = std::is_class_v<C>;
@@ -116,7 +124,7 @@ namespace LuaMix::Impl {
 	template <typename F>
 	struct CppFuncProxy<F, std::enable_if_t<CppCouldBeLambda<F>::value>> : CppFuncProxy<typename CppLambdaTraits<F>::FunctionType> {};
 
-	template <typename F>
+	template <typename F, typename C>
 	struct CppFactoryProxy : CppFuncProxy<F> {
 		static int Factory(lua_State* L) {
 			int ret = CppFuncProxy<F>::Proxy(L);
@@ -126,14 +134,15 @@ namespace LuaMix::Impl {
 			void* udp = *((void**)lua_touserdata(L, -ret));
 			lua_pushstring(L, LUAMIX_KEY_COLLECT);
 			lua_rawget(L, LUA_REGISTRYINDEX);
-			lua_pushvalue(L, lua_upvalueindex(2)); // ĸʱʹöӦĻպ
+			lua_pushvalue(L, lua_upvalueindex(2)); // 标记是哪个工厂函数所创建，回收时，使用对应的回收函数
 			lua_rawsetp(L, -2, udp);
+			ClassExternalSize<C>::Account(L, static_cast<const C*>(udp));
 			return ret;
 		}
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// Դ
+	// 属性代理
 	template <typename P>
 	struct CppPropertyGetter {
 		static int Proxy(lua_State *L) {
@@ -161,7 +170,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// Ա
+	// 成员方法代理
 	template <bool IS_CONST, typename F, typename C, typename R, typename... P>
 	struct CppMethodProxyImpl {
 		using SwapList = std::tuple<CppArg<std::conditional_t<IS_CONST, const C*, C*>>, CppArg<P>...>;
@@ -206,7 +215,7 @@ namespace LuaMix::Impl {
 	template <typename W, typename C, typename R, typename... P>
 	struct CppMethodProxy<R(C::*)(P...) const noexcept, W> : CppMethodProxy<R(C::*)(P...) const, W> {};
 	//////////////////////////////////////////////////////////////////////////
-	// Ա
+	// 成员变量代理
 	template <typename W, typename C, typename V>
 	struct CppMemeberVariableGetter {
 		static int Proxy(lua_State* L) {
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <iterator>
+
+#include "mix_util.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// GC阶段，与 lgc.h 中的 GCS* 一一对应
+	enum class GCPhase {
+		Propagate = 0,
+		Atomic,
+		SweepAllGC,
+		SweepFinObj,
+		SweepToBeFnz,
+		SweepEnd,
+		CallFin,
+		Pause,
+		Count,
+	};
+
+	inline const char* GCPhaseName(GCPhase phase) {
+		static const char* const names[] = {
+			"propagate", "atomic", "sweepallgc", "sweepfinobj", "sweeptobefnz", "sweepend", "callfin", "pause",
+		};
+		auto index = static_cast<std::size_t>(phase);
+		return index < std::size(names) ? names[index] : "unknown";
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// GC模式
+	enum class GCMode {
+		Incremental,	// 增量模式，lua5.3 默认
+		Generational,	// 分代模式：minor 回收只标记清除新生代，在一次 minor 回收中存活的对象晋升为老年代，只在 major 回收时处理
+	};
+
+	/* 切换GC模式，返回之前的模式：
+	 * minor_mul 为分代模式下两次 minor 回收之间允许增长的内存百分比，0 表示保持不变；
+	 * 进入分代模式时会完成当前增量周期并做一次全量回收以建立老年代。
+	*/
+	inline GCMode SetGCMode(lua_State* L, GCMode mode, int minor_mul = 0) {
+		int prev = mode == GCMode::Generational ? lua_gc(L, LUA_GCGEN, minor_mul) : lua_gc(L, LUA_GCINC, 0);
+		return prev == LUA_GCGEN ? GCMode::Generational : GCMode::Incremental;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// CollectFor 的统计
+	struct GCStats {
+		using Duration = std::chrono::nanoseconds;
+
+		// 停顿直方图的桶上限（微秒），最后一个桶收集其余所有停顿
+		static constexpr std::array<long long, 7> kPauseBuckets = { 50, 100, 200, 500, 1000, 2000, 5000 };
+
+		std::array<Duration, static_cast<std::size_t>(GCPhase::Count)> phase_time{};	// 各阶段累计耗时
+		std::array<std::size_t, kPauseBuckets.size() + 1> pause_histogram{};		// CollectFor 单次耗时分布
+		Duration max_pause{};			// 单次 CollectFor 最大耗时
+		Duration max_atomic{};			// 单次原子阶段最大耗时，原子阶段不可拆分，是超出预算的主要来源
+		std::size_t collects = 0;		// CollectFor 调用次数
+		std::size_t steps = 0;			// 执行的单步数
+		std::size_t cycles = 0;			// 完成的GC周期数
+		std::size_t overruns = 0;		// 超出预算的次数
+		std::size_t bytes_reclaimed = 0;	// 清除阶段回收的字节数
+
+		void Reset() {
+			*this = GCStats();
+		}
+
+		void RecordPause(Duration pause) {
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(pause).count();
+			std::size_t bucket = 0;
+			while (bucket < kPauseBuckets.size() && us >= kPauseBuckets[bucket]) {
+				++bucket;
+			}
+			++pause_histogram[bucket];
+			if (pause > max_pause) {
+				max_pause = pause;
+			}
+		}
+	};
+
+	inline std::size_t GCTotalBytes(lua_State* L) {
+		return static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+	}
+
+	/* 在时间预算内逐步推进增量GC，不受GC债务影响，也不要求GC处于运行状态：
+	 * 每推进 kCheckWork 字节的工作量或者跨越阶段时才读取一次时钟，预计下一段会超出预算时返回；
+	 * 单步本身不可拆分（如遍历一个很大的表、原子阶段、sweepend 的字符串表收缩），因此实际耗时仍可能超出预算。
+	 * 一个周期完成（回到 pause）时提前返回 true，下次调用将开始新的周期。
+	 * 分代模式下单步就是一次完整的 minor（或 major）回收，每次调用执行一次并返回 true，耗时计入 pause 阶段。
+	*/
+	inline bool CollectFor(lua_State* L, std::chrono::microseconds budget, GCStats& stats) {
+		using Clock = std::chrono::steady_clock;
+		constexpr int kCheckWork = 1024;
+
+		auto start = Clock::now();
+		auto deadline = start + budget;
+		auto last = start;
+		int phase = lua_gc(L, LUA_GCSTATE, 0);
+		std::size_t bytes = GCTotalBytes(L);
+		int work = 0;
+		bool finished = false;
+
+		++stats.collects;
+		for (;;) {
+			work += lua_gc(L, LUA_GCSINGLE, 0);
+			++stats.steps;
+			int next = lua_gc(L, LUA_GCSTATE, 0);
+			if (next == phase && next != static_cast<int>(GCPhase::Pause) && work < kCheckWork) {
+				continue;
+			}
+
+			auto now = Clock::now();
+			auto elapsed = now - last;
+			stats.phase_time[phase] += elapsed;
+			if (phase == static_cast<int>(GCPhase::Atomic) && elapsed > stats.max_atomic) {
+				stats.max_atomic = elapsed;
+			}
+			if ((phase >= static_cast<int>(GCPhase::SweepAllGC) && phase <= static_cast<int>(GCPhase::SweepEnd)) || (phase == next && next == static_cast<int>(GCPhase::Pause))) {
+				std::size_t after = GCTotalBytes(L);
+				if (after < bytes) {
+					stats.bytes_reclaimed += bytes - after;
+				}
+				bytes = after;
+			} else if (next >= static_cast<int>(GCPhase::SweepAllGC)) {
+				bytes = GCTotalBytes(L);
+			}
+			last = now;
+			work = 0;
+
+			if (next == static_cast<int>(GCPhase::Pause)) {
+				++stats.cycles;
+				finished = true;
+				break;
+			}
+			phase = next;
+			// 按上一段的耗时预估下一段，避免越过预算
+			if (now + elapsed >= deadline) {
+				break;
+			}
+		}
+
+		auto pause = last - start;
+		stats.RecordPause(pause);
+		if (pause > budget) {
+			++stats.overruns;
+		}
+		return finished;
+	}
+}
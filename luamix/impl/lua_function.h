@@ -0,0 +1,189 @@
+#pragma once
+
+#include <optional>
+#include <type_traits>
+
+#include "script_call.h"
+
+namespace LuaMix::Impl {
+	template <typename F>
+	class LuaFunction;
+
+	//////////////////////////////////////////////////////////////////////////
+	/* 带类型的脚本函数，可以作为导出的C++函数的参数，也可以由C++长期持有：
+	 * 函数保存在registry引用中，调用时只需取出常驻的错误处理函数与函数本身、压入参数并 lua_pcall；
+	 * 参数不超过 LUA_MINSTACK 时不需要检查栈空间（lua保证C代码至少有 LUA_MINSTACK 个空闲槽位）。
+	 * 调用发生在当前运行的线程（lua_running）上：在协程中调用时使用该协程的栈，错误的调用栈也属于该协程。
+	 * 除函数外也接受带 __call 元方法的表与userdata；持有者必须在状态机关闭前析构。
+	*/
+	template <typename R, typename... Args>
+	class LuaFunction<R(Args...)> {
+	public:
+		using ReturnType = std::conditional_t<std::is_void_v<R>, bool, std::optional<R>>;
+
+	public:
+		LuaFunction() = default;
+
+		// 引用栈上 index 处的函数，nil 得到空对象
+		LuaFunction(lua_State* L, int index) {
+			if (lua_isnoneornil(L, index)) {
+				return;
+			}
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+			state_ = lua_tothread(L, -1);
+			lua_pop(L, 1);
+			lua_pushvalue(L, index);
+			ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+
+		explicit LuaFunction(const LuaRef& ref) {
+			if (ref) {
+				StackGuard _guard(ref.GetState());
+				ref.Push();
+				*this = LuaFunction(ref.GetState(), -1);
+			}
+		}
+
+		LuaFunction(const LuaFunction& that) {
+			if (that.state_) {
+				state_ = that.state_;
+				lua_rawgeti(state_, LUA_REGISTRYINDEX, that.ref_);
+				ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+			}
+		}
+
+		LuaFunction(LuaFunction&& that) noexcept
+			: state_(that.state_)
+			, ref_(that.ref_)
+		{
+			that.state_ = nullptr;
+			that.ref_ = LUA_NOREF;
+		}
+
+		LuaFunction& operator = (LuaFunction that) noexcept {
+			std::swap(state_, that.state_);
+			std::swap(ref_, that.ref_);
+			return *this;
+		}
+
+		~LuaFunction() {
+			if (state_) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
+			}
+		}
+
+	public:
+		explicit operator bool() const {
+			return state_ != nullptr;
+		}
+
+		bool IsValid() const {
+			return state_ != nullptr;
+		}
+
+		lua_State* GetState() const {
+			return state_;
+		}
+
+		// 把函数压入主线程的栈，空对象时什么也不做
+		void Push() const {
+			Push(state_);
+		}
+
+		// 把函数压入同一状态机中的线程 L 的栈
+		void Push(lua_State* L) const {
+			if (state_) {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, ref_);
+			}
+		}
+
+		// 出错时抛出 LuaException；在导出的C++函数中调用时，异常会转为脚本错误
+		R operator()(Args... args) const {
+			if (!state_) {
+				throw LuaException("call of an empty LuaFunction");
+			}
+			lua_State* L = lua_running(state_);
+			StackGuard _guard(L);
+			if (pcall(L, args...) != LUA_OK) {
+				throw LuaException(L);
+			}
+			if constexpr (!std::is_void_v<R>) {
+				return Fetch<R>(L, -1);
+			}
+		}
+
+		// 出错时返回 false/std::nullopt，错误保存在 err 中，不抛出异常
+		ReturnType TryCall(ScriptError& err, Args... args) const {
+			if (!state_) {
+				return ReturnType();
+			}
+			lua_State* L = lua_running(state_);
+			StackGuard _guard(L);
+			if (int status = pcall(L, args...)) {
+				err.Set(L, status);
+				return ReturnType();
+			}
+			if constexpr (std::is_void_v<R>) {
+				return true;
+			} else {
+				return Fetch<R>(L, -1);
+			}
+		}
+
+	private:
+		int pcall(lua_State* L, const std::remove_reference_t<Args>&... args) const {
+			if constexpr (sizeof...(Args) + 2 > LUA_MINSTACK) {
+				luaL_checkstack(L, sizeof...(Args) + 2, "too many arguments");
+			}
+			LuaException::PushTraceback(L);					// :trace
+			lua_rawgeti(L, LUA_REGISTRYINDEX, ref_);		// :trace, fn
+			(..., Impl::Push(L, args));						// :trace, fn, args...
+			return lua_pcall(L, sizeof...(Args), std::is_void_v<R> ? 0 : 1, -int(sizeof...(Args) + 2));
+		}
+
+	private:
+		lua_State* state_ = nullptr;
+		int ref_ = LUA_NOREF;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// 特化 LuaFunction，作为参数时接受函数、带 __call 元方法的值或者nil
+	template <typename R, typename... Args>
+	struct _type_mix_spec<LuaFunction<R(Args...)>> {
+		using ArgHoldType = LuaFunction<R(Args...)>;
+
+		// 压入调用者的栈，可能是协程而不是函数所在的主线程
+		static void Push(lua_State* L, const LuaFunction<R(Args...)>& value) {
+			if (value) {
+				value.Push(L);
+			} else {
+				lua_pushnil(L);
+			}
+		}
+
+		template <bool CHECK = false>
+		static LuaFunction<R(Args...)> Fetch(lua_State* L, int index) {
+			if (!isCallable(L, index)) {
+				if constexpr (CHECK) {
+					if (!lua_isnoneornil(L, index)) {
+						luaL_argerror(L, index, "function expected");
+					}
+				}
+				return LuaFunction<R(Args...)>();
+			}
+			return LuaFunction<R(Args...)>(L, index);
+		}
+
+	private:
+		static bool isCallable(lua_State* L, int index) {
+			if (lua_isfunction(L, index)) {
+				return true;
+			}
+			if (LUA_TNIL == luaL_getmetafield(L, index, "__call")) {
+				return false;
+			}
+			lua_pop(L, 1);
+			return true;
+		}
+	};
+}
@@ -3,57 +3,53 @@
 #include "function_proxy.h"
 
 #include <algorithm>
+#include <cstdint>
 
 namespace LuaMix::Impl {
+	/* registry引用，复制的 LuaRef 共享同一个槽位：
+	 * 槽位的引用计数保存在堆上，复制只增加计数，最后一个 LuaRef 析构时才 luaL_unref；
+	 * nil 与无效引用不占用槽位，也没有计数。计数不是原子的，LuaRef 只能在脚本线程上使用
+	*/
 	class LuaRef {
 	private:
 		lua_State* state_;
 		int ref_;
+		std::uint32_t* count_;	// 共享槽位的 LuaRef 个数，ref_ 不占用槽位时为空
 
 	public:
 		constexpr LuaRef()
 			: state_(nullptr)
-			, ref_(LUA_NOREF) {}
+			, ref_(LUA_NOREF)
+			, count_(nullptr) {}
 
 		LuaRef(lua_State* L, std::nullptr_t)
 			: state_(L)
-			, ref_(LUA_REFNIL) {}
+			, ref_(LUA_REFNIL)
+			, count_(nullptr) {}
 
 		LuaRef(lua_State* L, int index)
 			: state_(L) {
 			lua_pushvalue(state_, index);
 			ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+			count_ = share(ref_);
 		}
 
-		LuaRef(const LuaRef& that)
-			: state_(that.state_) {
-			if (state_) {
-				lua_rawgeti(state_, LUA_REGISTRYINDEX, that.ref_);
-				ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
-			} else {
-				ref_ = LUA_NOREF;
+		LuaRef(const LuaRef& that) noexcept
+			: state_(that.state_)
+			, ref_(that.ref_)
+			, count_(that.count_) {
+			if (count_) {
+				++*count_;
 			}
 		}
 
-		LuaRef& operator = (const LuaRef& that) {
-			if (this != &that) {
-				if (state_) {
-					luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
-				}
-				state_ = that.state_;
-				if (state_) {
-					lua_rawgeti(state_, LUA_REGISTRYINDEX, that.ref_);
-					ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
-				} else {
-					ref_ = LUA_NOREF;
-				}
-			}
-			return *this;
+		LuaRef& operator = (const LuaRef& that) noexcept {
+			return *this = LuaRef(that);
 		}
 
 		LuaRef& operator = (std::nullptr_t) {
 			if (state_) {
-				luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
+				release();
 				ref_ = LUA_REFNIL;
 			}
 			return *this;
@@ -61,20 +57,21 @@ namespace LuaMix::Impl {
 
 		LuaRef(LuaRef&& that) noexcept
 			: state_(that.state_)
-			, ref_(that.ref_) {
+			, ref_(that.ref_)
+			, count_(that.count_) {
 			that.ref_ = LUA_NOREF;
+			that.count_ = nullptr;
 		}
 
 		LuaRef& operator = (LuaRef&& that) noexcept {
 			std::swap(state_, that.state_);
 			std::swap(ref_, that.ref_);
+			std::swap(count_, that.count_);
 			return *this;
 		}
 
 		~LuaRef() {
-			if (state_) {
-				luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
-			}
+			release();
 		}
 
 	public:
@@ -86,7 +83,7 @@ namespace LuaMix::Impl {
 			return ref_;
 		}
 
-		// ֻʽ༭ʽתҪʽתͨҲӦõ:-)
+		// 只有在条件表达式中允许编辑器隐式转换，其他情况需要显式转换（通常也不应该用到:-)）
 		explicit operator bool() const {
 			return ref_ != LUA_NOREF && ref_ != LUA_REFNIL;
 		}
@@ -367,6 +364,21 @@ namespace LuaMix::Impl {
 		explicit LuaRef(lua_State* L)
 			: state_(L) {
 			ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+			count_ = share(ref_);
+		}
+
+		static std::uint32_t* share(int ref) {
+			return ref > 0 ? new std::uint32_t(1) : nullptr;
+		}
+
+		// 放弃对槽位的共享，最后一个持有者释放槽位
+		void release() noexcept {
+			if (count_ && 0 == --*count_) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
+				delete count_;
+			}
+			count_ = nullptr;
+			ref_ = LUA_NOREF;
 		}
 
 	private:
@@ -392,7 +404,7 @@ namespace LuaMix::Impl {
 		static int destructFunctionObj(lua_State* L) {
 			try {
 				T* obj = static_cast<T*>(lua_touserdata(L, 1));
-				obj->~T();  // עֻͷڴ棬ڴlua
+				obj->~T();  // 注意这里只能析构，不能释放内存，内存块是由lua管理的
 				return 0;
 			} catch (std::exception& e) {
 				return luaL_error(L, "%s", e.what());
@@ -401,7 +413,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ػ LuaRef
+	// 特化 LuaRef
 	template <>
 	struct _type_mix_spec<LuaRef> {
 		using ArgHoldType = LuaRef;
@@ -3,10 +3,13 @@
 #include <stdexcept>
 
 #include "lua_ref.h"
+#include "finalizer.h"
+#include "alloc_mix.h"
+#include "object_pool.h"
 
 namespace LuaMix::Impl {
 	//////////////////////////////////////////////////////////////////////////
-	// ȫַ
+	// 全局方法
 	struct MixMetaEvent {
 		static void Init(lua_State* L) {
 			StackGuard _guard(L);
@@ -18,17 +21,18 @@ namespace LuaMix::Impl {
 				lua_pushboolean(L, 1);				// :nil, key, flag
 				lua_rawset(L, LUA_REGISTRYINDEX);	// :nil
 
-				// ӹڵud
+				// 接管生命周期的ud集合
 				lua_pushstring(L, LUAMIX_KEY_COLLECT);	// :nil, key
 				lua_newtable(L);						// :nil, key, tb
 				lua_rawset(L, LUA_REGISTRYINDEX);		// :nil
 
-				// ߺ
+				// 工具函数
 				static const luaL_Reg util_funcs[] = {
 					{"TakeOwnership", TakeOwnership},
 					{"ReleaseOwnership", ReleaseOwnership},
 					{"GetPeer", GetPeer},
 					{"SetPeer", SetPeer},
+					{"MemoryStats", MemoryStats},
 					{NULL, NULL}
 				};
 				luaL_newlib(L, util_funcs);
@@ -38,7 +42,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ģԪ
+	// 模块元方法
 	struct ModuleMetaEvent {
 		static int index(lua_State* L) {
 			lua_getmetatable(L, 1);		// : tb, key, mt
@@ -74,7 +78,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ģ
+	// 模块
 	class ModuleMeta {
 	public:
 		ModuleMeta(LuaRef m)
@@ -96,7 +100,7 @@ namespace LuaMix::Impl {
 			return module_;
 		}
 
-		// עắ
+		// 注册函数
 		template <typename F>
 		ModuleMeta& Function(const char *name, const F& fn) {
 			using FuncProxy = CppFuncProxy<F>;
@@ -104,7 +108,7 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// ע
+		// 注册属性
 		template <typename FG, typename FS>
 		ModuleMeta& Property(const char *name, const FG& get, const FS& set) {
 			if constexpr (!std::is_same_v<FG, std::nullptr_t>) {
@@ -142,7 +146,7 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// עű
+		// 注册脚本变量
 		template <typename T>
 		ModuleMeta& ScriptVal(const char *name, T val) {
 			module_.RawSet(name, val);
@@ -167,10 +171,10 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// Ԫ
+	// 类元方法
 	struct ClassMetaEvent {
 		static int index(lua_State* L) {
-			// peer
+			// 优先peer表
 			int peer_type = lua_getuservalue(L, 1);
 			if (peer_type == LUA_TTABLE) { // :ud, key, peer
 				lua_pushvalue(L, 2); // :ud, key, peer, key
@@ -179,7 +183,7 @@ namespace LuaMix::Impl {
 				}
 			}
 			lua_settop(L, 2); // :ud, key
-			// Ԫ
+			// 元表
 			lua_pushvalue(L, 1); // :ud, key, ud
 			while (lua_getmetatable(L, -1)) { // :ud, key, ud, mt
 				lua_remove(L, -2); // :ud, key, mt
@@ -188,7 +192,7 @@ namespace LuaMix::Impl {
 					return 1;
 				}
 				lua_pop(L, 1);	// :ud, key, mt
-				// 
+				// 检索属性
 				lua_pushstring(L, MetaKeyGet); // :ud, key, mt, MetaKeyGet
 				if (lua_rawget(L, -2) == LUA_TTABLE) { // :ud, key, mt, mt[".get"]
 					lua_pushvalue(L, 2); // :ud, key, mt, mt[".get"], key
@@ -211,7 +215,7 @@ namespace LuaMix::Impl {
 			lua_getmetatable(L, 1);
 			while (lua_istable(L, -1)) // :ud, k, v, mt
 			{
-				// 
+				// 检索属性
 				lua_pushstring(L, MetaKeySet); // :ud, k, v, mt, MetaKeySet
 				if (lua_rawget(L, -2) == LUA_TTABLE) { // :ud, k, v, mt, mt[".set"]
 					lua_pushvalue(L, 2); // :ud, k, v, mt, mt[".set"], k
@@ -236,7 +240,7 @@ namespace LuaMix::Impl {
 				lua_remove(L, -2); // :ud, k, v, nmt
 			}
 			lua_settop(L, 3); // :ud, k, v
-			// 浽peer
+			// 保存到peer表中
 			if (LUA_TUSERDATA == self_type) {
 				if (lua_getuservalue(L, 1) == LUA_TNIL) {
 					lua_pop(L, 1);
@@ -257,25 +261,45 @@ namespace LuaMix::Impl {
 
 		template <typename C>
 		static int gc(lua_State *L) {
-			// ע⣬жǷudڴԪ̳еԪ˸ԪҲfinalizeṛlua5.3ʼ
+			// 注意，这里先判断是否是ud，由于存在元表继承的情况，子类的元表由于设置了父类的元表，而导致其也会走finalizer流程（lua5.3开始）
 			if (LUA_TUSERDATA != lua_type(L, 1)) {
 				return 0;
 			}
-			// ѯȫgcȷǷҪ
+			// 查询全局gc表，以确定是否需要析构
 			void* ud = *((void**)lua_touserdata(L, 1));
 			lua_pushstring(L, LUAMIX_KEY_COLLECT);
 			lua_rawget(L, LUA_REGISTRYINDEX); // :ud, collect
 
 			if (LUA_TNUMBER == lua_rawgetp(L, -1, ud)) {
-				// ҳӦgc
+				// 对象即将回收，先冲减其外部内存
+				ReleaseExternalSize(L, ud);
 				luaL_getmetatable(L, ClassTypeSignature<C>::Value()); // :ud, collect, gc_id, mt
+				// 延迟回收：只将指针入队，回收函数由后台线程或安全点执行
+				lua_pushstring(L, MetaKeyDeferred); // :ud, collect, gc_id, mt, ".deferred"
+				if (LUA_TBOOLEAN == lua_rawget(L, -2) && lua_toboolean(L, -1)) { // :ud, collect, gc_id, mt, deferred
+					if (auto finalizer = Finalizer::Find(L)) {
+						lua_pushstring(L, MetaKeyGCNative); // :ud, collect, gc_id, mt, deferred, ".gcn"
+						// PooledFactory 等没有原生回收函数的工厂不创建 .gcn，仍然同步回收
+						if (LUA_TTABLE == lua_rawget(L, -3)) { // :ud, collect, gc_id, mt, deferred, .gcn
+							lua_rawgeti(L, -1, lua_tointeger(L, 3)); // :ud, collect, gc_id, mt, deferred, .gcn, collector
+						}
+						if (auto collector = static_cast<ClassCollector<C>*>(lua_touserdata(L, -1))) {
+							finalizer->Push({ &ClassCollector<C>::Invoke, collector->Attach(*finalizer), ud });
+							lua_pushnil(L);
+							lua_rawsetp(L, 2, ud);
+							return 0;
+						}
+					}
+				}
+				lua_settop(L, 4); // :ud, collect, gc_id, mt
+				// 找出对应的gc函数
 				lua_pushstring(L, MetaKeyGC); // :ud, collect, gc_id, mt, ".gc"
 				lua_rawget(L, -2); // :ud, collect, gc_id, mt, .gc
 				lua_rawgeti(L, -1, lua_tointeger(L, -3)); // :ud, collect, gc_id, mt, .gc, gc_fn
 				lua_pushvalue(L, 1); // :ud, collect, gc_id, mt, .gc, gc_fn, ud
-				// ﲻжϣֱӵãֱ쳣
+				// 这里不做判断，直接调用，如果出错，就直接引发异常
 				lua_call(L, 1, 0); // :ud, collect, gc_id, mt, .gc
-				// 
+				// 最后清理标记
 				lua_pushnil(L); // :ud, collect, gc_id, mt, .gc, nil
 				lua_rawsetp(L, 2, ud); // :ud, collect, gc_id, mt, .gc
 			}
@@ -293,10 +317,10 @@ namespace LuaMix::Impl {
 			mt.RawSet("__gc", &gc<C>);
 		}
 
-		/* BuildSupersuperBuildSuperˣᵼsupersuperԼsuper
-		 * ӳУֽűһָ룬Ȼٽָ游ָѹʱ
-		 * ԭᱻ°Ϊ游ӦԭԱȱʧ
-		 * Ȼʱ޳ױķΨһľǵʱռ̳˳򣬴Ӹ࿪ʼε࣬ⱾǺȻ飻
+		/* 如果BuildSuper后，其super又BuildSuper了，则会导致super的super不是自己的super；
+		 * 反映到代码运行中，会出现脚本中已有一个孙子类对象指针，然后再将此指针以祖父类指针压入时，
+		 * 对象的原表会被重新绑定为祖父类对应的原表，导致其成员方法缺失！
+		 * 然而，这种情况暂时并无彻底避免的方法，唯一可以做的就是导出类时，依照继承顺序，从父类开始依次导出子孙类，这本身就是很自然的事情；
 		*/
 		static void BuildSuper(LuaRef cur, LuaRef super) {
 			auto cur_super = cur.RawGet(MetaKeySuper);
@@ -309,7 +333,7 @@ namespace LuaMix::Impl {
 		}
 
 		static void BuildInhertance(LuaRef child, LuaRef parent) {
-			// ubox
+			// 共享ubox
 			if (auto parent_ubox = parent.RawGet(MetaKeyUBox)) {
 				child.RawSet(MetaKeyUBox, parent_ubox);
 			} else if (auto child_ubox = child.RawGet(MetaKeyUBox)) {
@@ -321,13 +345,13 @@ namespace LuaMix::Impl {
 				parent.RawSet(MetaKeyUBox, ubox);
 				child.RawSet(MetaKeyUBox, ubox);
 			}
-			// Ԫ̳
+			// 元表继承
 			child.SetMetatable(parent);
 		}
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ԪϢ
+	// 类元信息
 	template <typename C>
 	class ClassMeta {
 	public:
@@ -338,7 +362,7 @@ namespace LuaMix::Impl {
 		{
 			MixMetaEvent::Init(state_);
 
-			// ｫַڻluaУͨעסһջ
+			// 这里将字符串内化到lua中，并通过注册表挂住，以免引用了一个栈变量
 			class_name = lua_pushstring(state_, class_name);
 			luaL_ref(state_, LUA_REGISTRYINDEX);
 			const_name = lua_pushstring(state_, const_name);
@@ -378,7 +402,7 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// עԱ
+		// 注册成员方法
 		template <typename M>
 		ClassMeta<C>& Method(const char* name, const M& method) {
 			auto wrap = std::mem_fn(method);
@@ -387,7 +411,7 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// עԱΪ
+		// 注册成员变量为属性
 		template <typename V>
 		ClassMeta<C>& Property(const char* name, V C::* member) {
 			auto wrap = std::mem_fn(member);
@@ -405,7 +429,7 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// עᾲ̬ԱΪ
+		// 注册静态成员变量为属性
 		template <typename P>
 		ClassMeta<C>& StaticProperty(const char *name, P& prop, bool is_read_only = false) {
 			auto gets = class_mt_.RawGet(MetaKeyGet);
@@ -425,7 +449,7 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// עⲿʽ
+		// 注册外部函数形式的属性
 		template <typename FG, typename FS>
 		ClassMeta<C>& Property(const char *name, const FG& get, const FS& set) {
 			if constexpr (!std::is_same_v<FG, std::nullptr_t>) {
@@ -455,7 +479,7 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// עắҪھ̬ԱⲿԱ
+		// 注册函数；主要用于静态成员函数，亦可用于类外部扩充成员函数
 		template <typename F>
 		ClassMeta<C>& Function(const char *name, const F& fn) {
 			using FuncProxy = CppFuncProxy<F>;
@@ -463,33 +487,34 @@ namespace LuaMix::Impl {
 			return *this;
 		}
 
-		// עlua_CFunctionհ
+		// 注册lua_CFunction闭包
 		template <typename... Ts>
 		ClassMeta<C>& CClosure(const char* name, lua_CFunction fn, Ts&&... ups) {
 			class_mt_.RawSet(name, LuaRef::MakeCClosure(state_, fn, std::forward<Ts>(ups)...));
 			return *this;
 		}
 
-		// עṤպ
+		// 注册工厂及回收函数
 		template <typename FF, typename FC>
 		ClassMeta<C>& Factory(const char* name, const FF& factory, const FC& collect) {
 			if (!class_mt_.RawGet(MetaKeyGC)) {
 				class_mt_.RawSet(MetaKeyGC, LuaRef::MakeTable(state_));
 			}
 
-			// עպ
+			// 先注册回收函数
 			using GCProxy = CppFuncProxy<FC>;
 			auto gcs = class_mt_.RawGet(MetaKeyGC);
 			gcs.RawSet(gcs.Len() + 1, LuaRef::MakeFunction(state_, GCProxy::Proxy, GCProxy::Function(collect)));
+			addNativeCollector(gcs.Len(), GCProxy::Function(collect));
 
-			// עṤעҪӦĻպid
-			using FactoryProxy = CppFactoryProxy<FF>;
+			// 注册工厂函数，注意需要对应的回收函数的id
+			using FactoryProxy = CppFactoryProxy<FF, C>;
 			class_mt_.RawSet(name, LuaRef::MakeFactory(state_, FactoryProxy::Factory, FactoryProxy::Function(factory), gcs.Len()));
 
 			return *this;
 		}
 
-		// עĬϹպ
+		// 注册默认工厂及回收函数
 		ClassMeta<C>& DefaultFactory() {
 			if (!class_mt_.RawGet(MetaKeyGC)) {
 				class_mt_.RawSet(MetaKeyGC, LuaRef::MakeTable(state_));
@@ -498,25 +523,87 @@ namespace LuaMix::Impl {
 			using GCProxy = CppFuncProxy<decltype(&defaultGC)>;
 			auto gcs = class_mt_.RawGet(MetaKeyGC);
 			gcs.RawSet(gcs.Len() + 1, LuaRef::MakeFunction(state_, GCProxy::Proxy, GCProxy::Function(&defaultGC)));
+			addNativeCollector(gcs.Len(), &defaultGC);
 
-			using FactoryProxy = CppFactoryProxy<decltype(&defaultFactory)>;
+			using FactoryProxy = CppFactoryProxy<decltype(&defaultFactory), C>;
 			class_mt_.RawSet("__call", LuaRef::MakeFactory(state_, FactoryProxy::Factory, FactoryProxy::Function(&defaultFactory), gcs.Len()));
 
 			return *this;
 		}
 
-		// עű
+		/* 注册带对象池的默认工厂：
+		 * 脚本对象回收时，对象经过 reset 后放回本状态机的空闲链表，至多保留 capacity 个，工厂优先复用；
+		 * capacity 应不小于一个GC周期内产生的垃圾对象数，否则多出的对象仍会直接释放。
+		 * 池中对象只在脚本线程上复用，因此不受 DeferredCollect 影响，总是同步回收。
+		*/
+		ClassMeta<C>& PooledFactory(std::size_t capacity = 4096, std::function<void(C*)> reset = nullptr) {
+			if (!class_mt_.RawGet(MetaKeyGC)) {
+				class_mt_.RawSet(MetaKeyGC, LuaRef::MakeTable(state_));
+			}
+
+			using Pool = ObjectPool<C>;
+			Pool::Create(state_, class_mt_, capacity, std::move(reset));
+			auto pool = class_mt_.RawGet(MetaKeyPool);
+
+			auto gcs = class_mt_.RawGet(MetaKeyGC);
+			int gc_id = gcs.Len() + 1;
+			gcs.RawSet(gc_id, LuaRef::MakeCClosure(state_, &Pool::Collect, pool));
+			class_mt_.RawSet("__call", LuaRef::MakeCClosure(state_, &Pool::Factory, pool, gc_id));
+
+			return *this;
+		}
+
+		// 对象池统计，未注册 PooledFactory 时返回 nullptr
+		const ObjectPoolStats* PoolStats() const {
+			auto pool = ObjectPool<C>::Find(class_mt_);
+			return pool ? &pool->GetStats() : nullptr;
+		}
+
+		// 注册脚本变量
 		template <typename T>
 		ClassMeta<C>& ScriptVal(const char* name, T val) {
 			class_mt_.RawSet(name, val);
 			return *this;
 		}
 
+		// 回收策略：开启后脚本对象的回收函数不在GC过程中执行，而是交给状态机的 Finalizer
+		// 状态机没有安装 Finalizer 时仍同步回收；回收函数可能运行在后台线程，需要保证线程安全
+		// 策略记录在本状态机的类元表中，不影响其它状态机中的同一个类
+		ClassMeta<C>& DeferredCollect(bool deferred = true) {
+			class_mt_.RawSet(MetaKeyDeferred, deferred);
+			return *this;
+		}
+
+		/* 外部内存记账：size_of 返回对象持有的、lua分配器之外的内存字节数，不能抛出异常；
+		 * 脚本工厂创建对象后据此计入GC债务，对象回收时冲减，之后大小的变化需调用 UpdateExternalSize 同步。
+		 * 大小函数记录在本状态机的类元表中，不影响其它状态机中的同一个类。
+		*/
+		ClassMeta<C>& ExternalSize(std::function<std::size_t(const C*)> size_of) {
+			class_mt_.Push();								// :mt
+			lua_pushstring(state_, MetaKeyExternalSize);	// :mt, ".extsize"
+			ClassExternalSize<C>::Create(state_, std::move(size_of));	// :mt, ".extsize", size
+			lua_rawset(state_, -3);							// :mt
+			lua_pop(state_, 1);
+			return *this;
+		}
+
 		LuaRef RefClassMetatable() const {
 			return class_mt_;
 		}
 
 	private:
+		template <typename FC>
+		void addNativeCollector(int gc_id, const FC& collect) {
+			if (!class_mt_.RawGet(MetaKeyGCNative)) {
+				class_mt_.RawSet(MetaKeyGCNative, LuaRef::MakeTable(state_));
+			}
+			auto gcn = class_mt_.RawGet(MetaKeyGCNative);
+			gcn.Push();
+			ClassCollector<C>::Create(state_, collect);
+			lua_rawseti(state_, -2, gc_id);
+			lua_pop(state_, 1);
+		}
+
 		static C * defaultFactory() {
 			return new C;
 		}
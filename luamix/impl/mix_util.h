@@ -4,11 +4,15 @@
 #include "lauxlib.h"
 
 #include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
 
 namespace LuaMix::Impl
 {
 	//////////////////////////////////////////////////////////////////////////
-	// ջ
+	// 栈保护
 	struct StackGuard {
 		int top_;
 		lua_State* state_;
@@ -23,12 +27,60 @@ namespace LuaMix::Impl
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// 쳣
+	// 注册表键
+	inline constexpr const char* LUAMIX_KEY_INIT = "luamix_init";
+	inline constexpr const char* LUAMIX_KEY_COLLECT = "luamix_collect";
+	inline constexpr const char* LUAMIX_KEY_FINALIZER = "luamix_finalizer";
+	inline constexpr const char* LUAMIX_KEY_EXTERNAL = "luamix_external";
+	inline constexpr const char* LUAMIX_KEY_TRACEBACK = "luamix_traceback";	// 以地址作为 lua_rawgetp 的键
+	inline constexpr const char* LUAMIX_KEY_SCHEDULER = "luamix_scheduler";	// 以地址作为 lua_rawgetp 的键
+	inline constexpr const char* LUAMIX_KEY_BUDGET = "luamix_budget";		// 以地址作为 lua_rawgetp 的键
+
+	// FNV-1a，字节码缓存、脚本归档的索引与错误信息的比对使用
+	inline std::uint64_t HashBytes(const char* data, std::size_t size) {
+		std::uint64_t hash = 14695981039346656037ull;
+		for (std::size_t i = 0; i < size; ++i) {
+			hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 异常
+	// 调用栈中的一层，对应 luaL_traceback 输出的一行
+	struct TraceFrame {
+		char source[LUA_IDSIZE];	// short_src
+		char namewhat[16];
+		char name[48];				// 过长时截断
+		int line;					// currentline，没有时为 -1
+		int linedefined;
+		char what;					// 'L'ua、'C'、'm'ain
+		bool tailcall;
+	};
+
+	/* 每个状态机一份的调用栈捕获区，由常驻的错误处理函数写入，LuaException 构造时取走：
+	 * 以错误信息的长度与哈希确认捕获的是同一个错误，不会把之前未取走的调用栈挂到无关的异常上
+	*/
+	struct TraceCapture {
+		static constexpr int kLevels1 = 10;	// 与 luaL_traceback 相同：调用栈过深时保留前10层与后11层
+		static constexpr int kLevels2 = 11;
+
+		std::size_t msg_len;
+		std::uint64_t msg_hash;
+		int count;
+		int gap;		// 在此层之前省略了中间的调用，-1 表示没有省略
+		bool pending;
+		TraceFrame frames[kLevels1 + kLevels2];
+	};
+
 	class LuaException : public std::exception {
 	public:
 		explicit LuaException(lua_State* L) noexcept {
-			if (lua_gettop(L) > 0) {
-				what_ = lua_tostring(L, -1);
+			if (lua_gettop(L) > 0 && lua_isstring(L, -1)) {
+				std::size_t len = 0;
+				const char* msg = lua_tolstring(L, -1, &len);
+				what_.assign(msg, len);
+				traced_ = TakeTrace(L, msg, len, frames_, gap_);
 			} else {
 				what_ = "unknown error";
 			}
@@ -40,36 +92,210 @@ namespace LuaMix::Impl
 		explicit LuaException(const std::string& msg) noexcept
 			: what_(msg) {}
 
+		// 带调用栈时，调用栈文本在第一次读取时才生成
 		const char* what() const noexcept {
-			return what_.c_str();
+			if (!traced_) {
+				return what_.c_str();
+			}
+			if (rendered_.empty()) {
+				try {
+					rendered_ = what_ + RenderTrace(frames_, gap_);
+				} catch (...) {
+					return what_.c_str();
+				}
+			}
+			return rendered_.c_str();
+		}
+
+		// 不含调用栈的错误信息
+		const std::string& Message() const noexcept {
+			return what_;
+		}
+
+		// 错误处理函数捕获的调用栈，由内向外；调用栈过深时中间的层被省略
+		const std::vector<TraceFrame>& Frames() const noexcept {
+			return frames_;
 		}
 
 	public:
-		// ջ׷
+		/* 压入常驻的错误处理函数，用作 lua_pcall 的 msgh：
+		 * 函数与捕获区在每个状态机中只创建一次，出错时只记录各层的源文件、行号与函数名，不拼接调用栈文本
+		*/
+		static void PushTraceback(lua_State* L) {
+			if (LUA_TFUNCTION == lua_rawgetp(L, LUA_REGISTRYINDEX, LUAMIX_KEY_TRACEBACK)) {
+				return;
+			}
+			lua_pop(L, 1);
+			auto capture = static_cast<TraceCapture*>(lua_newuserdata(L, sizeof(TraceCapture)));	// :capture
+			capture->pending = false;
+			lua_pushcclosure(L, &captureTraceback, 1);			// :handler
+			lua_pushvalue(L, -1);								// :handler, handler
+			lua_rawsetp(L, LUA_REGISTRYINDEX, LUAMIX_KEY_TRACEBACK);	// :handler
+		}
+
+		// 取走捕获区中与错误信息 msg 匹配的调用栈，没有匹配的调用栈时返回 false
+		static bool TakeTrace(lua_State* L, const char* msg, std::size_t len, std::vector<TraceFrame>& frames, int& gap) {
+			bool taken = false;
+			if (LUA_TFUNCTION == lua_rawgetp(L, LUA_REGISTRYINDEX, LUAMIX_KEY_TRACEBACK)) {
+				lua_getupvalue(L, -1, 1);
+				auto capture = static_cast<TraceCapture*>(lua_touserdata(L, -1));
+				if (capture->pending && msg && capture->msg_len == len && capture->msg_hash == HashBytes(msg, len)) {
+					frames.assign(capture->frames, capture->frames + capture->count);
+					gap = capture->gap;
+					taken = true;
+				}
+				capture->pending = false;
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+			return taken;
+		}
+
+		// 与 luaL_traceback 的格式相同，只是不在 package.loaded 中查找函数的全局名
+		static std::string RenderTrace(const std::vector<TraceFrame>& frames, int gap) {
+			std::string text = "\nstack traceback:";
+			for (int i = 0; i < static_cast<int>(frames.size()); ++i) {
+				if (i == gap) {
+					text += "\n\t...";
+				}
+				auto& frame = frames[i];
+				text += "\n\t";
+				text += frame.source;
+				text += ":";
+				if (frame.line > 0) {
+					text += std::to_string(frame.line) + ":";
+				}
+				text += " in ";
+				if (frame.namewhat[0]) {
+					text += std::string(frame.namewhat) + " '" + frame.name + "'";
+				} else if (frame.what == 'm') {
+					text += "main chunk";
+				} else if (frame.what != 'C') {
+					text += std::string("function <") + frame.source + ":" + std::to_string(frame.linedefined) + ">";
+				} else {
+					text += "?";
+				}
+				if (frame.tailcall) {
+					text += "\n\t(...tail calls...)";
+				}
+			}
+			return text;
+		}
+
+		/* 捕获因出错而停止的协程 co 的调用栈，用于 lua_resume 出错之后：
+		 * L 栈顶的错误对象被替换为错误信息，调用栈记入 L 的捕获区，由随后的 ScriptError::Set 取走
+		*/
+		static void CaptureTrace(lua_State* L, lua_State* co) {
+			int top = lua_gettop(L);
+			PushTraceback(L);									// :err, handler
+			lua_getupvalue(L, -1, 1);							// :err, handler, capture
+			auto capture = static_cast<TraceCapture*>(lua_touserdata(L, -1));
+			lua_settop(L, top);									// :err
+			toMessage(L, top);
+			lua_copy(L, -1, top);
+			lua_settop(L, top);									// :msg
+			std::size_t len = 0;
+			const char* msg = lua_tolstring(L, top, &len);
+			fillTrace(capture, co, 0, msg, len);
+		}
+
+		// 调用栈追溯
 		static int StackTraceback(lua_State* L) {
-			auto msg = lua_tostring(L, 1);
+			auto msg = toMessage(L);
+			// 追加调用栈信息
+			luaL_traceback(L, L, msg, 1);
+			return 1;
+		}
+
+	private:
+		static const char* toMessage(lua_State* L, int index = 1) {
+			auto msg = lua_tostring(L, index);
 			if (!msg) {
-				if (luaL_callmeta(L, 1, "__tostring") && lua_type(L, -1) == LUA_TSTRING) {
-					// ͨԪtostringΪϢ
+				if (luaL_callmeta(L, index, "__tostring") && lua_type(L, -1) == LUA_TSTRING) {
+					// 如果错误对象可以通过元方法tostring，则视其结果为错误信息
 					msg = lua_tostring(L, -1);
 				} else {
-					msg = lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, 1));
+					msg = lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, index));
 				}
 			}
-			// ׷ӵջϢ
-			luaL_traceback(L, L, msg, 1);
+			return msg;
+		}
+
+		static void copyText(char* dst, std::size_t size, const char* src) {
+			std::size_t len = src ? std::strlen(src) : 0;
+			len = len < size ? len : size - 1;
+			std::memcpy(dst, src ? src : "", len);
+			dst[len] = '\0';
+		}
+
+		static int lastLevel(lua_State* L) {
+			lua_Debug ar;
+			int li = 1, le = 1;
+			while (lua_getstack(L, le, &ar)) {
+				li = le;
+				le *= 2;
+			}
+			while (li < le) {
+				int m = (li + le) / 2;
+				if (lua_getstack(L, m, &ar)) {
+					li = m + 1;
+				} else {
+					le = m;
+				}
+			}
+			return le - 1;
+		}
+
+		// 常驻的错误处理函数：upvalue(1) 为捕获区，返回转换后的错误信息本身
+		static int captureTraceback(lua_State* L) {
+			auto capture = static_cast<TraceCapture*>(lua_touserdata(L, lua_upvalueindex(1)));
+			toMessage(L);
+			std::size_t len = 0;
+			const char* msg = lua_tolstring(L, -1, &len);
+			fillTrace(capture, L, 1, msg, len);
 			return 1;
 		}
 
+		// 从 L 的第 level 层开始记录调用栈
+		static void fillTrace(TraceCapture* capture, lua_State* L, int level, const char* msg, std::size_t len) {
+			capture->msg_len = len;
+			capture->msg_hash = HashBytes(msg, len);
+			capture->count = 0;
+			capture->gap = -1;
+			capture->pending = true;
+
+			lua_Debug ar;
+			int last = lastLevel(L);
+			// 共有 last - level + 1 层，超过 kLevels1 + kLevels2 层时才省略中间的层
+			int n1 = (last - level + 1 > TraceCapture::kLevels1 + TraceCapture::kLevels2) ? TraceCapture::kLevels1 : -1;
+			while (capture->count < TraceCapture::kLevels1 + TraceCapture::kLevels2 && lua_getstack(L, level++, &ar)) {
+				if (n1-- == 0) {
+					capture->gap = capture->count;
+					level = last - TraceCapture::kLevels2 + 1;
+					continue;
+				}
+				lua_getinfo(L, "Slnt", &ar);
+				auto& frame = capture->frames[capture->count++];
+				copyText(frame.source, sizeof(frame.source), ar.short_src);
+				copyText(frame.namewhat, sizeof(frame.namewhat), ar.namewhat);
+				copyText(frame.name, sizeof(frame.name), ar.name);
+				frame.line = ar.currentline;
+				frame.linedefined = ar.linedefined;
+				frame.what = ar.what[0] == 'm' ? 'm' : (ar.what[0] == 'C' ? 'C' : 'L');
+				frame.tailcall = ar.istailcall != 0;
+			}
+		}
+
 	private:
 		std::string what_;
+		std::vector<TraceFrame> frames_;
+		int gap_ = -1;
+		bool traced_ = false;
+		mutable std::string rendered_;
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ߺ
-	
-	inline constexpr const char* LUAMIX_KEY_INIT = "luamix_init";
-	inline constexpr const char* LUAMIX_KEY_COLLECT = "luamix_collect";
+	// 工具函数
 
 	inline int MakeScriptValRef(lua_State *L, const char *path) {
 		StackGuard _guard(L);
@@ -102,7 +328,7 @@ namespace LuaMix::Impl
 		return luaL_ref(L, LUA_REGISTRYINDEX);
 	}
 
-	// ӹuserdata
+	// 接管userdata的生命周期
 	inline int TakeOwnership(lua_State *L) {
 		if (LUA_TUSERDATA != lua_type(L, 1)) {
 			return 0;
@@ -115,7 +341,7 @@ namespace LuaMix::Impl
 		return 0;
 	}
 
-	// ͷuserdataڹ
+	// 释放userdata生命周期管理
 	inline int ReleaseOwnership(lua_State *L) {
 		if (LUA_TUSERDATA != lua_type(L, 1)) {
 			return 0;
@@ -130,7 +356,7 @@ namespace LuaMix::Impl
 		return 0;
 	}
 
-	// ȡuserdatapeer
+	// 获取userdata的peer表
 	inline int GetPeer(lua_State *L) {
 		if (lua_type(L, 1) != LUA_TUSERDATA) {
 			lua_pushnil(L);
@@ -140,7 +366,7 @@ namespace LuaMix::Impl
 		return 1;
 	}
 
-	// userdatapeer
+	// 设置userdata的peer表
 	inline int SetPeer(lua_State* L) {
 		luaL_checktype(L, 1, LUA_TUSERDATA);
 		luaL_checktype(L, 2, LUA_TTABLE);
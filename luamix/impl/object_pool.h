@@ -0,0 +1,143 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+
+#include "lua_ref.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// 对象池统计
+	struct ObjectPoolStats {
+		std::size_t created;		// 新建对象数
+		std::size_t reused;			// 从空闲链表复用的对象数
+		std::size_t released;		// 回收进池的对象数
+		std::size_t dropped;		// 池满而直接释放的对象数
+		std::size_t free_objects;	// 当前空闲对象数
+	};
+
+	/* 按状态机划分的对象池，作为full userdata保存在类元表的 .pool 字段中：
+	 * 脚本对象回收时，C* 经过 reset 后放回空闲链表，工厂再次创建时优先复用。
+	 * 承载对象的ud不做复活复用：lua5.3 中重新设置带 __gc 的元表需要线性查找 allgc 链表，
+	 * 代价远高于新建一个ud；ud的内存复用交给分配策略（如 PoolAlloc）。
+	*/
+	template <typename C>
+	class ObjectPool {
+	public:
+		using ResetFunc = std::function<void(C*)>;
+
+		ObjectPool(std::size_t capacity, ResetFunc reset)
+			: capacity_(capacity)
+			, reset_(std::move(reset))
+		{}
+
+		ObjectPool(const ObjectPool&) = delete;
+		ObjectPool& operator = (const ObjectPool&) = delete;
+
+	public:
+		const ObjectPoolStats& GetStats() {
+			stats_.free_objects = free_.size();
+			return stats_;
+		}
+
+		// 在类元表中建立对象池，返回池对象；池已存在时直接返回
+		static ObjectPool* Create(lua_State* L, LuaRef class_mt, std::size_t capacity, ResetFunc reset) {
+			if (auto pool = Find(class_mt)) {
+				return pool;
+			}
+			class_mt.Push();								// :mt
+			lua_pushstring(L, MetaKeyPool);					// :mt, ".pool"
+			auto pool = ::new (lua_newuserdata(L, sizeof(ObjectPool))) ObjectPool(capacity, std::move(reset)); // :mt, ".pool", pool
+			lua_createtable(L, 0, 1);						// :mt, ".pool", pool, pool_mt
+			lua_pushcfunction(L, &destruct);				// :mt, ".pool", pool, pool_mt, destruct
+			lua_setfield(L, -2, "__gc");					// :mt, ".pool", pool, pool_mt
+			lua_setmetatable(L, -2);						// :mt, ".pool", pool
+			lua_rawset(L, -3);								// :mt
+			lua_pop(L, 1);
+			return pool;
+		}
+
+		static ObjectPool* Find(LuaRef class_mt) {
+			auto L = class_mt.GetState();
+			class_mt.Push();								// :mt
+			lua_pushstring(L, MetaKeyPool);					// :mt, ".pool"
+			lua_rawget(L, -2);								// :mt, pool
+			auto pool = static_cast<ObjectPool*>(lua_touserdata(L, -1));
+			lua_pop(L, 2);
+			return pool;
+		}
+
+		// 工厂：upvalue(1) 为池对象，upvalue(2) 为回收函数id
+		static int Factory(lua_State* L) {
+			auto pool = static_cast<ObjectPool*>(lua_touserdata(L, lua_upvalueindex(1)));
+			C* obj = nullptr;
+			try {
+				obj = pool->acquire();
+			} catch (const std::exception& e) {
+				return luaL_error(L, "%s", e.what());
+			}
+
+			Push<C*>(L, obj);								// :ud
+
+			lua_pushstring(L, LUAMIX_KEY_COLLECT);			// :ud, "collect"
+			lua_rawget(L, LUA_REGISTRYINDEX);				// :ud, collect
+			lua_pushvalue(L, lua_upvalueindex(2));			// :ud, collect, gc_id
+			lua_rawsetp(L, -2, obj);						// :ud, collect
+			lua_pop(L, 1);									// :ud
+			ClassExternalSize<C>::Account(L, obj);
+			return 1;
+		}
+
+		// 回收函数，由 ClassMetaEvent::gc 调用：upvalue(1) 为池对象，参数为正在终结的ud
+		static int Collect(lua_State* L) {
+			auto pool = static_cast<ObjectPool*>(lua_touserdata(L, lua_upvalueindex(1)));
+			pool->release(*static_cast<C**>(lua_touserdata(L, 1)));
+			return 0;
+		}
+
+	private:
+		C* acquire() {
+			if (free_.empty()) {
+				++stats_.created;
+				return new C;
+			}
+			C* obj = free_.back();
+			free_.pop_back();
+			++stats_.reused;
+			return obj;
+		}
+
+		void release(C* obj) {
+			if (closed_ || free_.size() >= capacity_) {
+				++stats_.dropped;
+				delete obj;
+				return;
+			}
+			if (reset_) {
+				reset_(obj);
+			}
+			free_.push_back(obj);
+			++stats_.released;
+		}
+
+		// 状态机关闭时，池可能先于其中的对象终结，因此这里不析构池本身，只释放其持有的资源，
+		// 之后回收的对象直接释放；池的内存随ud一起由lua回收
+		static int destruct(lua_State* L) {
+			auto pool = static_cast<ObjectPool*>(lua_touserdata(L, 1));
+			pool->closed_ = true;
+			for (auto obj : pool->free_) {
+				delete obj;
+			}
+			std::vector<C*>().swap(pool->free_);
+			pool->reset_ = nullptr;
+			return 0;
+		}
+
+	private:
+		const std::size_t capacity_;
+		ResetFunc reset_;
+		bool closed_ = false;
+		std::vector<C*> free_;
+		ObjectPoolStats stats_{};
+	};
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector>
+#include <initializer_list>
+
+#include "lua_ref.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// 沙箱统计
+	struct SandboxStats {
+		std::size_t created;		// 新建的环境表数
+		std::size_t reused;			// 从池中复用的环境表数
+		std::size_t released;		// 清理后放回池中的环境表数
+		std::size_t free_envs;		// 当前池中的环境表数
+	};
+
+	/* 可复用的沙箱环境表：
+	 * 所有环境表共享同一个元表，其 __index 指向只读的后备表，__metatable 阻止脚本取得后备表；
+	 * 指定了允许的全局变量时，后备表只包含这些变量，并且它们在取出环境表时已直接写入表中，读取不走元方法；
+	 * 否则后备表就是全局表本身，脚本的写入只落在环境表中。
+	 * 环境表归还时清空后放回池中（清空不会收缩哈希部分），再次取出时不需要分配。
+	 * 沙箱持有状态机中的引用，必须在状态机关闭前析构。
+	*/
+	class Sandbox {
+	public:
+		Sandbox(lua_State* L, std::initializer_list<const char*> allowed = {}, std::size_t capacity = 16)
+			: state_(L)
+			, capacity_(capacity)
+			, preresolve_(allowed.size() > 0)
+		{
+			if (preresolve_) {
+				fallback_ = LuaRef::MakeTable(L);
+				auto globals = LuaRef::RefGlobal(L);
+				for (auto name : allowed) {
+					fallback_.RawSet(name, globals.RawGet(name));
+				}
+			} else {
+				fallback_ = LuaRef::RefGlobal(L);
+			}
+			meta_ = LuaRef::MakeTable(L);
+			meta_.RawSet("__index", fallback_);
+			meta_.RawSet("__metatable", false);
+		}
+
+		Sandbox(const Sandbox&) = delete;
+		Sandbox& operator = (const Sandbox&) = delete;
+
+	public:
+		const SandboxStats& GetStats() {
+			stats_.free_envs = free_.size();
+			return stats_;
+		}
+
+		// 取出一个环境表，允许的全局变量已写入其中
+		LuaRef Acquire() {
+			if (free_.empty()) {
+				++stats_.created;
+				auto env = LuaRef::MakeTable(state_);
+				env.SetMetatable(meta_);
+				populate(env);
+				return env;
+			}
+			LuaRef env = std::move(free_.back());
+			free_.pop_back();
+			++stats_.reused;
+			return env;
+		}
+
+		// 归还环境表：清空并重新写入允许的全局变量，池满时直接丢弃
+		void Release(LuaRef env) {
+			if (!env || free_.size() >= capacity_) {
+				return;
+			}
+			clear(env);
+			populate(env);
+			free_.push_back(std::move(env));
+			++stats_.released;
+		}
+
+	private:
+		void clear(const LuaRef& env) {
+			StackGuard _guard(state_);
+			env.Push();						// :env
+			lua_pushnil(state_);			// :env, nil
+			while (lua_next(state_, -2)) {	// :env, k, v
+				lua_pop(state_, 1);			// :env, k
+				lua_pushvalue(state_, -1);	// :env, k, k
+				lua_pushnil(state_);		// :env, k, k, nil
+				lua_rawset(state_, -4);		// :env, k
+			}
+		}
+
+		void populate(const LuaRef& env) {
+			if (!preresolve_) {
+				return;
+			}
+			StackGuard _guard(state_);
+			env.Push();						// :env
+			fallback_.Push();				// :env, fallback
+			lua_pushnil(state_);			// :env, fallback, nil
+			while (lua_next(state_, -2)) {	// :env, fallback, k, v
+				lua_pushvalue(state_, -2);	// :env, fallback, k, v, k
+				lua_insert(state_, -2);		// :env, fallback, k, k, v
+				lua_rawset(state_, -5);		// :env, fallback, k
+			}
+		}
+
+	private:
+		lua_State* state_;
+		const std::size_t capacity_;
+		const bool preresolve_;
+		LuaRef fallback_;
+		LuaRef meta_;
+		std::vector<LuaRef> free_;
+		SandboxStats stats_{};
+	};
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "script_call.h"
+#include "coroutine_pool.h"
+#include "timer_wheel.h"
+#include "meta_mix.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// Scheduler 运行的脚本任务，结束后可以取得结果或错误；必须在状态机关闭前析构
+	class ScriptTask {
+	public:
+		using Callback = std::function<void(ScriptTask&)>;
+
+	public:
+		bool IsDone() const {
+			return done_;
+		}
+
+		// 任务出错时的错误，成功或者未结束时没有错误
+		const ScriptError& GetError() const {
+			return error_;
+		}
+
+		// 任务函数的返回值，未结束或者出错时返回 std::nullopt
+		template <typename... Rs>
+		std::optional<std::tuple<Rs...>> Result() const {
+			if (!done_ || error_ || !results_.IsValid()) {
+				return std::nullopt;
+			}
+			lua_State* L = results_.GetState();
+			StackGuard _guard(L);
+			results_.Push();
+			int base = lua_gettop(L);
+			luaL_checkstack(L, sizeof...(Rs), "too many results");
+			for (int i = 1; i <= static_cast<int>(sizeof...(Rs)); ++i) {
+				lua_rawgeti(L, base, i);
+			}
+			return fetch<Rs...>(L, base + 1, std::index_sequence_for<Rs...>());
+		}
+
+		// 任务结束时在脚本线程上调用 cb，已经结束时立即调用
+		void Then(Callback cb) {
+			if (done_) {
+				cb(*this);
+			} else {
+				then_.push_back(std::move(cb));
+			}
+		}
+
+	private:
+		template <typename... Rs, std::size_t... Is>
+		static std::tuple<Rs...> fetch(lua_State* L, int first, std::index_sequence<Is...>) {
+			return std::tuple<Rs...>(Fetch<Rs>(L, first + static_cast<int>(Is))...);
+		}
+
+	private:
+		friend class Scheduler;
+		lua_State* co_ = nullptr;
+		int ref_ = LUA_NOREF;
+		bool done_ = false;
+		LuaRef results_;
+		ScriptError error_;
+		std::vector<Callback> then_;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	/* 协程调度器，以lua线程运行脚本函数，一个状态机可以同时挂起大量等待中的任务：
+	 * 任务中调用返回 Async 的导出函数时，任务协程让出，直到 Async 完成后由 Poll 恢复；
+	 * 任务中调用 coroutine.yield 时让出到下一次 Poll。
+	 * 脚本中的 LuaMix.sleep(ms) 让任务睡眠，LuaMix.after(ms, fn) 在 ms 毫秒后以 fn 创建任务并返回定时器id，
+	 * LuaMix.cancel(id) 取消它；定时器保存在毫秒精度的 TimerWheel 中，在 Poll 时批量取出到期的定时器。
+	 * SetBudget 限制任务每次恢复后连续运行的指令数或时间，用完时任务被抢占，让出到下一次 Poll。
+	 * 任务线程取自 CoroutinePool，结束后复位放回。Spawn 立即运行任务直到第一次让出；Poll 只能在脚本线程上调用，Async 可以在任意线程上完成。
+	 * 每个状态机同时只能有一个调度器；调度器析构时未结束的任务被放弃
+	*/
+	class Scheduler {
+	public:
+		struct Stats {
+			std::size_t spawned;	// 创建的任务数
+			std::size_t resumes;	// 恢复协程的次数
+			std::size_t completed;	// 成功结束的任务数
+			std::size_t failed;		// 出错的任务数
+			std::size_t timers;		// 到期的定时器数
+			std::size_t preempted;	// 因预算用完而被抢占的次数
+		};
+
+		using ErrorHandler = std::function<void(ScriptTask&)>;
+
+	public:
+		explicit Scheduler(lua_State* L)
+			: queue_(std::make_shared<AsyncQueue>())
+			, threads_(L)
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+			state_ = lua_tothread(L, -1);
+			lua_pop(L, 1);
+			if (LUA_TNIL != lua_rawgetp(state_, LUA_REGISTRYINDEX, LUAMIX_KEY_SCHEDULER)) {
+				lua_pop(state_, 1);
+				throw std::logic_error("lua state already has a scheduler");
+			}
+			lua_pop(state_, 1);
+			lua_pushlightuserdata(state_, queue_.get());
+			lua_rawsetp(state_, LUA_REGISTRYINDEX, LUAMIX_KEY_SCHEDULER);
+			registerTimers();
+		}
+
+		Scheduler(const Scheduler&) = delete;
+		Scheduler& operator = (const Scheduler&) = delete;
+
+		~Scheduler() {
+			queue_->Close();
+			queue_->tasks.clear();
+			lua_pushnil(state_);
+			lua_rawsetp(state_, LUA_REGISTRYINDEX, LUAMIX_KEY_SCHEDULER);
+			for (auto& [co, task] : tasks_) {
+				threads_.Release({ co, task->ref_ });
+				task->co_ = nullptr;
+			}
+			*owner_ = nullptr;
+			luaL_unref(state_, LUA_REGISTRYINDEX, owner_ref_);
+			timers_.Clear([this](Timer& timer) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, timer.fn_ref);
+			});
+			for (auto& timer : expired_) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, timer.fn_ref);
+			}
+		}
+
+	public:
+		// 以 path 处的函数创建任务
+		template <typename... Ps>
+		std::shared_ptr<ScriptTask> Spawn(const char* path, Ps&&... args) {
+			int ref = MakeScriptValRef(state_, path);
+			lua_rawgeti(state_, LUA_REGISTRYINDEX, ref);
+			luaL_unref(state_, LUA_REGISTRYINDEX, ref);
+			return spawn(std::forward<Ps>(args)...);
+		}
+
+		template <typename... Ps>
+		std::shared_ptr<ScriptTask> Spawn(const LuaRef& fn, Ps&&... args) {
+			if (fn.IsValid()) {
+				lua_rawgeti(state_, LUA_REGISTRYINDEX, fn.GetRef());
+			} else {
+				lua_pushnil(state_);
+			}
+			return spawn(std::forward<Ps>(args)...);
+		}
+
+		/* 恢复已完成的异步操作所等待的任务、睡眠到期的任务，以及上次 Poll 之后 coroutine.yield 的任务，
+		 * 再以到期的 LuaMix.after 回调创建任务；返回恢复与创建的任务数
+		*/
+		std::size_t Poll() {
+			resuming_.swap(ready_);
+			queue_->Drain(resuming_);
+			timers_.Advance(clock(), expired_);
+			stats_.timers += expired_.size();
+			firing_.clear();
+			for (auto& timer : expired_) {
+				if (timer.co) {
+					resuming_.push_back(timer.co);
+				} else {
+					firing_.push_back(timer.fn_ref);
+				}
+			}
+			expired_.clear();
+			std::size_t n = 0;
+			for (std::size_t i = 0; i < resuming_.size(); ++i) {
+				if (auto it = tasks_.find(resuming_[i]); it != tasks_.end()) {
+					auto task = it->second;
+					resume(*task, 0);
+					++n;
+				}
+			}
+			resuming_.clear();
+			for (std::size_t i = 0; i < firing_.size(); ++i) {
+				lua_rawgeti(state_, LUA_REGISTRYINDEX, firing_[i]);
+				luaL_unref(state_, LUA_REGISTRYINDEX, firing_[i]);
+				spawn();
+				++n;
+			}
+			return n;
+		}
+
+		// 等待到有任务可以恢复、有定时器可能到期或者超时，返回是否有任务可能需要恢复
+		bool Wait(std::chrono::milliseconds timeout) {
+			timers_.Advance(clock(), expired_);
+			if (!ready_.empty() || !expired_.empty()) {
+				return true;
+			}
+			auto limit = static_cast<std::uint64_t>(timeout.count());
+			auto next = timers_.NextDelay(limit);
+			return queue_->Wait(std::chrono::milliseconds(next)) || next < limit;
+		}
+
+		// 任务出错时调用，包括 LuaMix.after 创建的任务
+		void OnError(ErrorHandler handler) {
+			on_error_ = std::move(handler);
+		}
+
+		// 任务每次恢复的预算，默认不限制；不能让出时（如在C函数的 lua_pcall 中）预算用完则任务出错
+		void SetBudget(const CallBudget& budget) {
+			budget_ = budget;
+		}
+
+		const CallBudget& GetBudget() const {
+			return budget_;
+		}
+
+		// 未到期的定时器数，包括睡眠中的任务
+		std::size_t GetTimerCount() const {
+			return timers_.GetSize();
+		}
+
+		// 未结束的任务数
+		std::size_t GetRunning() const {
+			return tasks_.size();
+		}
+
+		const Stats& GetStats() const {
+			return stats_;
+		}
+
+		// 任务使用的线程池，可以 Prewarm
+		CoroutinePool& GetThreadPool() {
+			return threads_;
+		}
+
+	private:
+		struct Timer {
+			lua_State* co = nullptr;		// 睡眠的任务
+			int fn_ref = LUA_NOREF;			// LuaMix.after 的回调
+		};
+
+		// 栈顶为任务函数
+		template <typename... Ps>
+		std::shared_ptr<ScriptTask> spawn(Ps&&... args) {
+			auto task = std::make_shared<ScriptTask>();
+			auto thread = threads_.Acquire();
+			lua_State* co = thread.co;
+			task->co_ = co;
+			task->ref_ = thread.ref;
+			lua_xmove(state_, co, 1);							// co :fn
+			if constexpr (sizeof...(Ps) + 1 > LUA_MINSTACK) {
+				luaL_checkstack(co, sizeof...(Ps), "too many arguments");
+			}
+			(..., Push(co, args));								// co :fn, args...
+			tasks_.emplace(co, task);
+			queue_->tasks.insert(co);
+			++stats_.spawned;
+			resume(*task, sizeof...(Ps));
+			return task;
+		}
+
+		void resume(ScriptTask& task, int nargs) {
+			lua_State* co = task.co_;
+			++stats_.resumes;
+			int status = LUA_OK;
+			bool preempted = false;
+			if (budget_) {
+				BudgetScope _budget(co, budget_, true, state_);
+				status = lua_resume(co, nullptr, nargs);
+				preempted = _budget.Preempted();
+			} else {
+				status = lua_resume(co, nullptr, nargs);
+			}
+			if (LUA_YIELD == status) {
+				if (queue_->suspending == co) {
+					queue_->suspending = nullptr;
+				} else {
+					stats_.preempted += preempted;
+					lua_settop(co, 0);			// coroutine.yield 的值被丢弃，下次 Poll 时恢复
+					ready_.push_back(co);
+				}
+				return;
+			}
+			finish(task, status);
+		}
+
+		void finish(ScriptTask& task, int status) {
+			lua_State* co = task.co_;
+			if (LUA_OK == status) {
+				int n = lua_gettop(co);
+				luaL_checkstack(state_, n + 1, "too many results");
+				lua_xmove(co, state_, n);							// :rets...
+				lua_createtable(state_, n, 0);						// :rets..., t
+				lua_insert(state_, -(n + 1));						// :t, rets...
+				for (int i = n; i >= 1; --i) {
+					lua_rawseti(state_, -(i + 1), i);
+				}
+				task.results_ = LuaRef::RefStack(state_);			// :
+				++stats_.completed;
+			} else {
+				lua_xmove(co, state_, 1);							// :err
+				LuaException::CaptureTrace(state_, co);				// :msg，只记录各层，调用栈文本在 What() 时才生成
+				task.error_.Set(state_, status);
+				++stats_.failed;
+				if (on_error_) {
+					on_error_(task);
+				}
+			}
+			threads_.Release({ co, task.ref_ });
+			task.ref_ = LUA_NOREF;
+			task.co_ = nullptr;
+			task.done_ = true;
+			queue_->tasks.erase(co);
+			auto self = tasks_.at(co);		// 回调中可能释放任务的其它持有者
+			tasks_.erase(co);
+			auto then = std::move(task.then_);
+			for (auto& cb : then) {
+				cb(task);
+			}
+		}
+
+		// 调度器创建后经过的毫秒数，定时器以此计时
+		std::uint64_t clock() const {
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch_).count());
+		}
+
+		// 定时器从当前时间开始计时，先把时间轮推进到现在，到期的定时器留给下一次 Poll
+		TimerWheel<Timer>::TimerId addTimer(lua_Number ms, int fn_ref, lua_State* co) {
+			timers_.Advance(clock(), expired_);
+			return timers_.Add(ms > 0 ? static_cast<std::uint64_t>(std::ceil(ms)) : 0, Timer{ co, fn_ref });
+		}
+
+		void registerTimers() {
+			MixMetaEvent::Init(state_);
+			owner_ = static_cast<Scheduler**>(lua_newuserdata(state_, sizeof(Scheduler*)));
+			*owner_ = this;
+			owner_ref_ = luaL_ref(state_, LUA_REGISTRYINDEX);
+			lua_getglobal(state_, "LuaMix");						// :LuaMix
+			const std::pair<const char*, lua_CFunction> funcs[] = {
+				{ "sleep", &luaSleep },
+				{ "after", &luaAfter },
+				{ "cancel", &luaCancel },
+			};
+			for (auto& [name, fn] : funcs) {
+				lua_rawgeti(state_, LUA_REGISTRYINDEX, owner_ref_);	// :LuaMix, owner
+				lua_pushcclosure(state_, fn, 1);					// :LuaMix, fn
+				lua_setfield(state_, -2, name);						// :LuaMix
+			}
+			lua_pop(state_, 1);
+		}
+
+		static Scheduler* checkOwner(lua_State* L) {
+			auto sched = *static_cast<Scheduler**>(lua_touserdata(L, lua_upvalueindex(1)));
+			if (!sched) {
+				luaL_error(L, "scheduler is closed");
+			}
+			return sched;
+		}
+
+		// LuaMix.sleep(ms)：只能在任务中调用，ms 不大于0时让出到下一次 Poll
+		static int luaSleep(lua_State* L) {
+			auto sched = checkOwner(L);
+			lua_Number ms = luaL_checknumber(L, 1);
+			if (!sched->queue_->tasks.count(L)) {
+				return luaL_error(L, "LuaMix.sleep must be called in a scheduler task");
+			}
+			// 不能让出时（如在 table.sort 的比较函数中）先报错，不留下定时器与挂起标记
+			if (!lua_isyieldable(L)) {
+				return luaL_error(L, "LuaMix.sleep cannot yield here (called across a C-call boundary)");
+			}
+			if (ms > 0) {
+				sched->addTimer(ms, LUA_NOREF, L);
+				sched->queue_->suspending = L;
+			}
+			return lua_yield(L, 0);
+		}
+
+		// LuaMix.after(ms, fn)：返回定时器id
+		static int luaAfter(lua_State* L) {
+			auto sched = checkOwner(L);
+			lua_Number ms = luaL_checknumber(L, 1);
+			luaL_checktype(L, 2, LUA_TFUNCTION);
+			lua_settop(L, 2);
+			int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			lua_pushinteger(L, static_cast<lua_Integer>(sched->addTimer(ms, ref, nullptr)));
+			return 1;
+		}
+
+		// LuaMix.cancel(id)：取消 LuaMix.after 的定时器，返回是否取消成功；睡眠中的任务的定时器不能取消
+		static int luaCancel(lua_State* L) {
+			auto sched = checkOwner(L);
+			auto id = static_cast<TimerWheel<Timer>::TimerId>(luaL_checkinteger(L, 1));
+			auto found = sched->timers_.Find(id);
+			Timer timer;
+			bool cancelled = found && !found->co && sched->timers_.Cancel(id, &timer);
+			if (cancelled) {
+				luaL_unref(L, LUA_REGISTRYINDEX, timer.fn_ref);
+			}
+			lua_pushboolean(L, cancelled);
+			return 1;
+		}
+
+	private:
+		lua_State* state_ = nullptr;
+		std::shared_ptr<AsyncQueue> queue_;
+		CoroutinePool threads_;
+		std::unordered_map<lua_State*, std::shared_ptr<ScriptTask>> tasks_;
+		std::vector<lua_State*> ready_;
+		std::vector<lua_State*> resuming_;
+		std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+		TimerWheel<Timer> timers_;
+		std::vector<Timer> expired_;
+		std::vector<int> firing_;
+		Scheduler** owner_ = nullptr;
+		int owner_ref_ = LUA_NOREF;
+		ErrorHandler on_error_;
+		CallBudget budget_;
+		Stats stats_{};
+	};
+}
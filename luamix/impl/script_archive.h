@@ -0,0 +1,313 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+
+#include "mix_util.h"
+#include "file_mapping.h"
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 脚本归档：把一个脚本目录打包成单个文件，模块名到数据的索引是开放寻址的哈希表，
+	 * 打开时整个文件映射到内存，require 查找模块只需一次哈希探测，不再按 package.path 逐个尝试打开文件。
+	 * 归档中的每个模块保存源码或对齐格式的字节码（LUA_DUMPALIGNED），字节码以 'F' 模式加载，
+	 * 指令与行号数组直接引用映射内存，因此归档必须比从中加载过函数的状态机活得更久。
+	 * 打开后归档只读，同一个归档对象可以被多个状态机（包括不同线程上的）共享。
+	 * 文件使用本机字节序，与字节码一样只能在相同平台上使用。
+	 *
+	 * 文件布局：
+	 *   文件头（32字节）：magic[8]、模块数 uint32、槽数 uint32（2的幂）、槽表偏移 uint64、文件大小 uint64
+	 *   槽表：每槽40字节，见 Slot，name_len 为 0 表示空槽
+	 *   字符串区：模块名与源文件相对路径
+	 *   数据区：每个模块的源码或字节码，起始偏移按8字节对齐
+	*/
+	class ScriptArchive {
+	public:
+		ScriptArchive() = default;
+		ScriptArchive(const ScriptArchive&) = delete;
+		ScriptArchive& operator = (const ScriptArchive&) = delete;
+
+	public:
+		// 打开归档文件，文件不存在或格式不符时返回 false
+		bool Open(const std::string& file) {
+			Close();
+			if (!mapping_.Open(file)) {
+				return false;
+			}
+			Header header;
+			if (mapping_.Size() < sizeof(Header)) {
+				Close();
+				return false;
+			}
+			std::memcpy(&header, mapping_.Data(), sizeof(Header));
+			if (std::memcmp(header.magic, kMagic, sizeof(kMagic))
+				|| header.file_size != mapping_.Size()
+				|| header.slots == 0 || (header.slots & (header.slots - 1))
+				|| header.slots_offset % alignof(Slot)
+				|| header.slots_offset + std::uint64_t(header.slots) * sizeof(Slot) > header.file_size) {
+				Close();
+				return false;
+			}
+			header_ = header;
+			slots_ = reinterpret_cast<const Slot*>(mapping_.Data() + header.slots_offset);
+			return true;
+		}
+
+		void Close() {
+			mapping_.Close();
+			header_ = {};
+			slots_ = nullptr;
+		}
+
+		explicit operator bool() const {
+			return slots_ != nullptr;
+		}
+
+		std::size_t GetCount() const {
+			return header_.count;
+		}
+
+		std::size_t GetMappedBytes() const {
+			return mapping_.Size();
+		}
+
+		bool Contains(std::string_view name) const {
+			return find(name) != nullptr;
+		}
+
+		// 与 luaL_loadfile 相同：成功时压入模块的函数并返回 LUA_OK，否则压入错误信息并返回错误码
+		int Load(lua_State* L, std::string_view name) const {
+			const Slot* slot = find(name);
+			if (!slot) {
+				lua_pushfstring(L, "module '%s' not found in archive", std::string(name).c_str());
+				return LUA_ERRFILE;
+			}
+			return load(L, slot);
+		}
+
+		/* 在 package.searchers 的预加载搜索器之后插入归档搜索器，require 优先从归档中查找模块：
+		 * 后安装的归档排在前面，可以用来覆盖先安装的归档中的同名模块
+		*/
+		static void InstallSearcher(lua_State* L, const ScriptArchive* archive) {
+			StackGuard _guard(L);
+			luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);	// :loaded
+			if (LUA_TTABLE != lua_getfield(L, -1, LUA_LOADLIBNAME)) {	// :loaded, package
+				return;
+			}
+			if (LUA_TTABLE != lua_getfield(L, -1, "searchers")) {		// :loaded, package, searchers
+				return;
+			}
+			for (lua_Integer i = static_cast<lua_Integer>(lua_rawlen(L, -1)); i >= 2; --i) {
+				lua_rawgeti(L, -1, i);								// :loaded, package, searchers, searchers[i]
+				lua_rawseti(L, -2, i + 1);							// :loaded, package, searchers
+			}
+			lua_pushlightuserdata(L, const_cast<ScriptArchive*>(archive));	// :loaded, package, searchers, archive
+			lua_pushcclosure(L, &searcher, 1);					// :loaded, package, searchers, searcher
+			lua_rawseti(L, -2, 2);								// :loaded, package, searchers
+		}
+
+		/* 把 dir 下所有的 .lua 文件打包到 file，失败时抛出 std::runtime_error：
+		 * 模块名由相对路径得到，"a/b.lua" 为 "a.b"，"a/init.lua" 为 "a"，与 package.path 的 "?.lua;?/init.lua" 一致；
+		 * bytecode 为 true 时保存编译后的字节码，strip 去掉调试信息；否则保存源码，但仍然编译一次以检查语法错误
+		*/
+		static std::size_t Pack(lua_State* L, const std::string& dir, const std::string& file, bool bytecode = true, bool strip = false) {
+			namespace fs = std::filesystem;
+			std::vector<std::string> files;
+			for (auto& entry : fs::recursive_directory_iterator(dir)) {
+				if (entry.is_regular_file() && entry.path().extension() == ".lua") {
+					files.push_back(entry.path().lexically_relative(dir).generic_string());
+				}
+			}
+			// 排序保证输出稳定，并且 "a.lua" 排在 "a/init.lua" 之前，同名时与 package.path 的查找顺序一致
+			std::sort(files.begin(), files.end());
+
+			std::vector<Module> modules;
+			for (auto& path : files) {
+				std::string name = moduleName(path);
+				if (std::any_of(modules.begin(), modules.end(), [&](const Module& m) { return m.name == name; })) {
+					continue;
+				}
+				std::ifstream ifs(fs::path(dir) / path, std::ios::binary);
+				std::string source((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+				if (!ifs.good() && !ifs.eof()) {
+					throw std::runtime_error("cannot read " + path);
+				}
+				StackGuard _guard(L);
+				std::string chunkname = "@" + path;
+				if (LUA_OK != luaL_loadbufferx(L, source.data(), source.size(), chunkname.c_str(), nullptr)) {
+					throw std::runtime_error(lua_tostring(L, -1));
+				}
+				if (bytecode) {
+					source.clear();
+					lua_dump(L, &writer, &source, LUA_DUMPALIGNED | (strip ? 1 : 0));
+				}
+				modules.push_back({ std::move(name), path, std::move(source) });
+			}
+			write(file, modules);
+			return modules.size();
+		}
+
+	private:
+		static constexpr char kMagic[8] = { 'L', 'M', 'X', 'P', 'A', 'K', '1', '\0' };
+
+		struct Header {
+			char magic[8];
+			std::uint32_t count;
+			std::uint32_t slots;
+			std::uint64_t slots_offset;
+			std::uint64_t file_size;
+		};
+		static_assert(sizeof(Header) == 32, "unexpected archive header size");
+
+		struct Slot {
+			std::uint64_t hash;
+			std::uint64_t data_offset;
+			std::uint64_t data_size;
+			std::uint32_t name_offset;
+			std::uint32_t name_len;
+			std::uint32_t path_offset;
+			std::uint32_t path_len;
+		};
+		static_assert(sizeof(Slot) == 40, "unexpected archive slot size");
+
+		struct Module {
+			std::string name;
+			std::string path;
+			std::string data;
+		};
+
+		static std::string moduleName(std::string path) {
+			path.resize(path.size() - 4);	// ".lua"
+			constexpr std::string_view init = "/init";
+			if (path.size() > init.size() && path.compare(path.size() - init.size(), init.size(), init) == 0) {
+				path.resize(path.size() - init.size());
+			}
+			std::replace(path.begin(), path.end(), '/', '.');
+			return path;
+		}
+
+		const Slot* find(std::string_view name) const {
+			if (!slots_ || name.empty()) {
+				return nullptr;
+			}
+			const char* base = mapping_.Data();
+			std::uint64_t hash = HashBytes(name.data(), name.size());
+			std::uint32_t mask = header_.slots - 1;
+			for (std::uint32_t i = static_cast<std::uint32_t>(hash) & mask, n = 0; n < header_.slots; i = (i + 1) & mask, ++n) {
+				const Slot& slot = slots_[i];
+				if (slot.name_len == 0) {
+					return nullptr;
+				}
+				if (slot.hash == hash && slot.name_len == name.size()
+					&& std::uint64_t(slot.name_offset) + slot.name_len <= header_.file_size
+					&& std::memcmp(base + slot.name_offset, name.data(), name.size()) == 0) {
+					if (slot.data_offset + slot.data_size > header_.file_size
+						|| std::uint64_t(slot.path_offset) + slot.path_len > header_.file_size) {
+						return nullptr;
+					}
+					return &slot;
+				}
+			}
+			return nullptr;
+		}
+
+		int load(lua_State* L, const Slot* slot) const {
+			const char* base = mapping_.Data();
+			std::string chunkname = "@";
+			chunkname.append(base + slot->path_offset, slot->path_len);
+			const char* data = base + slot->data_offset;
+			bool binary = slot->data_size > 0 && data[0] == LUA_SIGNATURE[0];
+			return luaL_loadbufferx(L, data, static_cast<std::size_t>(slot->data_size), chunkname.c_str(), binary ? "bF" : "t");
+		}
+
+		// package.searchers 中的归档搜索器：upvalue(1) 为归档
+		static int searcher(lua_State* L) {
+			auto archive = static_cast<const ScriptArchive*>(lua_touserdata(L, lua_upvalueindex(1)));
+			std::size_t len = 0;
+			const char* name = luaL_checklstring(L, 1, &len);
+			const Slot* slot = archive->find(std::string_view(name, len));
+			if (!slot) {
+				lua_pushfstring(L, "\n\tno module '%s' in archive", name);
+				return 1;
+			}
+			if (LUA_OK != archive->load(L, slot)) {
+				return luaL_error(L, "error loading module '%s' from archive:\n\t%s", name, lua_tostring(L, -1));
+			}
+			lua_pushlstring(L, archive->mapping_.Data() + slot->path_offset, slot->path_len);	// :name, fn, path
+			return 2;
+		}
+
+		static int writer(lua_State* L, const void* p, std::size_t sz, void* ud) {
+			static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+			return 0;
+		}
+
+		static void write(const std::string& file, const std::vector<Module>& modules) {
+			std::uint32_t slots = 8;
+			while (slots < modules.size() * 2) {
+				slots <<= 1;
+			}
+			std::string out(sizeof(Header) + std::size_t(slots) * sizeof(Slot), '\0');
+			std::vector<Slot> table(slots, Slot{});
+			auto align = [&out]() {
+				out.resize((out.size() + 7) & ~std::size_t(7), '\0');
+			};
+			auto append = [&out](const std::string& s) {
+				auto offset = static_cast<std::uint32_t>(out.size());
+				out.append(s);
+				return offset;
+			};
+
+			std::vector<std::uint32_t> names, paths;
+			for (auto& m : modules) {
+				names.push_back(append(m.name));
+				paths.push_back(append(m.path));
+			}
+			for (std::size_t k = 0; k < modules.size(); ++k) {
+				auto& m = modules[k];
+				align();
+				Slot slot;
+				slot.hash = HashBytes(m.name.data(), m.name.size());
+				slot.data_offset = out.size();
+				slot.data_size = m.data.size();
+				slot.name_offset = names[k];
+				slot.name_len = static_cast<std::uint32_t>(m.name.size());
+				slot.path_offset = paths[k];
+				slot.path_len = static_cast<std::uint32_t>(m.path.size());
+				out.append(m.data);
+				std::uint32_t i = static_cast<std::uint32_t>(slot.hash) & (slots - 1);
+				while (table[i].name_len) {
+					i = (i + 1) & (slots - 1);
+				}
+				table[i] = slot;
+			}
+
+			Header header;
+			std::memcpy(header.magic, kMagic, sizeof(kMagic));
+			header.count = static_cast<std::uint32_t>(modules.size());
+			header.slots = slots;
+			header.slots_offset = sizeof(Header);
+			header.file_size = out.size();
+			std::memcpy(&out[0], &header, sizeof(Header));
+			std::memcpy(&out[sizeof(Header)], table.data(), table.size() * sizeof(Slot));
+
+			std::ofstream ofs(file, std::ios::binary | std::ios::trunc);
+			if (!ofs.write(out.data(), out.size())) {
+				throw std::runtime_error("cannot write " + file);
+			}
+		}
+
+	private:
+		FileMapping mapping_;
+		Header header_{};
+		const Slot* slots_ = nullptr;
+	};
+}
@@ -1,52 +1,289 @@
 #pragma once
 
 #include <optional>
+#include <cassert>
+#include <string_view>
+#include <vector>
 
 #include "lua_ref.h"
+#include "call_budget.h"
 
 namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 脚本调用的错误，不经过C++异常传递：
+	 * 错误对象保存在registry的固定槽位中，同一个对象反复出错时复用槽位与调用栈数组，不再分配；
+	 * 错误信息直接指向槽位中的lua字符串，带调用栈的文本在第一次读取 What 时才生成
+	*/
+	class ScriptError {
+	public:
+		ScriptError() = default;
+		ScriptError(const ScriptError&) = delete;
+		ScriptError& operator = (const ScriptError&) = delete;
+
+		ScriptError(ScriptError&& that) noexcept {
+			swap(that);
+		}
+
+		ScriptError& operator = (ScriptError&& that) noexcept {
+			swap(that);
+			return *this;
+		}
+
+		~ScriptError() {
+			if (state_) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
+			}
+		}
+
+	public:
+		explicit operator bool() const {
+			return status_ != LUA_OK;
+		}
+
+		// lua_pcall 的返回值，没有错误时为 LUA_OK
+		int Status() const {
+			return status_;
+		}
+
+		// 不含调用栈的错误信息，指向槽位中的字符串，在下一次出错或者 Clear 之前有效
+		const char* Message() const {
+			if (status_ == LUA_OK) {
+				return "";
+			}
+			lua_rawgeti(state_, LUA_REGISTRYINDEX, ref_);
+			const char* msg = lua_tostring(state_, -1);
+			lua_pop(state_, 1);
+			return msg ? msg : "unknown error";
+		}
+
+		// 错误信息加调用栈文本
+		const std::string& What() const {
+			if (status_ != LUA_OK && rendered_.empty()) {
+				rendered_ = Message();
+				if (traced_) {
+					rendered_ += LuaException::RenderTrace(frames_, gap_);
+				}
+			}
+			return rendered_;
+		}
+
+		const std::vector<TraceFrame>& Frames() const {
+			return frames_;
+		}
+
+		// 压入错误对象，没有错误时压入nil
+		void Push() const {
+			if (status_ == LUA_OK) {
+				lua_pushnil(state_);
+			} else {
+				lua_rawgeti(state_, LUA_REGISTRYINDEX, ref_);
+			}
+		}
+
+		// 以 LuaException 抛出，没有错误时什么也不做
+		void Throw() const {
+			if (status_ != LUA_OK) {
+				throw LuaException(What());
+			}
+		}
+
+		// 弹出栈顶的错误对象保存到槽位中
+		void Set(lua_State* L, int status) {
+			std::size_t len = 0;
+			const char* msg = lua_isstring(L, -1) ? lua_tolstring(L, -1, &len) : nullptr;
+			traced_ = LuaException::TakeTrace(L, msg, len, frames_, gap_);
+			if (!state_) {
+				state_ = L;
+				ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+			} else {
+				lua_rawseti(L, LUA_REGISTRYINDEX, ref_);
+			}
+			status_ = status;
+			rendered_.clear();
+		}
+
+		// 清除错误，保留槽位
+		void Clear() {
+			if (status_ != LUA_OK) {
+				lua_pushnil(state_);
+				lua_rawseti(state_, LUA_REGISTRYINDEX, ref_);
+			}
+			status_ = LUA_OK;
+			traced_ = false;
+			frames_.clear();
+			rendered_.clear();
+		}
+
+		// 释放槽位，之后不再访问状态机；状态机关闭前调用
+		void Reset() {
+			Clear();
+			if (state_) {
+				luaL_unref(state_, LUA_REGISTRYINDEX, ref_);
+			}
+			state_ = nullptr;
+			ref_ = LUA_NOREF;
+		}
+
+	private:
+		void swap(ScriptError& that) noexcept {
+			std::swap(state_, that.state_);
+			std::swap(ref_, that.ref_);
+			std::swap(status_, that.status_);
+			std::swap(gap_, that.gap_);
+			std::swap(traced_, that.traced_);
+			frames_.swap(that.frames_);
+			rendered_.swap(that.rendered_);
+		}
+
+	private:
+		lua_State* state_ = nullptr;
+		int ref_ = LUA_NOREF;
+		int status_ = LUA_OK;
+		int gap_ = -1;
+		bool traced_ = false;
+		std::vector<TraceFrame> frames_;
+		mutable std::string rendered_;
+	};
+
+	/* 以 args 中的每组参数依次调用同一个脚本函数，结果写入 out，返回出错的组数：
+	 * 函数与错误处理函数只压栈一次，每组参数只需压入参数、lua_pcall 与取回结果；
+	 * 出错的组结果为 std::nullopt，错误保存在 err 中并以 on_error(index, err) 通知
+	*/
+	template <int NRets, typename R, typename Fetcher, typename F, typename... Ps>
+	std::size_t ScriptCallBatch(lua_State* L, ScriptError& err, int fn_ref, const std::tuple<Ps...>* args, std::size_t count, R* out, Fetcher fetch, F&& on_error) {
+		StackGuard _guard(L);
+		LuaException::PushTraceback(L);				// :trace
+		int base = lua_gettop(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, fn_ref);	// :trace, fn
+		std::size_t failed = 0;
+		for (std::size_t i = 0; i < count; ++i) {
+			lua_pushvalue(L, base + 1);				// :trace, fn, fn
+			std::apply([L](const auto&... arg) {
+				(..., Push(L, arg));
+				}, args[i]);						// :trace, fn, fn, args...
+			if (int status = lua_pcall(L, sizeof...(Ps), NRets, base)) {	// :trace, fn, err
+				err.Set(L, status);					// :trace, fn
+				out[i] = std::nullopt;
+				++failed;
+				on_error(i, static_cast<const ScriptError&>(err));
+			} else {								// :trace, fn, rets...
+				out[i] = fetch(L);
+				lua_settop(L, base + 1);			// :trace, fn
+			}
+		}
+		return failed;
+	}
+
+	/* 调用脚本函数，结果直接取到 outs 引用的变量中，返回 lua_pcall 的结果：
+	 * 错误处理函数与结果（或错误对象）留在栈上，由调用者恢复栈顶
+	*/
+	template <typename... Outs, typename... Ps>
+	int ScriptCallInto(lua_State* L, int fn_ref, const std::tuple<Outs&...>& outs, Ps&&... args) {
+		LuaException::PushTraceback(L);				// :trace
+		int base = lua_gettop(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, fn_ref);	// :trace, fn
+		(..., Push(L, args));						// :trace, fn, args...
+		int status = lua_pcall(L, sizeof...(Ps), sizeof...(Outs), base);
+		if (status == LUA_OK) {						// :trace, rets...
+			std::apply([L](auto&... out) {
+				int index = sizeof...(Outs);
+				(..., FetchInto(L, -(index--), out));
+				}, outs);
+		}
+		return status;
+	}
+
+	/* 带 pin 的 CallInto 把错误处理函数与结果留在栈上，同一个 pin 的多次调用会累积：
+	 * 调用前为参数与结果扩展栈空间，另外保留与C函数入口相同的 LUA_MINSTACK 个空位给路径查找等临时值，无法扩展时抛出 LuaException
+	*/
+	template <std::size_t NARGS, std::size_t NOUTS>
+	inline void ReservePinned(lua_State* L) {
+		constexpr int slots = static_cast<int>(NARGS + NOUTS) + LUA_MINSTACK;
+		if (!lua_checkstack(L, slots)) {
+			throw LuaException("stack overflow (too many results pinned)");
+		}
+	}
+
+	template <typename... Outs>
+	inline constexpr bool _has_string_view_v = (std::is_same_v<std::decay_t<Outs>, std::string_view> || ...);
+
+	/* 调用脚本函数：
+	 * TryCall/TrySelfCall 出错时把错误保存到 err 并返回 std::nullopt，不抛出异常；
+	 * Call/SelfCall 出错时抛出 LuaException
+	*/
 	template <typename... Rs>
 	struct ScriptCallImpl {
 		using ReturnType = std::optional<std::tuple<Rs...>>;
 
+		template <typename... Ps>
+		static ReturnType TryCall(lua_State* L, ScriptError& err, int fn_ref, Ps&&... args) {
+			StackGuard _guard(L);
+			if (int status = pcall(L, fn_ref, std::forward<Ps>(args)...)) {
+				err.Set(L, status);
+				return std::nullopt;
+			}
+			return fetch(L);
+		}
+
+		template <typename... Ps>
+		static ReturnType TrySelfCall(lua_State* L, ScriptError& err, int callee_ref, const char* method, Ps&&... args) {
+			StackGuard _guard(L);
+			if (int status = selfPcall(L, callee_ref, method, std::forward<Ps>(args)...)) {
+				err.Set(L, status);
+				return std::nullopt;
+			}
+			return fetch(L);
+		}
+
+		template <typename... Ps, typename F>
+		static std::size_t CallBatch(lua_State* L, ScriptError& err, int fn_ref, const std::tuple<Ps...>* args, std::size_t count, ReturnType* out, F&& on_error) {
+			return ScriptCallBatch<sizeof...(Rs)>(L, err, fn_ref, args, count, out, &fetch, std::forward<F>(on_error));
+		}
+
 		template <typename... Ps>
 		static ReturnType Call(lua_State* L, int fn_ref, Ps&&... args) {
 			StackGuard _guard(L);
-			lua_pushcfunction(L, LuaException::StackTraceback);
-			lua_rawgeti(L, LUA_REGISTRYINDEX, fn_ref);
-			(..., Push(L, args));
-			if (lua_pcall(L, sizeof...(Ps), sizeof...(Rs), -int(sizeof...(Ps) + 2)) != LUA_OK) {
+			if (pcall(L, fn_ref, std::forward<Ps>(args)...) != LUA_OK) {
 				throw LuaException(L);
-			} else {
-				int index = 0;
-				std::tuple<Rs...> rets;
-				std::apply([L](auto &... ret) {
-					int index = sizeof...(Rs);
-					(..., (ret = Fetch<Rs>(L, -(index--))));
-					}, rets);
-				return rets;
 			}
+			return fetch(L);
 		}
 
 		template <typename... Ps>
 		static ReturnType SelfCall(lua_State *L, int callee_ref, const char *method, Ps&&... args) {
 			StackGuard _guard(L);
+			if (selfPcall(L, callee_ref, method, std::forward<Ps>(args)...) != LUA_OK) {
+				throw LuaException(L);
+			}
+			return fetch(L);
+		}
+
+	private:
+		template <typename... Ps>
+		static int pcall(lua_State* L, int fn_ref, Ps&&... args) {
+			LuaException::PushTraceback(L);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, fn_ref);
+			(..., Push(L, args));
+			return lua_pcall(L, sizeof...(Ps), sizeof...(Rs), -int(sizeof...(Ps) + 2));
+		}
+
+		template <typename... Ps>
+		static int selfPcall(lua_State* L, int callee_ref, const char* method, Ps&&... args) {
 			lua_rawgeti(L, LUA_REGISTRYINDEX, callee_ref); // :..., callee
-			lua_pushcfunction(L, LuaException::StackTraceback); // :..., callee, trace
+			LuaException::PushTraceback(L); // :..., callee, trace
 			lua_getfield(L, -2, method);	// :..., callee, trace, method
 			lua_pushvalue(L, -3); // :..., callee, trace, method, callee
 			(..., Push(L, args)); // :..., callee, trace, method, callee, args...
-			if (lua_pcall(L, sizeof...(Ps) + 1, sizeof...(Rs), -int(sizeof...(Ps) + 2 + 1)) != LUA_OK) {
-				throw LuaException(L);
-			} else {
-				int index = 0;
-				std::tuple<Rs...> rets;
-				std::apply([L](auto &... ret) {
-					int index = sizeof...(Rs);
-					(..., (ret = Fetch<Rs>(L, -(index--))));
-					}, rets);
-				return rets;
-			}
+			return lua_pcall(L, sizeof...(Ps) + 1, sizeof...(Rs), -int(sizeof...(Ps) + 2 + 1));
+		}
+
+		static ReturnType fetch(lua_State* L) {
+			std::tuple<Rs...> rets;
+			std::apply([L](auto &... ret) {
+				int index = sizeof...(Rs);
+				(..., (ret = Fetch<Rs>(L, -(index--))));
+				}, rets);
+			return rets;
 		}
 	};
 
@@ -54,32 +291,70 @@ namespace LuaMix::Impl {
 	struct ScriptCallImpl<R> {
 		using ReturnType = std::optional<R>;
 
+		template <typename... Ps>
+		static ReturnType TryCall(lua_State* L, ScriptError& err, int fn_ref, Ps&&... args) {
+			StackGuard _guard(L);
+			if (int status = pcall(L, fn_ref, std::forward<Ps>(args)...)) {
+				err.Set(L, status);
+				return std::nullopt;
+			}
+			return Fetch<R>(L, -1);
+		}
+
+		template <typename... Ps>
+		static ReturnType TrySelfCall(lua_State* L, ScriptError& err, int callee_ref, const char* method, Ps&&... args) {
+			StackGuard _guard(L);
+			if (int status = selfPcall(L, callee_ref, method, std::forward<Ps>(args)...)) {
+				err.Set(L, status);
+				return std::nullopt;
+			}
+			return Fetch<R>(L, -1);
+		}
+
+		template <typename... Ps, typename F>
+		static std::size_t CallBatch(lua_State* L, ScriptError& err, int fn_ref, const std::tuple<Ps...>* args, std::size_t count, ReturnType* out, F&& on_error) {
+			return ScriptCallBatch<1>(L, err, fn_ref, args, count, out, &fetch, std::forward<F>(on_error));
+		}
+
 		template <typename... Ps>
 		static std::optional<R> Call(lua_State* L, int fn_ref, Ps&&... args) {
 			StackGuard _guard(L);
-			lua_pushcfunction(L, LuaException::StackTraceback);
-			lua_rawgeti(L, LUA_REGISTRYINDEX, fn_ref);
-			(..., Push(L, args));
-			if (lua_pcall(L, sizeof...(Ps), 1, -int(sizeof...(Ps) + 2)) != LUA_OK) {
+			if (pcall(L, fn_ref, std::forward<Ps>(args)...) != LUA_OK) {
 				throw LuaException(L);
-			} else {
-				return Fetch<R>(L, -1);
 			}
+			return Fetch<R>(L, -1);
 		}
 
 		template <typename... Ps>
 		static std::optional<R> SelfCall(lua_State* L, int callee_ref, const char* method, Ps&&... args) {
 			StackGuard _guard(L);
+			if (selfPcall(L, callee_ref, method, std::forward<Ps>(args)...) != LUA_OK) {
+				throw LuaException(L);
+			}
+			return Fetch<R>(L, -1);
+		}
+
+	private:
+		template <typename... Ps>
+		static int pcall(lua_State* L, int fn_ref, Ps&&... args) {
+			LuaException::PushTraceback(L);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, fn_ref);
+			(..., Push(L, args));
+			return lua_pcall(L, sizeof...(Ps), 1, -int(sizeof...(Ps) + 2));
+		}
+
+		template <typename... Ps>
+		static int selfPcall(lua_State* L, int callee_ref, const char* method, Ps&&... args) {
 			lua_rawgeti(L, LUA_REGISTRYINDEX, callee_ref); // :..., callee
-			lua_pushcfunction(L, LuaException::StackTraceback); // :..., callee, trace
+			LuaException::PushTraceback(L); // :..., callee, trace
 			lua_getfield(L, -2, method);	// :..., callee, trace, method
 			lua_pushvalue(L, -3); // :..., callee, trace, method, callee
 			(..., Push(L, args)); // :..., callee, trace, method, callee, args...
-			if (lua_pcall(L, sizeof...(Ps) + 1, 1, -int(sizeof...(Ps) + 2 + 1)) != LUA_OK) {
-				throw LuaException(L);
-			} else {
-				return Fetch<R>(L, -1);
-			}
+			return lua_pcall(L, sizeof...(Ps) + 1, 1, -int(sizeof...(Ps) + 2 + 1));
+		}
+
+		static ReturnType fetch(lua_State* L) {
+			return Fetch<R>(L, -1);
 		}
 	};
 
@@ -123,7 +398,7 @@ namespace LuaMix::Impl {
 		ScriptCall(ScriptCall<Rs...>&& that) noexcept
 			: state_(that.state_)
 			, callee_ref_(that.callee_ref_)
-			, errmsg_(std::move(that.errmsg_))
+			, error_(std::move(that.error_))
 		{
 			that.callee_ref_ = LUA_NOREF;
 		}
@@ -131,7 +406,7 @@ namespace LuaMix::Impl {
 		ScriptCall<Rs...>& operator = (ScriptCall<Rs...>&& that) noexcept {
 			std::swap(state_, that.state_);
 			std::swap(callee_ref_, that.callee_ref_);
-			std::swap(errmsg_, that.errmsg_);
+			std::swap(error_, that.error_);
 			return *this;
 		}
 
@@ -142,34 +417,99 @@ namespace LuaMix::Impl {
 	public:
 		using ReturnType = typename ScriptCallImpl<Rs...>::ReturnType;
 
+		// 出错时返回 std::nullopt，错误保存在 Error() 中，不抛出异常
 		template <typename... Ps>
 		ReturnType Call(Ps&&... args) {
-			try {
-				return ScriptCallImpl<Rs...>::Call(state_, callee_ref_, std::forward<Ps>(args)...);
-			} catch (const LuaException& e) {
-				errmsg_ = e.what();
-				return std::nullopt;
-			}
+			return ScriptCallImpl<Rs...>::TryCall(state_, error_, callee_ref_, std::forward<Ps>(args)...);
 		}
 
 		template <typename... Ps>
 		ReturnType SelfCall(const char *method, Ps&&... args) {
-			try {
-				return ScriptCallImpl<Rs...>::SelfCall(state_, callee_ref_, method, std::forward<Ps>(args)...);
-			} catch (const LuaException& e) {
-				errmsg_ = e.what();
-				return std::nullopt;
+			return ScriptCallImpl<Rs...>::TrySelfCall(state_, error_, callee_ref_, method, std::forward<Ps>(args)...);
+		}
+
+		/* 以 args[0, count) 中的每组参数调用，结果写入 out[0, count)，返回出错的组数：
+		 * 出错的组结果为 std::nullopt，Error() 中是最后一个错误，需要每个错误时传入 on_error(index, const ScriptError&)
+		*/
+		template <typename... Ps>
+		std::size_t CallBatch(const std::tuple<Ps...>* args, std::size_t count, ReturnType* out) {
+			return ScriptCallImpl<Rs...>::CallBatch(state_, error_, callee_ref_, args, count, out, [](std::size_t, const ScriptError&) {});
+		}
+
+		template <typename... Ps, typename F>
+		std::size_t CallBatch(const std::tuple<Ps...>* args, std::size_t count, ReturnType* out, F&& on_error) {
+			return ScriptCallImpl<Rs...>::CallBatch(state_, error_, callee_ref_, args, count, out, std::forward<F>(on_error));
+		}
+
+		template <typename... Ps>
+		std::size_t CallBatch(const std::vector<std::tuple<Ps...>>& args, std::vector<ReturnType>& out) {
+			out.resize(args.size());
+			return CallBatch(args.data(), args.size(), out.data());
+		}
+
+		/* 结果直接写入 outs（如 std::tie(a, b)），成功时返回 true，出错时错误保存在 Error() 中：
+		 * 不构造 optional 与 tuple，std::string 结果复用已有容量
+		*/
+		template <typename... Outs, typename... Ps>
+		bool CallInto(const std::tuple<Outs&...>& outs, Ps&&... args) {
+			static_assert(!_has_string_view_v<Outs...>, "std::string_view results require a StackGuard pin");
+			StackGuard _guard(state_);
+			if (int status = ScriptCallInto(state_, callee_ref_, outs, std::forward<Ps>(args)...)) {
+				error_.Set(state_, status);
+				return false;
+			}
+			return true;
+		}
+
+		// 结果留在栈上直到 pin 析构，std::string_view 结果在此之前有效；同一个 pin 可以用于多次调用，见 ReservePinned
+		template <typename... Outs, typename... Ps>
+		bool CallInto(StackGuard& pin, const std::tuple<Outs&...>& outs, Ps&&... args) {
+			assert(pin.state_ == state_);
+			ReservePinned<sizeof...(Ps), sizeof...(Outs)>(state_);
+			if (int status = ScriptCallInto(state_, callee_ref_, outs, std::forward<Ps>(args)...)) {
+				error_.Set(state_, status);
+				return false;
 			}
+			return true;
+		}
+
+		// 以 budget 限制本次调用，预算用完时以 LUAMIX_BUDGET_EXCEEDED 错误返回 std::nullopt，见 BudgetScope
+		template <typename... Ps>
+		ReturnType CallWithBudget(const CallBudget& budget, Ps&&... args) {
+			BudgetScope _budget(state_, budget);
+			return Call(std::forward<Ps>(args)...);
+		}
+
+		template <typename... Ps>
+		ReturnType SelfCallWithBudget(const CallBudget& budget, const char* method, Ps&&... args) {
+			BudgetScope _budget(state_, budget);
+			return SelfCall(method, std::forward<Ps>(args)...);
+		}
+
+		// 出错时抛出 LuaException
+		template <typename... Ps>
+		ReturnType CallOrThrow(Ps&&... args) {
+			return ScriptCallImpl<Rs...>::Call(state_, callee_ref_, std::forward<Ps>(args)...);
+		}
+
+		template <typename... Ps>
+		ReturnType SelfCallOrThrow(const char *method, Ps&&... args) {
+			return ScriptCallImpl<Rs...>::SelfCall(state_, callee_ref_, method, std::forward<Ps>(args)...);
 		}
 
 	public:
+		// 最近一次出错的信息，包含调用栈
 		const std::string& ErrMsg() const {
-			return errmsg_;
+			return error_.What();
+		}
+
+		const ScriptError& Error() const {
+			return error_;
 		}
 
 	private:
 		lua_State* state_;
 		int callee_ref_;
-		std::string errmsg_;
+		ScriptError error_;
 	};
 }
\ No newline at end of file
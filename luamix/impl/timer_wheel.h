@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	/* 分层时间轮，时间单位由使用者决定（Scheduler 以毫秒为单位）：
+	 * 第一层 256 个槽位，每个槽位一个时间单位；之后四层各 64 个槽位，每层的槽位跨度是上一层的整层，
+	 * 最长可以表示 2^32 个时间单位，更远的定时器按最远的时间放置。
+	 * 定时器节点保存在数组中，以下标串成槽位的双向链表，添加与取消都是 O(1)；
+	 * 推进时间时只在第一层转过一圈时把上层的一个槽位重新分配到下层，到期的值批量取出
+	*/
+	template <typename T>
+	class TimerWheel {
+	public:
+		using TimerId = std::uint64_t;	// 高32位为序号，低32位为节点下标
+
+	public:
+		explicit TimerWheel(std::uint64_t now = 0)
+			: now_(now)
+		{
+			heads_.assign(kRootSlots + kLevels * kLevelSlots, kNil);
+		}
+
+	public:
+		// delay 个时间单位之后到期，delay 为0时按1处理
+		TimerId Add(std::uint64_t delay, T value) {
+			std::uint32_t index = 0;
+			if (!free_.empty()) {
+				index = free_.back();
+				free_.pop_back();
+			} else {
+				index = static_cast<std::uint32_t>(nodes_.size());
+				nodes_.emplace_back();
+			}
+			auto& node = nodes_[index];
+			node.expire = now_ + (delay ? (delay < kMaxDelay ? delay : kMaxDelay) : 1);
+			node.value = std::move(value);
+			node.live = true;
+			++node.serial;
+			link(index);
+			++size_;
+			return (static_cast<TimerId>(node.serial) << 32) | index;
+		}
+
+		// 未到期的定时器的值，id 无效或者已经到期时返回 nullptr
+		const T* Find(TimerId id) const {
+			auto index = static_cast<std::uint32_t>(id & 0xffffffff);
+			return valid(id, index) ? &nodes_[index].value : nullptr;
+		}
+
+		// 取消未到期的定时器，out 不为空时取出它的值
+		bool Cancel(TimerId id, T* out = nullptr) {
+			auto index = static_cast<std::uint32_t>(id & 0xffffffff);
+			if (!valid(id, index)) {
+				return false;
+			}
+			unlink(index);
+			if (out) {
+				*out = std::move(nodes_[index].value);
+			}
+			release(index);
+			return true;
+		}
+
+		// 推进到 now，到期的值追加到 out（先到期的在前），返回到期的个数；第一层为空时直接跳到下一次重新分配
+		std::size_t Advance(std::uint64_t now, std::vector<T>& out) {
+			std::size_t expired = 0;
+			while (now_ < now) {
+				if (!size_) {
+					now_ = now;
+					break;
+				}
+				if (!root_size_) {
+					std::uint64_t last = now_ | (kRootSlots - 1);
+					if (last >= now) {
+						now_ = now;
+						break;
+					}
+					now_ = last;
+				}
+				++now_;
+				if (0 == (now_ & (kRootSlots - 1))) {
+					for (int level = 0; level < kLevels; ++level) {
+						auto slot = static_cast<std::uint32_t>((now_ >> (kRootBits + level * kLevelBits)) & (kLevelSlots - 1));
+						cascade(kRootSlots + level * kLevelSlots + slot);
+						if (slot) {
+							break;
+						}
+					}
+				}
+				auto& head = heads_[now_ & (kRootSlots - 1)];
+				while (head != kNil) {
+					std::uint32_t index = head;
+					unlink(index);
+					out.push_back(std::move(nodes_[index].value));
+					release(index);
+					++expired;
+				}
+			}
+			return expired;
+		}
+
+		// 下一个定时器最早可能到期的时间距离，没有定时器时返回 limit；
+		// 只查看第一层，第一层在本圈内没有定时器时返回到下一次重新分配的距离
+		std::uint64_t NextDelay(std::uint64_t limit) const {
+			if (!size_) {
+				return limit;
+			}
+			std::uint64_t end = (now_ | (kRootSlots - 1)) + 1;
+			for (std::uint64_t t = now_ + 1; t < end && t - now_ < limit; ++t) {
+				if (heads_[t & (kRootSlots - 1)] != kNil) {
+					return t - now_;
+				}
+			}
+			return end - now_ < limit ? end - now_ : limit;
+		}
+
+		// 对所有未到期的值调用 fn 并清空
+		template <typename F>
+		void Clear(F&& fn) {
+			for (auto& node : nodes_) {
+				if (node.live) {
+					fn(node.value);
+					node.live = false;
+				}
+			}
+			heads_.assign(heads_.size(), kNil);
+			root_size_ = 0;
+			free_.clear();
+			for (std::uint32_t i = 0; i < nodes_.size(); ++i) {
+				free_.push_back(i);
+			}
+			size_ = 0;
+		}
+
+		std::size_t GetSize() const {
+			return size_;
+		}
+
+		std::uint64_t GetTime() const {
+			return now_;
+		}
+
+	private:
+		static constexpr int kRootBits = 8;
+		static constexpr int kLevelBits = 6;
+		static constexpr int kLevels = 4;
+		static constexpr std::uint64_t kRootSlots = 1ull << kRootBits;
+		static constexpr std::uint64_t kLevelSlots = 1ull << kLevelBits;
+		static constexpr std::uint64_t kMaxDelay = (1ull << (kRootBits + kLevels * kLevelBits)) - 1;
+		static constexpr std::uint32_t kNil = 0xffffffff;
+
+		struct Node {
+			std::uint64_t expire = 0;
+			std::uint32_t prev = kNil;
+			std::uint32_t next = kNil;
+			std::uint32_t slot = kNil;
+			std::uint32_t serial = 0;
+			bool live = false;
+			T value{};
+		};
+
+		bool valid(TimerId id, std::uint32_t index) const {
+			return index < nodes_.size() && nodes_[index].live && nodes_[index].serial == static_cast<std::uint32_t>(id >> 32);
+		}
+
+		// 按距离到期的时间选择层与槽位
+		void link(std::uint32_t index) {
+			auto& node = nodes_[index];
+			std::uint64_t delay = node.expire - now_;
+			std::uint32_t slot = 0;
+			if (delay < kRootSlots) {
+				slot = static_cast<std::uint32_t>(node.expire & (kRootSlots - 1));
+			} else {
+				int level = 0;
+				while (delay >= (1ull << (kRootBits + (level + 1) * kLevelBits))) {
+					++level;
+				}
+				auto offset = (node.expire >> (kRootBits + level * kLevelBits)) & (kLevelSlots - 1);
+				slot = static_cast<std::uint32_t>(kRootSlots + level * kLevelSlots + offset);
+			}
+			node.slot = slot;
+			root_size_ += slot < kRootSlots;
+			node.prev = kNil;
+			node.next = heads_[slot];
+			if (node.next != kNil) {
+				nodes_[node.next].prev = index;
+			}
+			heads_[slot] = index;
+		}
+
+		void unlink(std::uint32_t index) {
+			auto& node = nodes_[index];
+			if (node.prev != kNil) {
+				nodes_[node.prev].next = node.next;
+			} else {
+				heads_[node.slot] = node.next;
+			}
+			if (node.next != kNil) {
+				nodes_[node.next].prev = node.prev;
+			}
+			root_size_ -= node.slot < kRootSlots;
+		}
+
+		void release(std::uint32_t index) {
+			auto& node = nodes_[index];
+			node.live = false;
+			node.value = T{};
+			free_.push_back(index);
+			--size_;
+		}
+
+		// 把上层槽位中的定时器按当前时间重新放置
+		void cascade(std::uint32_t slot) {
+			std::uint32_t index = heads_[slot];
+			heads_[slot] = kNil;
+			while (index != kNil) {
+				std::uint32_t next = nodes_[index].next;
+				link(index);
+				index = next;
+			}
+		}
+
+	private:
+		std::uint64_t now_;
+		std::size_t size_ = 0;
+		std::size_t root_size_ = 0;		// 第一层中的定时器数
+		std::vector<Node> nodes_;
+		std::vector<std::uint32_t> free_;
+		std::vector<std::uint32_t> heads_;
+	};
+}
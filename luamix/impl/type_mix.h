@@ -29,7 +29,7 @@ namespace LuaMix::Impl {
 	template <typename T>
 	inline constexpr bool _is_class_v = std::is_class_v<std::remove_cv_t<std::remove_pointer_t<T>>>;
 
-	// ڴ˸ɷʵ֣ûжӦػ
+	// 在此根据类型派发给具体的实现，如果没有对应的特化，则引发编译错误
 	template <typename T, typename DT = std::decay_t<T>>
 	struct TypeMix : std::conditional_t< _is_type_speced_v<T>, _type_mix_spec<T>,
 		std::conditional_t<_is_type_speced_v<DT>, _type_mix_spec<DT>,
@@ -43,7 +43,7 @@ namespace LuaMix::Impl {
 		TypeMix<T>::Push(L, value);
 	}
 
-	// ṩchar *ǱҪģ`const T& value` ὫֵַƵΪַͣ TypeMix ʵʧܣûҲж֧:-(
+	// 提供对于char *的重载是必要的，`const T& value` 会将字符串字面值推导为字符数组类型，导致 TypeMix 实例化失败，并没有也不会有对数组的支持:-(
 	inline void Push(lua_State* L, const char* value) {
 		lua_pushstring(L, value);
 	}
@@ -57,8 +57,24 @@ namespace LuaMix::Impl {
 		return TypeMix<T>::Fetch<CHECK>(L, index);
 	}
 
+	// 取值到调用者提供的变量中
+	template <typename T>
+	inline void FetchInto(lua_State* L, int index, T& out) {
+		out = Fetch<T>(L, index);
+	}
+
+	// std::string 复用已有的容量，容量足够时不分配
+	inline void FetchInto(lua_State* L, int index, std::string& out) {
+		std::size_t len = 0;
+		if (auto p = lua_tolstring(L, index, &len)) {
+			out.assign(p, len);
+		} else {
+			out.clear();
+		}
+	}
+
 	//////////////////////////////////////////////////////////////////////////
-	// ͡öͳһ
+	// 整型、枚举统一处理
 	template <typename T>
 	struct _integer_mix_speced {
 		using ArgHoldType = std::decay_t<T>;
@@ -84,7 +100,7 @@ namespace LuaMix::Impl {
 	struct _type_mix_spec<T, std::enable_if_t<std::is_enum_v<T>>> : _integer_mix_speced<T> {};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ͳһ
+	// 浮点型统一处理
 	template <typename T>
 	struct _type_mix_spec<T, std::enable_if_t<std::is_floating_point_v<T>>> {
 		using ArgHoldType = std::decay_t<T>;
@@ -104,7 +120,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ػ
+	// 布尔类型特化
 	template <>
 	struct _type_mix_spec<bool> {
 		using ArgHoldType = bool;
@@ -120,7 +136,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ַػע⣺signed char  unsigned char Ϊַʹ
+	// 字符型特化；注意：signed char 和 unsigned char 并不视为字符，均按照整型处理
 	template <>
 	struct _type_mix_spec<char> {
 		using ArgHoldType = char;
@@ -145,7 +161,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ػ char *
+	// 特化 char *
 	template <>
 	struct _type_mix_spec<char*> {
 		using ArgHoldType = char*;
@@ -154,7 +170,7 @@ namespace LuaMix::Impl {
 			lua_pushstring(L, value);
 		}
 
-		// luaеַڲģﲻṩluaзchar *Ĳ
+		// lua中的字符串是内部化的，所以这里不提供从lua中返回char *的操作
 	};
 
 	template <>
@@ -180,7 +196,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ػ std::stringֵд
+	// 特化 std::string，按照值语义进行处理
 	template <>
 	struct _type_mix_spec<std::string> {
 		using ArgHoldType = std::string;
@@ -206,7 +222,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ػ std::string_view
+	// 特化 std::string_view
 	template <>
 	struct _type_mix_spec<std::string_view> {
 		using ArgHoldType = std::string_view;
@@ -232,7 +248,7 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ػ lua_CFunction
+	// 特化 lua_CFunction
 	template <>
 	struct _type_mix_spec<lua_CFunction> {
 		using ArgHoldType = lua_CFunction;
@@ -248,13 +264,17 @@ namespace LuaMix::Impl {
 	};
 
 	//////////////////////////////////////////////////////////////////////////
-	// ͳһ
+	// 类类型统一处理
 	constexpr const char* UndefinedClassType = "undefined class type";
 	constexpr const char* MetaKeyGet = ".get";
 	constexpr const char* MetaKeySet = ".set";
 	constexpr const char* MetaKeySuper = ".super";
 	constexpr const char* MetaKeyUBox = ".ubox";
 	constexpr const char* MetaKeyGC = ".gc";
+	constexpr const char* MetaKeyGCNative = ".gcn";
+	constexpr const char* MetaKeyDeferred = ".deferred";
+	constexpr const char* MetaKeyPool = ".pool";
+	constexpr const char* MetaKeyExternalSize = ".extsize";
 
 	template <typename C, int KIND = 0>
 	struct ClassTypeSignature {
@@ -267,7 +287,7 @@ namespace LuaMix::Impl {
 	template <typename C>
 	using ClassConstSignature = ClassTypeSignature<C, 1>;
 
-	// ָ
+	// 指针类型
 	template <typename C>
 	struct _type_mix_class<C*> {
 		using ArgHoldType = C*;
@@ -275,7 +295,7 @@ namespace LuaMix::Impl {
 		template <typename T>
 		using ClassSignature = std::conditional_t<std::is_const_v<T>, ClassConstSignature<std::decay_t<T>>, ClassTypeSignature<std::decay_t<T>>>;
 
-		// ЧʿǣֱӵAPI
+		// 效率考虑，直接调用API
 		static void Push(lua_State* L, C* value) {
 			if (!value) {
 				lua_pushnil(L);
@@ -292,7 +312,7 @@ namespace LuaMix::Impl {
 				lua_pushlightuserdata(L, (void*)value);		// :mt, ubox, lud
 
 				if (LUA_TNIL == lua_rawget(L, -2)) {	// :mt, ubox, ubox[lud]
-					// ûл棬½ubox
+					// 没有缓存，新建并加入ubox
 					lua_pop(L, 1);						// :mt, ubox
 					lua_pushlightuserdata(L, (void*)value);	// :mt, ubox, lud
 					*(void**)lua_newuserdata(L, sizeof(void*)) = (void*)value; // :mt, ubox, lud, ud
@@ -304,7 +324,7 @@ namespace LuaMix::Impl {
 					lua_setmetatable(L, -2);			// :mt, ud
 					lua_remove(L, -2);					// :ud
 				} else {
-					// л棬ǷҪԪ
+					// 有缓存，检查是否需要变更元表
 					lua_insert(L, -2);					// :mt, ubox[lud], ubox
 					lua_pop(L, 1);						// :mt, ud
 					lua_pushstring(L, MetaKeySuper);	// :mt, ud, ".super"
@@ -312,11 +332,11 @@ namespace LuaMix::Impl {
 					lua_pushstring(L, ClassSignature<C>::Value()); // :mt, ud, super, cur_type_str
 					lua_rawget(L, -2);					// :mt, ud, super, bool
 					if (1 == lua_toboolean(L, -1)) {
-						// ѴͣҪԪ
+						// 已存在下游类型，不需要变更元表
 						lua_pop(L, 2);					// :mt, ud
 						lua_remove(L, -2);				// :ud
 					} else {
-						// ѹһεͣ°Ԫ
+						// 压入了一个更下游的类型，重新绑定元表
 						lua_pushvalue(L, -4);			// :mt, ud, super, bool, mt
 						lua_setmetatable(L, -4);		// :mt, ud, super, bool
 						lua_pop(L, 2);					// :mt, ud
@@ -326,13 +346,13 @@ namespace LuaMix::Impl {
 			}
 		}
 
-		// ͲԵĻͨ luaL_checkudata ׳쳣ԱԭĴϢ
+		// 类型不对的话，通过 luaL_checkudata 来抛出异常，以便输出原生的错误信息
 		template <bool CHECK = false>
 		static C* Fetch(lua_State* L, int index) {
 			void* ud = lua_touserdata(L, index);
 			switch (lua_type(L, index)) {
 			case LUA_TUSERDATA:
-				// ϸƥ
+				// 类型严格匹配
 				if (lua_getmetatable(L, index)) {	// : mt
 					luaL_getmetatable(L, ClassSignature<C>::Value()); // : mt, c_mt
 					if (lua_rawequal(L, -1, -2)) {
@@ -346,7 +366,7 @@ namespace LuaMix::Impl {
 						return nullptr;
 					}
 				}
-				// ߸ε
+				// 或者更下游的类型
 				lua_pop(L, 1);	// : mt
 				lua_pushstring(L, MetaKeySuper);
 				lua_rawget(L, -2); // : mt, super
@@ -372,7 +392,7 @@ namespace LuaMix::Impl {
 		}
 	};
 
-	// ָ
+	// 指针的引用
 	template <typename C>
 	struct _type_mix_class<C*&> : _type_mix_class<C*> {};
 }
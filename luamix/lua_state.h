@@ -1,15 +1,30 @@
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include "luamix.h"
 
 namespace LuaMix {
 	class LuaState {
 	public:
-		LuaState() 
+		// 默认使用 DefaultAlloc，行为与 luaL_newstate 相同，但可以统计内存并设置上限
+		LuaState()
+			: LuaState(std::make_unique<DefaultAlloc>())
+		{}
+
+		// 使用指定的分配策略创建状态机，策略对象由 LuaState 持有，并在 lua_close 之后释放
+		explicit LuaState(std::unique_ptr<AllocPolicy> alloc)
 			: view_(false)
+			, alloc_(std::move(alloc))
 		{
-			state_ = luaL_newstate();
+			state_ = lua_newstate(&AllocPolicy::Alloc, alloc_.get());
+			if (!state_) {
+				throw std::bad_alloc();
+			}
+			lua_atpanic(state_, &panic);
 			luaL_openlibs(state_);
+			Impl::MixMetaEvent::Init(state_);
 		}
 
 		LuaState(lua_State *L)
@@ -18,9 +33,21 @@ namespace LuaMix {
 		{}
 		
 		~LuaState() {
+			call_error_.Reset();
 			if (state_ && !view_) {
 				lua_close(state_);
+			} else if (state_) {
+				if (finalizer_) {
+					Finalizer::Install(state_, nullptr);
+				}
+				call_cache_.Clear(state_);
+				chunk_cache_.Clear(state_);
 			}
+			// 状态机关闭时入队的对象，由 Finalizer 析构时按需执行
+			finalizer_.reset();
+			alloc_.reset();
+			bytecode_cache_.reset();
+			archives_.clear();
 		}
 
 	public:
@@ -43,43 +70,288 @@ namespace LuaMix {
 	public:
 		void DoFile(const std::string &file_path) {
 			StackGuard _guard(state_);
-			lua_pushcfunction(state_, LuaException::StackTraceback);
-			if (luaL_dofile(state_, file_path.c_str())) {
+			LuaException::PushTraceback(state_);
+			int status = bytecode_cache_ ? bytecode_cache_->Load(state_, file_path.c_str()) : luaL_loadfile(state_, file_path.c_str());
+			if (status || lua_pcall(state_, 0, LUA_MULTRET, -2)) {
 				throw LuaException(state_);
 			}
 		}
 
+		// 编译结果保存在状态机的代码块缓存中，重复执行同一脚本不再编译，见 Impl::ChunkCache
 		void DoString(const std::string& script) {
 			StackGuard _guard(state_);
-			lua_pushcfunction(state_, LuaException::StackTraceback);
-			if (luaL_dostring(state_, script.c_str())) {
+			LuaException::PushTraceback(state_);
+			if (chunk_cache_.DoString(state_, script, 0, -1)) {
+				throw LuaException(state_);
+			}
+		}
+
+		// 以 env 为环境执行脚本，env 为空时使用全局表
+		void DoString(const std::string& script, const LuaRef& env) {
+			StackGuard _guard(state_);
+			LuaException::PushTraceback(state_);
+			if (!env) {
+				lua_pushnil(state_);
+			} else {
+				env.Push();
+			}
+			if (chunk_cache_.DoString(state_, script, lua_isnil(state_, -1) ? 0 : -1, -2)) {
 				throw LuaException(state_);
 			}
 		}
 
-		// ϵͳʱӦڴ˴Ϣ¼־ϲ߼봦
+		// 代码块缓存容量，0 表示不缓存
+		void SetChunkCacheCapacity(std::size_t capacity) {
+			chunk_cache_.SetCapacity(state_, capacity);
+		}
+
+		const ChunkCache::Stats& GetChunkCacheStats() const {
+			return chunk_cache_.GetStats();
+		}
+
+		// 系统集成时，总是应该在此处捕获错误信息，并记录日志，避免让上层逻辑代码处理
+		// func_path 解析后的引用保存在调用缓存中，重复调用同一路径只需逐级 rawget 比对，见 Impl::CallCache
+		// 出错时不经过C++异常，错误保存在 GetLastError() 中
 		template <typename... Rs, typename... Ts>
 		decltype(auto) Call( const char *func_path, Ts&&... args ) {
-			ScriptCall<Rs...> sc(state_, func_path);
-			auto rst = sc.Call(std::forward<Ts>(args)...);
+			auto rst = Impl::ScriptCallImpl<Rs...>::TryCall(state_, call_error_, call_cache_.Get(state_, func_path), std::forward<Ts>(args)...);
 			if (!rst) {
-				std::cout << sc.ErrMsg() << std::endl;
+				std::cout << call_error_.What() << std::endl;
 			}
 			return rst;
 		}
 
 		template <typename... Rs, typename... Ts>
 		decltype(auto) SelfCall(const char* func_path, const char *method, Ts&&... args) {
-			ScriptCall<Rs...> sc(state_, func_path);
-			auto rst = sc.SelfCall(method, std::forward<Ts>(args)...);
+			auto rst = Impl::ScriptCallImpl<Rs...>::TrySelfCall(state_, call_error_, call_cache_.Get(state_, func_path), method, std::forward<Ts>(args)...);
 			if (!rst) {
-				std::cout << sc.ErrMsg() << std::endl;
+				std::cout << call_error_.What() << std::endl;
 			}
 			return rst;
 		}
 
+		// 以 budget 限制本次调用，预算用完时调用出错，错误信息为 LUAMIX_BUDGET_EXCEEDED，见 Impl::BudgetScope
+		template <typename... Rs, typename... Ts>
+		decltype(auto) CallWithBudget(const CallBudget& budget, const char* func_path, Ts&&... args) {
+			BudgetScope _budget(state_, budget);
+			return Call<Rs...>(func_path, std::forward<Ts>(args)...);
+		}
+
+		template <typename... Rs, typename... Ts>
+		decltype(auto) SelfCallWithBudget(const CallBudget& budget, const char* func_path, const char* method, Ts&&... args) {
+			BudgetScope _budget(state_, budget);
+			return SelfCall<Rs...>(func_path, method, std::forward<Ts>(args)...);
+		}
+
+		// 结果直接写入 outs（如 std::tie(a, b)），不构造 optional 与 tuple，见 ScriptCall::CallInto
+		template <typename... Outs, typename... Ts>
+		bool CallInto(const char* func_path, const std::tuple<Outs&...>& outs, Ts&&... args) {
+			static_assert(!Impl::_has_string_view_v<Outs...>, "std::string_view results require a StackGuard pin");
+			StackGuard _guard(state_);
+			return finishCallInto(Impl::ScriptCallInto(state_, call_cache_.Get(state_, func_path), outs, std::forward<Ts>(args)...));
+		}
+
+		// 结果留在栈上直到 pin 析构，std::string_view 结果在此之前有效；同一个 pin 可以用于多次调用，见 Impl::ReservePinned
+		template <typename... Outs, typename... Ts>
+		bool CallInto(StackGuard& pin, const char* func_path, const std::tuple<Outs&...>& outs, Ts&&... args) {
+			assert(pin.state_ == state_);
+			Impl::ReservePinned<sizeof...(Ts), sizeof...(Outs)>(state_);
+			return finishCallInto(Impl::ScriptCallInto(state_, call_cache_.Get(state_, func_path), outs, std::forward<Ts>(args)...));
+		}
+
+		// 以 args 中的每组参数调用 func_path，结果写入 out，返回出错的组数；每个错误都会输出
+		template <typename... Rs, typename... Ps>
+		std::size_t CallBatch(const char* func_path, const std::vector<std::tuple<Ps...>>& args, std::vector<typename ScriptCall<Rs...>::ReturnType>& out) {
+			out.resize(args.size());
+			return Impl::ScriptCallImpl<Rs...>::CallBatch(state_, call_error_, call_cache_.Get(state_, func_path), args.data(), args.size(), out.data(),
+				[](std::size_t index, const ScriptError& err) { std::cout << "[" << index << "] " << err.What() << std::endl; });
+		}
+
+		// 最近一次 Call/SelfCall/CallBatch 出错的信息
+		const ScriptError& GetLastError() const {
+			return call_error_;
+		}
+
+		// 释放 path 及其下级路径缓存的引用；脚本重新赋值路径时缓存会自行失效，不必调用
+		void InvalidateCall(const std::string& path) {
+			call_cache_.Invalidate(state_, path);
+		}
+
+		void ClearCallCache() {
+			call_cache_.Clear(state_);
+		}
+
+		const CallCache::Stats& GetCallCacheStats() const {
+			return call_cache_.GetStats();
+		}
+
+	public:
+		/* 设置字节码缓存，之后 DoFile 与 require 的lua模块都经过缓存加载，见 Impl::BytecodeCache：
+		 * 状态机共享持有缓存，保证映射比从中加载的函数活得更久；设置后不能更换。
+		 * 视图不关闭状态机，析构后 package.searchers 中的搜索器会引用已释放的缓存，因此不能在视图上设置
+		*/
+		void SetBytecodeCache(std::shared_ptr<BytecodeCache> cache) {
+			if (view_) {
+				throw std::logic_error("bytecode cache cannot be set on a LuaState view");
+			}
+			if (bytecode_cache_) {
+				throw std::logic_error("bytecode cache already set");
+			}
+			bytecode_cache_ = std::move(cache);
+			if (bytecode_cache_) {
+				// 归档搜索器插在lua文件搜索器之前
+				BytecodeCache::InstallSearcher(state_, bytecode_cache_.get(), 2 + static_cast<lua_Integer>(archives_.size()));
+			}
+		}
+
+		BytecodeCache* GetBytecodeCache() const {
+			return bytecode_cache_.get();
+		}
+
+		/* 添加脚本归档，之后 require 先从归档中查找模块，见 Impl::ScriptArchive：
+		 * 状态机共享持有归档，后添加的归档优先；与 SetBytecodeCache 一样不能在视图上添加
+		*/
+		void AddScriptArchive(std::shared_ptr<ScriptArchive> archive) {
+			if (view_) {
+				throw std::logic_error("script archive cannot be added to a LuaState view");
+			}
+			if (!archive || !*archive) {
+				throw std::invalid_argument("script archive not opened");
+			}
+			ScriptArchive::InstallSearcher(state_, archive.get());
+			archives_.push_back(std::move(archive));
+		}
+
+	public:
+		// 开启延迟回收，对 DeferredCollect 的类生效
+		Finalizer& EnableFinalizer(Finalizer::Mode mode = Finalizer::Mode::Background) {
+			if (!finalizer_) {
+				finalizer_ = std::make_unique<Finalizer>(mode);
+				Finalizer::Install(state_, finalizer_.get());
+			}
+			return *finalizer_;
+		}
+
+		Finalizer* GetFinalizer() const {
+			return finalizer_.get();
+		}
+
+		// 安全点：执行已入队的回收，Batched 模式下需要定期调用
+		std::size_t DrainFinalizer(std::size_t max = static_cast<std::size_t>(-1)) {
+			return finalizer_ ? finalizer_->Drain(max) : 0;
+		}
+
+	public:
+		// 状态机不是由 AllocPolicy 分配时返回 nullptr
+		AllocPolicy* GetAllocator() const {
+			return AllocPolicy::Find(state_);
+		}
+
+		// 内存上限，见 AllocPolicy::SetLimits
+		bool SetMemoryLimit(std::size_t soft_limit, std::size_t hard_limit) {
+			if (auto alloc = GetAllocator()) {
+				alloc->SetLimits(soft_limit, hard_limit);
+				return true;
+			}
+			return false;
+		}
+
+		// 回调在分配函数内执行，不能调用 lua API
+		bool OnSoftMemoryLimit(AllocPolicy::SoftLimitHandler handler) {
+			if (auto alloc = GetAllocator()) {
+				alloc->SetSoftLimitHandler(std::move(handler));
+				return true;
+			}
+			return false;
+		}
+
+		AllocPolicy::Stats GetMemoryStats() const {
+			if (auto alloc = GetAllocator()) {
+				return alloc->GetStats();
+			}
+			AllocPolicy::Stats stats{};
+			stats.live_bytes = static_cast<std::size_t>(lua_gc(state_, LUA_GCCOUNT, 0)) * 1024 + lua_gc(state_, LUA_GCCOUNTB, 0);
+			return stats;
+		}
+
+	public:
+		// 自动GC开关；关闭后只有 CollectFor、显式的 collectgarbage 及内存不足时才会回收
+		void SetAutoCollect(bool enable) {
+			lua_gc(state_, enable ? LUA_GCRESTART : LUA_GCSTOP, 0);
+		}
+
+		// 切换GC模式，返回之前的模式，见 Impl::SetGCMode
+		GCMode SetGCMode(GCMode mode, int minor_mul = 0) {
+			return Impl::SetGCMode(state_, mode, minor_mul);
+		}
+
+		// 在时间预算内推进增量GC，完成一个周期时返回 true，见 Impl::CollectFor
+		bool CollectFor(std::chrono::microseconds budget) {
+			return Impl::CollectFor(state_, budget, gc_stats_);
+		}
+
+		/* 冻结 ref 引用的对象及其可达的全部对象，之后的GC周期不再遍历和清除它们，被冻结的对象永不回收：
+		 * 适合启动后不再变化的类元表、模块表与脚本函数。冻结前会执行一次全量回收；
+		 * lua闭包、协程与弱表不冻结而是作为常驻的根对象，每个周期仍会遍历；
+		 * 向冻结的对象写入未冻结的值会把它解冻为根对象，代价与冻结对象数成正比
+		*/
+		void Freeze(const LuaRef& ref) {
+			ref.Push();
+			lua_freeze(state_, -1);
+			lua_pop(state_, 1);
+		}
+
+		// 冻结当前可达的全部对象；注册表与全局表本身经常改动，只冻结其中的值
+		void FreezeAll() {
+			lua_pushvalue(state_, LUA_REGISTRYINDEX);
+			lua_freeze(state_, -1);
+			lua_pop(state_, 1);
+		}
+
+		// 设置脚本对象的外部内存字节数，计入GC债务，见 Impl::SetExternalSize
+		void SetExternalSize(const void* obj, std::size_t bytes) {
+			Impl::SetExternalSize(state_, obj, bytes);
+		}
+
+		// 当前记账的外部内存总字节数
+		std::size_t GetExternalBytes() const {
+			return Impl::ExternalBytes(state_);
+		}
+
+		const GCStats& GetGCStats() const {
+			return gc_stats_;
+		}
+
+		void ResetGCStats() {
+			gc_stats_.Reset();
+		}
+
+	private:
+		bool finishCallInto(int status) {
+			if (status == LUA_OK) {
+				return true;
+			}
+			call_error_.Set(state_, status);
+			std::cout << call_error_.What() << std::endl;
+			return false;
+		}
+
+		// 与 luaL_newstate 的 panic 函数相同
+		static int panic(lua_State* L) {
+			lua_writestringerror("PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+			return 0;
+		}
+
 	private:
 		lua_State* state_;
 		bool view_;
+		std::unique_ptr<Finalizer> finalizer_;
+		std::unique_ptr<AllocPolicy> alloc_;
+		std::shared_ptr<BytecodeCache> bytecode_cache_;
+		std::vector<std::shared_ptr<ScriptArchive>> archives_;
+		ChunkCache chunk_cache_;
+		CallCache call_cache_;
+		ScriptError call_error_;
+		GCStats gc_stats_;
 	};
 }
\ No newline at end of file
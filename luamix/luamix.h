@@ -6,17 +6,53 @@
 #include "impl/lua_ref.h"
 #include "impl/meta_mix.h"
 #include "impl/script_call.h"
+#include "impl/alloc_mix.h"
+#include "impl/gc_mix.h"
+#include "impl/bytecode_cache.h"
+#include "impl/chunk_cache.h"
+#include "impl/sandbox.h"
+#include "impl/script_archive.h"
+#include "impl/call_cache.h"
+#include "impl/lua_function.h"
+#include "impl/event_channel.h"
+#include "impl/coroutine_pool.h"
+#include "impl/scheduler.h"
 
 
 namespace LuaMix {
 	using LuaRef = Impl::LuaRef;
 	using StackGuard = Impl::StackGuard;
 	using LuaException = Impl::LuaException;
+	using ScriptError = Impl::ScriptError;
+	using CallBudget = Impl::CallBudget;
+	using BudgetScope = Impl::BudgetScope;
+	using Finalizer = Impl::Finalizer;
+	using AllocPolicy = Impl::AllocPolicy;
+	using DefaultAlloc = Impl::DefaultAlloc;
+	using PoolAlloc = Impl::PoolAlloc;
+	using ObjectPoolStats = Impl::ObjectPoolStats;
+	using GCStats = Impl::GCStats;
+	using GCPhase = Impl::GCPhase;
+	using GCMode = Impl::GCMode;
+	using BytecodeCache = Impl::BytecodeCache;
+	using ChunkCache = Impl::ChunkCache;
+	using Sandbox = Impl::Sandbox;
+	using SandboxStats = Impl::SandboxStats;
+	using ScriptArchive = Impl::ScriptArchive;
+	using CallCache = Impl::CallCache;
+	using EventChannel = Impl::EventChannel;
+	using Async = Impl::Async;
+	using CoroutinePool = Impl::CoroutinePool;
+	using ScriptTask = Impl::ScriptTask;
+	using Scheduler = Impl::Scheduler;
 
 	template <typename... Rs>
 	using ScriptCall = Impl::ScriptCall<Rs...>;
 
-	// ģ鶨
+	template <typename F>
+	using LuaFunction = Impl::LuaFunction<F>;
+
+	// 模块定义
 	inline Impl::ModuleMeta ModuleDef(lua_State *L, const char* name) {
 		auto md = LuaRef::RefTable(L, name, true);
 		if (!md) {
@@ -34,7 +70,7 @@ namespace LuaMix {
 		return Impl::ModuleMeta(LuaRef::RefGlobal(L));
 	}
 
-	// ඨ
+	// 类定义
 	template <typename C, typename B = void>
 	Impl::ClassMeta<C> ClassDef(lua_State* L, const char* class_name, const char* const_name, LuaRef export_to = LuaRef()) {
 		if (!export_to) {
@@ -53,7 +89,7 @@ namespace LuaMix {
 	}
 }
 
-// ݺ
+// 便捷宏
 #define LUAMIX_MODULE_EXPORT(L, M)	LuaMix::ModuleDef(L, #M)
 #define LUAMIX_GLOBAL_EXPORT(L)	LuaMix::ModuleDef(L)
 
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "luamix.h"
+
+#define LUAMIX_PARALLEL_SUPPORT(L)	LuaMix::ParallelMix::Support(L);
+
+namespace LuaMix::Impl {
+	//////////////////////////////////////////////////////////////////////////
+	// 并行工作：将下标区间切分为[begin, end)块，只在工作线程中运行，不触碰 lua_State
+	class ParallelJob {
+	public:
+		using Body = std::function<void(std::size_t, std::size_t)>;
+		using Callback = std::function<void(const char* error)>;
+
+		ParallelJob(std::size_t n, std::size_t grain, Body body)
+			: n_(n)
+			, grain_(grain ? grain : 1)
+			, body_(std::move(body))
+			, next_(0)
+			, left_((n + grain_ - 1) / grain_)
+		{}
+
+	public:
+		// 领取下一块并执行，没有可领取的块时返回 false
+		bool RunOne() {
+			std::size_t begin = next_.fetch_add(grain_, std::memory_order_relaxed);
+			if (begin >= n_) {
+				return false;
+			}
+			std::size_t end = (std::min)(begin + grain_, n_);
+			if (!failed_.load(std::memory_order_relaxed)) {
+				try {
+					body_(begin, end);
+				} catch (const std::exception& e) {
+					fail(e.what());
+				} catch (...) {
+					fail("unknown exception in parallel kernel");
+				}
+			}
+			if (left_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				if (done_) {
+					done_(Error());
+				}
+				std::lock_guard<std::mutex> _lock(mutex_);
+				cond_.notify_all();
+			}
+			return true;
+		}
+
+		// 最后一块完成时在完成它的线程上调用 cb，参数为错误信息，成功时为 nullptr；只能在提交之前设置
+		void OnDone(Callback cb) {
+			done_ = std::move(cb);
+		}
+
+		bool HasWork() const {
+			return next_.load(std::memory_order_relaxed) < n_;
+		}
+
+		bool Done() const {
+			return left_.load(std::memory_order_acquire) == 0;
+		}
+
+		// 调用方参与执行剩余块，然后等待其他线程完成
+		void Wait() {
+			while (RunOne()) {}
+			std::unique_lock<std::mutex> _lock(mutex_);
+			cond_.wait(_lock, [this] { return Done(); });
+		}
+
+		// 只能在 Done() 之后调用
+		const char* Error() const {
+			return failed_.load(std::memory_order_acquire) ? errmsg_.c_str() : nullptr;
+		}
+
+	private:
+		void fail(const char* msg) {
+			std::lock_guard<std::mutex> _lock(mutex_);
+			if (!failed_.load(std::memory_order_relaxed)) {
+				errmsg_ = msg;
+				failed_.store(true, std::memory_order_release);
+			}
+		}
+
+	private:
+		const std::size_t n_;
+		const std::size_t grain_;
+		Body body_;
+		Callback done_;
+		std::atomic<std::size_t> next_;
+		std::atomic<std::size_t> left_;
+		std::atomic<bool> failed_{ false };
+		std::string errmsg_;
+		std::mutex mutex_;
+		std::condition_variable cond_;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// 工作线程池，整个进程共享一份，第一次使用时创建
+	class ParallelPool {
+	public:
+		static ParallelPool& Instance() {
+			static ParallelPool pool;
+			return pool;
+		}
+
+		std::size_t Concurrency() const {
+			return workers_.size() + 1;
+		}
+
+		void Submit(std::shared_ptr<ParallelJob> job) {
+			{
+				std::lock_guard<std::mutex> _lock(mutex_);
+				jobs_.push_back(std::move(job));
+			}
+			cond_.notify_all();
+		}
+
+		~ParallelPool() {
+			{
+				std::lock_guard<std::mutex> _lock(mutex_);
+				stop_ = true;
+			}
+			cond_.notify_all();
+			for (auto& t : workers_) {
+				t.join();
+			}
+		}
+
+	private:
+		ParallelPool() {
+			unsigned int n = std::thread::hardware_concurrency();
+			n = n > 1 ? n - 1 : 1;	// 调用方线程本身也会参与计算
+			for (unsigned int i = 0; i < n; ++i) {
+				workers_.emplace_back([this] { loop(); });
+			}
+		}
+
+		void loop() {
+			for (;;) {
+				std::shared_ptr<ParallelJob> job;
+				{
+					std::unique_lock<std::mutex> _lock(mutex_);
+					cond_.wait(_lock, [this] { return stop_ || !jobs_.empty(); });
+					if (stop_) {
+						return;
+					}
+					job = jobs_.front();
+					if (!job->HasWork()) {
+						// 块已领完，移出队列；尚未完成的块由持有者负责收尾
+						jobs_.pop_front();
+						continue;
+					}
+				}
+				while (job->RunOne()) {}
+			}
+		}
+
+	private:
+		std::vector<std::thread> workers_;
+		std::deque<std::shared_ptr<ParallelJob>> jobs_;
+		std::mutex mutex_;
+		std::condition_variable cond_;
+		bool stop_ = false;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+	// 内核抽象：在脚本线程上采集参数，生成一个可以跨线程执行的工作
+	struct ParallelKernel : std::enable_shared_from_this<ParallelKernel> {
+		virtual ~ParallelKernel() = default;
+		virtual std::shared_ptr<ParallelJob> Prepare(lua_State* L, int arg_base, std::size_t n) = 0;
+	};
+
+	/* IS_RANGE 为 true 时内核签名为 void(std::size_t begin, std::size_t end, P...)，
+	 * 否则为 void(std::size_t i, P...)；
+	 * P 的规则同导出函数的形参，但由于内核执行在工作线程，不支持出参
+	*/
+	template <bool IS_RANGE, typename F, typename... P>
+	struct ParallelKernelImpl : ParallelKernel {
+		using SwapList = std::tuple<CppArg<P>...>;
+
+		F func_;
+		std::size_t grain_;
+
+		ParallelKernelImpl(F func, std::size_t grain)
+			: func_(std::move(func))
+			, grain_(grain) {}
+
+		std::shared_ptr<ParallelJob> Prepare(lua_State* L, int arg_base, std::size_t n) override {
+			auto args = std::make_shared<SwapList>();
+			std::apply([L, arg_base](auto &... arg) {
+				int index = arg_base;
+				(..., arg.Input(L, index++));
+				}, *args);
+
+			std::size_t grain = grain_;
+			if (!grain) {
+				// 默认每个线程平均分八块，以均衡负载
+				grain = n / (ParallelPool::Instance().Concurrency() * 8);
+			}
+			// 工作持有内核的引用，内核对象先于工作被回收也不受影响
+			auto self = std::static_pointer_cast<ParallelKernelImpl>(shared_from_this());
+			return std::make_shared<ParallelJob>(n, grain, [self, args](std::size_t begin, std::size_t end) {
+				std::apply([&self, begin, end](auto &... arg) {
+					if constexpr (IS_RANGE) {
+						std::invoke(self->func_, begin, end, arg.Value()...);
+					} else {
+						for (std::size_t i = begin; i < end; ++i) {
+							std::invoke(self->func_, i, arg.Value()...);
+						}
+					}
+					}, *args);
+			});
+		}
+	};
+
+	template <bool IS_RANGE, typename F, typename SIG>
+	struct ParallelKernelTraits;
+
+	template <typename F, typename R, typename... P>
+	struct ParallelKernelTraits<false, F, std::function<R(std::size_t, P...)>> {
+		using Type = ParallelKernelImpl<false, F, P...>;
+	};
+
+	template <typename F, typename R, typename... P>
+	struct ParallelKernelTraits<true, F, std::function<R(std::size_t, std::size_t, P...)>> {
+		using Type = ParallelKernelImpl<true, F, P...>;
+	};
+
+	template <bool IS_RANGE, typename F>
+	using ParallelKernelOf = typename ParallelKernelTraits<IS_RANGE, F, decltype(std::function(std::declval<F>()))>::Type;
+}
+
+namespace LuaMix {
+	struct ParallelMix {
+		static constexpr const char* KernelMeta = "LuaMix.ParallelKernel";
+		static constexpr const char* JobMeta = "LuaMix.ParallelJob";
+
+		// 在 LuaMix 表中注册 parallel_for
+		static void Support(lua_State* L) {
+			Impl::MixMetaEvent::Init(L);
+			Impl::StackGuard _guard(L);
+
+			if (luaL_newmetatable(L, KernelMeta)) {
+				lua_pushcfunction(L, &destruct<KernelHolder>);
+				lua_setfield(L, -2, "__gc");
+			}
+			if (luaL_newmetatable(L, JobMeta)) {
+				lua_pushcfunction(L, &destruct<JobHolder>);
+				lua_setfield(L, -2, "__gc");
+			}
+
+			lua_getglobal(L, "LuaMix");
+			lua_pushcfunction(L, &parallel_for);
+			lua_setfield(L, -2, "parallel_for");
+		}
+
+		// 按下标的内核对象：函数签名 void(std::size_t i, P...)
+		// grain 为每块处理的下标数，0 表示按线程池规模自动选择
+		template <typename F>
+		static LuaRef MakeKernel(lua_State* L, F func, std::size_t grain = 0) {
+			return makeKernel<Impl::ParallelKernelOf<false, F>>(L, std::move(func), grain);
+		}
+
+		// 按区间的内核对象：函数签名 void(std::size_t begin, std::size_t end, P...)
+		template <typename F>
+		static LuaRef MakeRangeKernel(lua_State* L, F func, std::size_t grain = 0) {
+			return makeKernel<Impl::ParallelKernelOf<true, F>>(L, std::move(func), grain);
+		}
+
+	private:
+		struct KernelHolder {
+			std::shared_ptr<Impl::ParallelKernel> kernel_;
+		};
+
+		struct JobHolder {
+			std::shared_ptr<Impl::ParallelJob> job_;
+
+			~JobHolder() {
+				// 协程被放弃而回收时，需要等工作完成，否则内核仍可能引用已回收的lua对象
+				if (job_) {
+					job_->Wait();
+				}
+			}
+		};
+
+		template <typename K, typename F>
+		static LuaRef makeKernel(lua_State* L, F func, std::size_t grain) {
+			Impl::MixMetaEvent::Init(L);
+			auto holder = ::new (lua_newuserdata(L, sizeof(KernelHolder))) KernelHolder;
+			holder->kernel_ = std::make_shared<K>(std::move(func), grain);
+			if (luaL_newmetatable(L, KernelMeta)) {
+				lua_pushcfunction(L, &destruct<KernelHolder>);
+				lua_setfield(L, -2, "__gc");
+			}
+			lua_setmetatable(L, -2);
+			return LuaRef::RefStack(L);
+		}
+
+		template <typename T>
+		static int destruct(lua_State* L) {
+			static_cast<T*>(lua_touserdata(L, 1))->~T();
+			return 0;
+		}
+
+		static int finish(lua_State* L, Impl::ParallelJob& job) {
+			if (auto err = job.Error()) {
+				return luaL_error(L, "%s", err);
+			}
+			return 0;
+		}
+
+		// L 是否为 Scheduler 的任务协程并且此处可以让出，只有这时才能等待 Async；
+		// 任务中不能让出的地方（如 table.sort 的比较函数）与其它情形一样阻塞等待
+		static bool inSchedulerTask(lua_State* L) {
+			lua_rawgetp(L, LUA_REGISTRYINDEX, Impl::LUAMIX_KEY_SCHEDULER);
+			auto queue = static_cast<Impl::AsyncQueue*>(lua_touserdata(L, -1));
+			lua_pop(L, 1);
+			return queue && queue->tasks.count(L) && lua_isyieldable(L);
+		}
+
+		// LuaMix.parallel_for(kernel, n, args...)
+		static int parallel_for(lua_State* L) {
+			auto holder = static_cast<KernelHolder*>(luaL_checkudata(L, 1, KernelMeta));
+			lua_Integer n = luaL_checkinteger(L, 2);
+			luaL_argcheck(L, n >= 0, 2, "count must be non-negative");
+			if (n == 0) {
+				return 0;
+			}
+
+			auto job_holder = ::new (lua_newuserdata(L, sizeof(JobHolder))) JobHolder;
+			luaL_setmetatable(L, JobMeta);
+
+			try {
+				job_holder->job_ = holder->kernel_->Prepare(L, 3, static_cast<std::size_t>(n));
+			} catch (const std::exception& e) {
+				return luaL_error(L, "%s", e.what());
+			}
+
+			auto& job = *job_holder->job_;
+			if (inSchedulerTask(L)) {
+				// 在调度任务中：不占用脚本线程，工作完成时由完成最后一块的线程结束 Async，Scheduler::Poll 恢复任务
+				Impl::Async op;
+				job.OnDone([op](const char* err) {
+					if (err) {
+						op.Reject(err);
+					} else {
+						op.Resolve();
+					}
+				});
+				Impl::ParallelPool::Instance().Submit(job_holder->job_);
+				Impl::Push(L, op);
+				return Impl::AsyncAwait(L, lua_gettop(L));
+			}
+			Impl::ParallelPool::Instance().Submit(job_holder->job_);
+			job.Wait();
+			return finish(L, job);
+		}
+	};
+}
@@ -6,12 +6,14 @@
 #include "luamix.h"
 
 #define LUAMIX_VECTOR_SUPPORT(L, T)	LuaMix::VectorMix<T>::Support(L, #T);
+// 同时按容量记账脚本创建的vector的外部内存
+#define LUAMIX_VECTOR_SUPPORT_ACCOUNTED(L, T)	LuaMix::VectorMix<T>::Support(L, #T, true);
 
 namespace LuaMix {
 	template <typename T>
 	struct VectorMix {
-		static void Support(lua_State *L, const char *name) {
-			// name޳һ¿ո񣬱*ͣ
+		static void Support(lua_State *L, const char *name, bool account = false) {
+			// name剔除一下空格，避免类似*号停靠带来的问题
 			std::vector<char> fname(strlen(name) + 1, 0);
 			auto it = fname.begin();
 			for (auto pos = 0; pos < fname.size() - 1; ++pos) {
@@ -26,7 +28,7 @@ namespace LuaMix {
 			std::string const_name = "const " + reg_name;
 			auto cm = ClassDef<VT>(L, reg_name.c_str(), const_name.c_str());
 
-			// ׼ƥصķ
+			// 精准匹配重载的方法
 			cm.Method("empty", static_cast<bool(VT::*)()const>(&VT::empty));
 			cm.Method("size", static_cast<typename VT::size_type(VT::*)()const>(&VT::size));
 			cm.Method("max_size", static_cast<typename VT::size_type(VT::*)()const>(&VT::max_size));
@@ -38,12 +40,12 @@ namespace LuaMix {
 			cm.Method("pop_back", static_cast<void(VT::*)()>(&VT::pop_back));
 			cm.Method("push_back", static_cast<void(VT::*)(const T&val)>(&VT::push_back));
 
-			// ׸selfķʽչĳԱ
-			// Щֱʵֳɾ̬ԱЧʻ
+			// 以首个参数是self对象的方式，扩展类的成员方法
+			// 这些函数直接实现成静态成员函数效率会更高
 			auto resize_with = [](VT *vec, int count, const T& val) {
 				vec->resize(count, val);
 			};
-			// һƹresize
+			// 这里给一个别名，以绕过resize函数的重载
 			cm.Function("resize_with", resize_with);
 
 			auto swap_with = [](VT* self, VT* other) {
@@ -82,6 +84,43 @@ namespace LuaMix {
 			cm.CClosure("ipairs", &ipairs, const_name);
 
 			cm.Factory("new", [] { return new std::vector<T>; }, [](std::vector<T>* v) { delete v; });
+
+			if (!account) {
+				return;
+			}
+			// 脚本创建的vector按容量记账外部内存，会改变容量的方法调用后同步；不记账的类型不包装，方法调用没有额外开销
+			cm.ExternalSize([](const VT* vec) { return vec->capacity() * sizeof(T); });
+			auto mt = cm.RefClassMetatable();
+			for (auto name : { "reserve", "shrink_to_fit", "resize", "push_back", "resize_with", "insert" }) {
+				cm.CClosure(name, &resync, mt.RawGet(name), 1);
+			}
+			cm.CClosure("swap", &resync, mt.RawGet("swap"), 2);
+		}
+
+		/* 调用 upvalue(1) 中的原方法，之后前 upvalue(2) 个参数（均为vector）的容量如有变化则同步外部内存记账；
+		 * 只有脚本创建的vector已记账，其余的由 UpdateExternalSize 忽略
+		*/
+		static int resync(lua_State* L) {
+			int count = static_cast<int>(lua_tointeger(L, lua_upvalueindex(2)));
+			std::vector<T>* vecs[2] = {};
+			std::size_t caps[2] = {};
+			for (int i = 0; i < count; ++i) {
+				// 类型不符的参数留给原方法报错
+				if (auto ud = luaL_testudata(L, i + 1, Impl::ClassTypeSignature<std::vector<T>>::Value())) {
+					vecs[i] = *static_cast<std::vector<T>**>(ud);
+					caps[i] = vecs[i] ? vecs[i]->capacity() : 0;
+				}
+			}
+			int top = lua_gettop(L);
+			lua_pushvalue(L, lua_upvalueindex(1));
+			lua_insert(L, 1);
+			lua_call(L, top, LUA_MULTRET);
+			for (int i = 0; i < count; ++i) {
+				if (vecs[i] && vecs[i]->capacity() != caps[i]) {
+					Impl::UpdateExternalSize(L, vecs[i], vecs[i]->capacity() * sizeof(T));
+				}
+			}
+			return lua_gettop(L);
 		}
 
 		static int ipairsaux(lua_State* L) {
@@ -99,9 +138,9 @@ namespace LuaMix {
 
 		static int ipairs(lua_State* L) {
 			const char* meta = lua_tostring(L, lua_upvalueindex(1));
-			lua_pushcfunction(L, &ipairsaux);	// ĵ
-			lua_pushvalue(L, 1);	// vectorΪ
-			lua_pushinteger(L, -1);	// ӳʼֵ
+			lua_pushcfunction(L, &ipairsaux);	// 真正的迭代器
+			lua_pushvalue(L, 1);	// 以vector本身作为不变量
+			lua_pushinteger(L, -1);	// 迭代子初始值
 			return 3;
 		}
 	};
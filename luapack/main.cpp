@@ -0,0 +1,50 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+
+#include "lualib.h"
+#include "lauxlib.h"
+
+#include "luamix/impl/script_archive.h"
+
+// 把脚本目录打包成脚本归档，见 LuaMix::Impl::ScriptArchive
+// 用法：luapack <脚本目录> <归档文件> [-s|--source] [--strip]
+int main(int argc, char* argv[]) {
+	std::string dir, file;
+	bool bytecode = true;
+	bool strip = false;
+	for (int i = 1; i < argc; ++i) {
+		if (!std::strcmp(argv[i], "-s") || !std::strcmp(argv[i], "--source")) {
+			bytecode = false;
+		} else if (!std::strcmp(argv[i], "--strip")) {
+			strip = true;
+		} else if (dir.empty()) {
+			dir = argv[i];
+		} else if (file.empty()) {
+			file = argv[i];
+		} else {
+			dir.clear();
+			break;
+		}
+	}
+	if (dir.empty() || file.empty()) {
+		std::cerr << "usage: luapack <script_dir> <archive> [-s|--source] [--strip]" << std::endl;
+		return 2;
+	}
+
+	lua_State* L = luaL_newstate();
+	if (!L) {
+		std::cerr << "luapack: cannot create lua state" << std::endl;
+		return 1;
+	}
+	int ret = 0;
+	try {
+		auto count = LuaMix::Impl::ScriptArchive::Pack(L, dir, file, bytecode, strip);
+		std::cout << "luapack: " << count << " modules -> " << file << std::endl;
+	} catch (const std::exception& e) {
+		std::cerr << "luapack: " << e.what() << std::endl;
+		ret = 1;
+	}
+	lua_close(L);
+	return ret;
+}
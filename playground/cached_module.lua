@@ -0,0 +1,15 @@
+-- 经过字节码缓存加载的模块，见 main.cpp 中的字节码缓存测试
+local M = {}
+
+function M.fib(n)
+	if n < 2 then
+		return n
+	end
+	return M.fib(n - 1) + M.fib(n - 2)
+end
+
+function M.where()
+	return debug.getinfo(1, "Sl").short_src .. ":" .. debug.getinfo(1, "l").currentline
+end
+
+return M
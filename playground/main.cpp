@@ -3,10 +3,12 @@
 #include <array>
 #include <tuple>
 #include <vector>
+#include <thread>
 
 #include "luamix/luamix.h"
 #include "luamix/lua_state.h"
 #include "luamix/vector_mix.h"
+#include "luamix/parallel_mix.h"
 
 class Window {
 public:
@@ -100,6 +102,15 @@ bool fetch_window(const Window *& wnd ) {
 	return true;
 }
 
+struct Bullet {
+	float x = 0.0f;
+	float y = 0.0f;
+};
+
+struct Spark {
+	float life = 1.0f;
+};
+
 enum MyEnum {
 	kEnum0 = 0,
 	kEnum1,
@@ -109,29 +120,29 @@ enum MyEnum {
 int main() {
 	LuaMix::LuaState state;
 	//////////////////////////////////////////////////////////////////////////
-	// DoString
+	// 带环境的DoString测试
 	{
 		LuaMix::StackGuard _guard(state);
 
-		// ʱԪ
+		// 创建临时元表
 		auto mt = LuaMix::LuaRef::MakeTable(state);
 		mt.RawSet("__index", LuaMix::LuaRef::RefGlobal(state));
 
-		// 
+		// 创建环境表
 		auto env = LuaMix::LuaRef::MakeTable(state);
 		env.RawSet("a", 99);
 		env.SetMetatable(mt);
-		// ѹջ׷
+		// 压入栈追溯
 		lua_pushcfunction(state, LuaMix::LuaException::StackTraceback);
-		// ַ
+		// 加载字符串
 		std::string script = "print(a, b+1, _G)";
 		luaL_loadstring(state, script.c_str());
-		// û
+		// 设置环境
 		env.Push();
 		if (!lua_setupvalue(state, -2, 1)) {
 			lua_pop(state, 1);
 		}
-		// 
+		// 调用
 		if (LUA_OK != lua_pcall(state, 0, LUA_MULTRET, -2)) {
 			LuaMix::LuaException ex(state);
 			std::cout << ex.what() << std::endl;
@@ -142,7 +153,7 @@ int main() {
 
 
 	//////////////////////////////////////////////////////////////////////////
-	// ȫע
+	// 全局注册
 	LUAMIX_GLOBAL_EXPORT(state)
 		.Function("add_ref", add_ref)
 		.Function("print1", print_any<int>)
@@ -158,7 +169,7 @@ int main() {
 		.Property("g_ConstIntValue", g_ConstIntVal)
 		;
 
-	// ģע
+	// 模块注册
 	LUAMIX_MODULE_EXPORT(state, "cpp.test")
 		.Property("IntValue", []() { return g_IntValue; }, [](int v) { g_IntValue = v; })
 		;
@@ -168,7 +179,7 @@ int main() {
 		;
 
 	//////////////////////////////////////////////////////////////////////////
-	// ע
+	// 类注册
 	LUAMIX_CLASS_EXPORT(state, Window)
 		.Method("GetSize", &Window::GetSize)
 		.Method("SetSize", &Window::SetSize)
@@ -198,6 +209,18 @@ int main() {
 
 	LUAMIX_VECTOR_SUPPORT(state, Button*);
 
+	//////////////////////////////////////////////////////////////////////////
+	// 并行内核
+	// plain 在 state 之前注册同一类型但不记账，类签名仍指向 state 中的字符串
+	LuaMix::LuaState plain;
+	LUAMIX_VECTOR_SUPPORT(plain, double);
+	LUAMIX_PARALLEL_SUPPORT(state);
+	LUAMIX_VECTOR_SUPPORT_ACCOUNTED(state, double);
+	LUAMIX_GLOBAL_EXPORT(state)
+		.ScriptVal("ScaleKernel", LuaMix::ParallelMix::MakeKernel(state, [](std::size_t i, std::vector<double>* v, double k) { (*v)[i] *= k; }))
+		.ScriptVal("FailKernel", LuaMix::ParallelMix::MakeKernel(state, [](std::size_t i) { if (i == 77) throw std::runtime_error("kernel failed"); }))
+		;
+
 	std::vector<Window *> vws;
 	Button vb;
 	Window vw;
@@ -214,7 +237,7 @@ int main() {
 		lua_pop(state, 1);
 	}
 
-	// űò
+	// 脚本函数调用测试
 	std::cout << "Calling Script Function:-------------------------\n";
 	if (auto rst = state.Call<Window *>("Window")) {
 		std::cout << "Create Window From Script:" << rst.value() << std::endl;
@@ -238,5 +261,429 @@ int main() {
 		std::cout << i << std::ends << s << std::ends << f << std::endl;
 	}
 
+	// 错误调用栈的层数恰好在省略中间层的边界附近
+	state.DoString("function DeepError(n) if n <= 1 then error('deep') end return (DeepError(n - 1)) end");
+	for (int depth : { 20, 21, 22 }) {
+		LuaMix::ScriptCall<int> deep(state, "DeepError");
+		deep.Call(depth);
+		std::cout << "Traceback depth " << depth << " frames:" << deep.Error().Frames().size() << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 对象池工厂
+	{
+		auto cm = LUAMIX_CLASS_EXPORT(state, Bullet)
+			.Property("x", &Bullet::x)
+			.Property("y", &Bullet::y)
+			.PooledFactory(1024, [](Bullet* b) { b->x = b->y = 0.0f; })
+			;
+		state.DoString("for f = 1, 100 do for i = 1, 100 do local b = Bullet() b.x = i end collectgarbage('step') end");
+		auto stats = cm.PoolStats();
+		std::cout << "Bullet pool created:" << stats->created << " reused:" << stats->reused << " dropped:" << stats->dropped << " free:" << stats->free_objects << std::endl;
+	}
+
+	// 延迟回收的状态机中，对象池仍然同步回收
+	{
+		LuaMix::LuaState deferred;
+		deferred.EnableFinalizer(LuaMix::Finalizer::Mode::Batched);
+		auto cm = LUAMIX_CLASS_EXPORT(deferred, Spark)
+			.Property("life", &Spark::life)
+			.PooledFactory(256)
+			.DeferredCollect()
+			;
+		deferred.DoString("for f = 1, 20 do for i = 1, 100 do local s = Spark() s.life = i end collectgarbage() end");
+		auto stats = cm.PoolStats();
+		std::cout << "Deferred Spark pool created:" << stats->created << " reused:" << stats->reused << " queued:" << deferred.GetFinalizer()->GetStats().queued << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 限时GC
+	{
+		int ticks = 1;
+		while (!state.CollectFor(std::chrono::microseconds(300))) {
+			++ticks;
+		}
+		auto& stats = state.GetGCStats();
+		std::cout << "CollectFor ticks:" << ticks << " steps:" << stats.steps << " reclaimed:" << stats.bytes_reclaimed << " max pause(us):" << stats.max_pause.count() / 1000 << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 分代GC
+	{
+		state.SetGCMode(LuaMix::GCMode::Generational);
+		state.DoString("local keep = {} for i = 1, 10000 do keep[i] = { i } end for i = 1, 100000 do local t = { i } end");
+		state.ResetGCStats();
+		state.CollectFor(std::chrono::microseconds(300));
+		std::cout << "Generational minor pause(us):" << state.GetGCStats().max_pause.count() / 1000 << " reclaimed:" << state.GetGCStats().bytes_reclaimed << std::endl;
+		state.DoString("print('gc mode was', collectgarbage('incremental'))");
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 冻结
+	{
+		auto full_gc = [&state] {
+			auto start = std::chrono::steady_clock::now();
+			lua_gc(state, LUA_GCCOLLECT, 0);
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		};
+		auto before = full_gc();
+		state.FreezeAll();
+		std::cout << "full gc(us) before freeze:" << before << " after:" << full_gc() << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 外部内存记账
+	{
+		state.DoString(R"(
+			local peak = 0
+			for i = 1, 1000 do
+				local v = _G['std::vector<double>'].new()
+				v:resize_with(10000, 0.0)
+				peak = math.max(peak, LuaMix.MemoryStats().external_bytes)
+			end
+			print('external bytes peak', peak)
+		)");
+		lua_gc(state, LUA_GCCOLLECT, 0);
+		std::cout << "external bytes after full gc:" << state.GetExternalBytes() << std::endl;
+
+		// 大小函数按状态机记录：另一个状态机中不记账的同一个类型创建的对象不记账
+		plain.DoString("keep = _G['std::vector<double>'].new() keep:resize_with(10000, 0.0)");
+		auto keep = LuaMix::LuaRef::RefGlobal(plain).RawGet<const char*, std::vector<double>*>("keep");
+		bool accounted = LuaMix::Impl::UpdateExternalSize(plain, keep, keep->capacity() * sizeof(double));
+		std::cout << "external bytes in plain state:" << accounted << " " << plain.GetExternalBytes() << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 代码块缓存
+	{
+		auto env = LuaMix::LuaRef::MakeTable(state);
+		for (int i = 0; i < 1000; ++i) {
+			env.RawSet("x", i);
+			state.DoString("result = x * 2", env);
+		}
+		auto& stats = state.GetChunkCacheStats();
+		std::cout << "ChunkCache hits:" << stats.hits << " misses:" << stats.misses << " result:" << env.RawGet<const char*, int>("result") << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 沙箱环境
+	{
+		LuaMix::Sandbox sandbox(state, { "print", "math" });
+		for (int i = 0; i < 100; ++i) {
+			auto env = sandbox.Acquire();
+			env.RawSet("a", i);
+			state.DoString("b = math.floor(a / 2)", env);
+			sandbox.Release(std::move(env));
+		}
+		auto env = sandbox.Acquire();
+		state.DoString("print('sandbox', a, b, io, math.pi)", env);
+		auto& stats = sandbox.GetStats();
+		std::cout << "Sandbox created:" << stats.created << " reused:" << stats.reused << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 字节码缓存
+	{
+		auto cache = std::make_shared<LuaMix::BytecodeCache>(".luamix_cache");
+		for (int round = 0; round < 2; ++round) {
+			LuaMix::LuaState cached;
+			cached.SetBytecodeCache(cache);
+			cached.DoString("local m = require('cached_module') print('cached_module', m.fib(20), m.where())");
+		}
+		auto stats = cache->GetStats();
+		std::cout << "BytecodeCache hits:" << stats.hits << " misses:" << stats.misses << " writes:" << stats.writes << " mapped:" << stats.mapped_bytes << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 脚本归档
+	{
+		auto count = LuaMix::ScriptArchive::Pack(state, ".", ".luamix_cache/playground.lpk");
+		auto archive = std::make_shared<LuaMix::ScriptArchive>();
+		if (archive->Open(".luamix_cache/playground.lpk")) {
+			LuaMix::LuaState packed;
+			packed.AddScriptArchive(archive);
+			packed.DoString("local m = require('cached_module') print('archived_module', m.fib(20), m.where(), package.loaded.cached_module == m)");
+			std::cout << "ScriptArchive packed:" << count << " modules:" << archive->GetCount() << " mapped:" << archive->GetMappedBytes() << std::endl;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 调用缓存
+	{
+		LuaMix::LuaState cached;
+		cached.DoString("hooks = { OnTick = function(n) return n + 1 end }");
+		int sum = 0;
+		for (int i = 0; i < 100; ++i) {
+			sum += cached.Call<int>("hooks.OnTick", i).value_or(0);
+		}
+		cached.DoString("hooks.OnTick = function(n) return n * 2 end");
+		auto doubled = cached.Call<int>("hooks.OnTick", 21).value_or(0);
+		cached.DoString("hooks = { OnTick = function(n) return -n end }");
+		auto negated = cached.Call<int>("hooks.OnTick", 5).value_or(0);
+		auto& stats = cached.GetCallCacheStats();
+		std::cout << "CallCache sum:" << sum << " doubled:" << doubled << " negated:" << negated << " hits:" << stats.hits << " misses:" << stats.misses << " invalidations:" << stats.invalidations << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 批量调用
+	{
+		state.DoString("function OnEntityTick(id, dt) if id == 3 then error('entity 3 is broken') end return id + dt end");
+		std::vector<std::tuple<int, float>> args;
+		for (int id = 0; id < 5; ++id) {
+			args.emplace_back(id, 0.5f);
+		}
+		std::vector<std::optional<float>> out;
+		auto failed = state.CallBatch<float>("OnEntityTick", args, out);
+		std::cout << "CallBatch failed:" << failed << " out[4]:" << out[4].value_or(-1) << " out[3]:" << out[3].has_value() << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 零分配调用
+	{
+		state.DoString("function EntityInfo(id) return id, 'entity_' .. id, id * 1.5 end");
+		int id = 0;
+		std::string name;
+		double speed = 0;
+		state.CallInto("EntityInfo", std::tie(id, name, speed), 7);
+		LuaMix::StackGuard pin(state);
+		std::string_view label;
+		state.CallInto(pin, "EntityInfo", std::tie(id, label, speed), 8);
+		std::cout << "CallInto " << name << " " << label << " " << speed << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 脚本回调
+	{
+		std::vector<LuaMix::LuaFunction<int(int)>> handlers;
+		LUAMIX_GLOBAL_EXPORT(state)
+			.Function("AddHandler", [&handlers](LuaMix::LuaFunction<int(int)> fn) { handlers.push_back(std::move(fn)); return handlers.size(); })
+			;
+		state.DoString("for i = 1, 3 do AddHandler(function(n) return n * i end) end AddHandler(function(n) error('bad handler') end)");
+		int sum = 0;
+		LuaMix::ScriptError err;
+		for (auto& fn : handlers) {
+			sum += fn.TryCall(err, 10).value_or(0);
+		}
+		std::cout << "LuaFunction handlers:" << handlers.size() << " sum:" << sum << " first:" << handlers[0](7) << " error:" << err.Message() << std::endl;
+
+		// 带 __call 的表也可以作为回调；在协程中触发时回调运行在该协程上
+		LUAMIX_GLOBAL_EXPORT(state)
+			.Function("FireHandlers", [&handlers](int n) { LuaMix::ScriptError e; int total = 0; for (auto& fn : handlers) { total += fn.TryCall(e, n).value_or(0); } return total; })
+			;
+		handlers.clear();
+		state.DoString("AddHandler(setmetatable({ k = 5 }, { __call = function(self, n) return n * self.k end }))"
+			 " AddHandler(function(n) local _, main = coroutine.running() return main and 0 or 1 end)"
+			" local co = coroutine.wrap(function() return FireHandlers(2) end) print('LuaFunction in coroutine', co())");
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 事件通道
+	{
+		LuaMix::EventChannel on_damage(state);
+		on_damage.OnError([](LuaMix::EventChannel::Token, const LuaMix::ScriptError& e) { std::cout << "listener failed: " << e.Message() << std::endl; });
+		LUAMIX_GLOBAL_EXPORT(state)
+			.ScriptVal("OnDamage", on_damage.GetProxy())
+			;
+		state.DoString("total = 0 "
+			"OnDamage:Subscribe(function(id, dmg) total = total + dmg end) "
+			"local once once = OnDamage:Subscribe(function(id, dmg) OnDamage:Unsubscribe(once) end) "
+			"OnDamage:Subscribe(function(id, dmg) if id == 2 then error('listener broken') end end)");
+		for (int id = 1; id <= 3; ++id) {
+			on_damage.Fire(id, 10.0);
+		}
+		state.DoString("print('EventChannel', total, OnDamage:Count(), OnDamage:Fire(2, 1))");
+		auto& stats = on_damage.GetStats();
+		std::cout << "EventChannel fired:" << stats.fired << " calls:" << stats.calls << " errors:" << stats.errors << std::endl;
+
+		// 参数较多时 dispatch 为每个订阅者复制一份参数，Fire 预留的栈空间包含这份副本
+		LuaMix::EventChannel on_wide(state);
+		LUAMIX_GLOBAL_EXPORT(state)
+			.ScriptVal("OnWide", on_wide.GetProxy())
+			;
+		state.DoString("wide = 0 OnWide:Subscribe(function(...) wide = wide + select('#', ...) end)");
+		on_wide.Fire(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12);
+		std::cout << "EventChannel wide args:" << LuaMix::LuaRef::RefGlobal(state).RawGet<const char*, int>("wide") << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 协程调度
+	{
+		LuaMix::Scheduler sched(state);
+		std::vector<std::pair<LuaMix::Async, int>> io;
+		LUAMIX_GLOBAL_EXPORT(state)
+			.Function("LoadAsync", [&io](int id) { LuaMix::Async op; io.emplace_back(op, id); return op; })
+			;
+		state.DoString("function LoadEntity(id) local hp = LoadAsync(id) local mp = LoadAsync(id + 1) return hp + mp end");
+		int sum = 0;
+		for (int id = 0; id < 1000; ++id) {
+			sched.Spawn("LoadEntity", id)->Then([&sum](LuaMix::ScriptTask& task) { sum += std::get<0>(task.Result<int>().value_or(std::make_tuple(0))); });
+		}
+		std::cout << "Scheduler in flight:" << sched.GetRunning() << std::endl;
+		while (sched.GetRunning()) {
+			std::thread completer([pending = std::move(io)] {
+				for (auto& [op, id] : pending) {
+					op.Resolve(id * 10);
+				}
+			});
+			io.clear();
+			completer.join();
+			sched.Wait(std::chrono::milliseconds(100));
+			sched.Poll();
+		}
+		auto& stats = sched.GetStats();
+		std::cout << "Scheduler sum:" << sum << " spawned:" << stats.spawned << " resumes:" << stats.resumes << " completed:" << stats.completed << std::endl;
+		auto& threads = sched.GetThreadPool().GetStats();
+		std::cout << "CoroutinePool created:" << threads.created << " reused:" << threads.reused << " idle:" << sched.GetThreadPool().GetIdle() << std::endl;
+
+		// 任务中的 parallel_for 挂起任务，计算完成后由 Poll 恢复
+		state.DoString("function ScaleTask(k) local v = _G['std::vector<double>'].new() v:resize_with(100000, 1.0) LuaMix.parallel_for(ScaleKernel, v:size(), v, k) return v:get(99999) end");
+		auto scale = sched.Spawn("ScaleTask", 4.0);
+		std::cout << "parallel_for suspended:" << !scale->IsDone() << std::endl;
+		while (!scale->IsDone()) {
+			sched.Wait(std::chrono::milliseconds(100));
+			sched.Poll();
+		}
+		std::cout << "parallel_for in task:" << std::get<0>(scale->Result<double>().value_or(std::make_tuple(-1.0))) << std::endl;
+
+		// 任务中的协程与不能让出的地方（pcall 下 table.sort 的比较函数）阻塞等待，不挂起任务
+		state.DoString("function ScaleNested(k) local v = _G['std::vector<double>'].new() v:resize_with(1000, 1.0) "
+			"local co = coroutine.wrap(function() LuaMix.parallel_for(ScaleKernel, v:size(), v, k) return v:get(999) end) "
+			"local sorted = 0 pcall(table.sort, { 3, 1, 2 }, function(a, b) LuaMix.parallel_for(ScaleKernel, v:size(), v, 2.0) sorted = sorted + 1 return a < b end) "
+			"return co(), sorted end");
+		auto nested = sched.Spawn("ScaleNested", 3.0);
+		auto [scaled_value, compares] = nested->Result<double, int>().value_or(std::make_tuple(-1.0, -1));
+		std::cout << "parallel_for blocking done:" << nested->IsDone() << " value:" << scaled_value << " compares:" << compares << std::endl;
+
+		// 内核抛出的异常结束 Async，任务以脚本错误结束；并发的多个任务各自挂起与恢复
+		state.DoString("function FailTask() LuaMix.parallel_for(FailKernel, 1000) end");
+		auto failed = sched.Spawn("FailTask");
+		std::vector<std::shared_ptr<LuaMix::ScriptTask>> scaled;
+		for (int i = 0; i < 50; ++i) {
+			scaled.push_back(sched.Spawn("ScaleTask", 2.0));
+		}
+		while (sched.GetRunning()) {
+			sched.Wait(std::chrono::milliseconds(100));
+			sched.Poll();
+		}
+		double total = 0.0;
+		for (auto& task : scaled) {
+			total += std::get<0>(task->Result<double>().value_or(std::make_tuple(0.0)));
+		}
+		std::cout << "parallel_for failed:" << failed->GetError().Message() << " concurrent:" << total << std::endl;
+
+		// 未完成就丢弃的 Async 被拒绝，等待它的任务出错结束而不是永远挂起
+		std::vector<LuaMix::Async> lost;
+		LUAMIX_GLOBAL_EXPORT(state)
+			.Function("LoadLost", [&lost]() { lost.emplace_back(); return lost.back(); })
+			;
+		state.DoString("function LoseEntity() return LoadLost() end");
+		auto orphan = sched.Spawn("LoseEntity");
+		lost.clear();
+		sched.Poll();
+		std::cout << "Async dropped:" << orphan->IsDone() << " running:" << sched.GetRunning() << " " << orphan->GetError().Message() << std::endl;
+
+		// 不能让出的地方等待 Async 引发错误，不登记等待的协程，之后的 coroutine.yield 照常恢复
+		state.DoString("function SortLoad() local ok, err = pcall(table.sort, { 3, 1, 2 }, function(a, b) LoadLost() return a < b end) "
+			"coroutine.yield() return ok, err end");
+		auto sorter = sched.Spawn("SortLoad");
+		for (int i = 0; i < 20 && !sorter->IsDone(); ++i) {
+			sched.Poll();
+		}
+		std::cout << "Async across C call done:" << sorter->IsDone() << " running:" << sched.GetRunning() << " "
+			<< std::get<1>(sorter->Result<bool, std::string>().value_or(std::make_tuple(true, std::string()))) << std::endl;
+		lost.clear();
+
+		// 出错的任务只记录调用栈的各层，What() 时才生成调用栈文本；过深的调用栈省略中间的层
+		state.DoString("function InnerFail() error('bad') end function OuterFail() LuaMix.sleep(0) InnerFail() end "
+			"function DeepFail(n) if n == 0 then error({}) end DeepFail(n - 1) return n end");
+		auto outer = sched.Spawn("OuterFail");
+		while (!outer->IsDone()) {
+			sched.Wait(std::chrono::milliseconds(100));
+			sched.Poll();
+		}
+		auto& fail = outer->GetError();
+		std::cout << "Task error:" << fail.Message() << " frames:" << fail.Frames().size()
+			<< " traceback:" << (fail.What().find("stack traceback:") != std::string::npos) << std::endl;
+		auto deep = sched.Spawn("DeepFail", 40);
+		std::cout << "Task deep error:" << deep->GetError().Message() << " elided:" << (deep->GetError().What().find("\n\t...") != std::string::npos) << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 定时器
+	{
+		LuaMix::Scheduler sched(state);
+		state.DoString("ticks = 0 function Ticker(n) for i = 1, n do LuaMix.sleep(10) ticks = ticks + 1 end end "
+			"for i = 1, 1000 do LuaMix.after(i % 50, function() ticks = ticks + 1 end) end "
+			"LuaMix.cancel(LuaMix.after(10, function() ticks = ticks + 1000 end))");
+		for (int i = 0; i < 100; ++i) {
+			sched.Spawn("Ticker", 5);
+		}
+		std::cout << "Timers pending:" << sched.GetTimerCount() << std::endl;
+		while (sched.GetRunning() || sched.GetTimerCount()) {
+			sched.Wait(std::chrono::milliseconds(100));
+			sched.Poll();
+		}
+		std::cout << "Timers ticks:" << LuaMix::LuaRef::RefGlobal(state).RawGet<const char*, int>("ticks") << " fired:" << sched.GetStats().timers << std::endl;
+
+		// 不能让出的地方调用 sleep 引发错误，不留下定时器，之后的 coroutine.yield 照常恢复
+		state.DoString("function SortSleep() local ok, err = pcall(table.sort, { 3, 1, 2 }, function(a, b) LuaMix.sleep(1e6) return a < b end) "
+			"coroutine.yield() return ok, err end");
+		auto sorter = sched.Spawn("SortSleep");
+		for (int i = 0; i < 20 && !sorter->IsDone(); ++i) {
+			sched.Poll();
+		}
+		std::cout << "sleep across C call done:" << sorter->IsDone() << " timers:" << sched.GetTimerCount() << " "
+			<< std::get<1>(sorter->Result<bool, std::string>().value_or(std::make_tuple(true, std::string()))) << std::endl;
+
+		// 睡眠中的任务的定时器不能被 LuaMix.cancel 取消，猜测定时器 id 也不行
+		state.DoString("function SleepTask() LuaMix.sleep(50) return true end "
+			"function GuessCancel() local n = 0 for i = 0, 8 do for s = 1, 4 do if LuaMix.cancel((s << 32) | i) then n = n + 1 end end end return n end");
+		auto sleeper = sched.Spawn("SleepTask");
+		auto guess = sched.Spawn("GuessCancel");
+		while (sched.GetRunning() || sched.GetTimerCount()) {
+			sched.Wait(std::chrono::milliseconds(100));
+			sched.Poll();
+		}
+		std::cout << "Sleep ids cancelled:" << std::get<0>(guess->Result<int>().value_or(std::make_tuple(-1)))
+			<< " sleeper done:" << std::get<0>(sleeper->Result<bool>().value_or(std::make_tuple(false))) << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 执行预算
+	{
+		state.DoString("function Runaway() while true do end end function Bounded(n) local x = 0 for i = 1, n do x = x + i end return x end");
+		auto spin = state.CallWithBudget<int>(LuaMix::CallBudget::Instructions(100000), "Runaway");
+		std::cout << "Budget runaway stopped:" << !spin << " " << state.GetLastError().Message() << std::endl;
+		LuaMix::ScriptCall<int> bounded(state, "Bounded");
+		std::cout << "Budget bounded:" << bounded.CallWithBudget(LuaMix::CallBudget::Time(std::chrono::milliseconds(100)), 100).value_or(-1) << std::endl;
+
+		LuaMix::Scheduler sched(state);
+		sched.SetBudget(LuaMix::CallBudget::Instructions(10000));
+		auto task = sched.Spawn("Bounded", 100000);
+		while (!task->IsDone()) {
+			sched.Poll();
+		}
+		std::cout << "Budget task:" << std::get<0>(task->Result<long long>().value_or(std::make_tuple(-1ll))) << " preempted:" << sched.GetStats().preempted << std::endl;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// 池分配状态机
+	{
+		LuaMix::LuaState pooled(std::make_unique<LuaMix::PoolAlloc>());
+		pooled.SetMemoryLimit(16 << 20, 32 << 20);
+		pooled.OnSoftMemoryLimit([](const LuaMix::AllocPolicy::Stats& stats) { std::cout << "soft memory limit hit, live:" << stats.live_bytes << std::endl; });
+		pooled.DoString("local t = {} for i = 1, 10000 do t[i] = { tostring(i) } end");
+		auto alloc = static_cast<LuaMix::PoolAlloc*>(pooled.GetAllocator());
+		auto& stats = alloc->GetStats();
+		std::cout << "PoolAlloc live:" << stats.live_bytes << " peak:" << stats.peak_bytes << " allocs:" << stats.allocs << " frees:" << stats.frees << std::endl;
+		for (std::size_t i = 0; i < LuaMix::PoolAlloc::kClassCount; ++i) {
+			auto cs = alloc->GetClassStats(i);
+			if (cs.allocs) {
+				std::cout << "  class " << cs.block_size << " live:" << cs.live_blocks << " allocs:" << cs.allocs << std::endl;
+			}
+		}
+		pooled.DoString("local m = LuaMix.MemoryStats() print('MemoryStats', m.live_bytes, m.peak_bytes, m.soft_limit, m.hard_limit)");
+	}
+
 	return 0;
 }
\ No newline at end of file
@@ -19,14 +19,14 @@ Window.WindowCounter = 888
 print(Window.WindowCounter)
 print(Window.GetWindowCounter())
 
-print("ģע--------------------")
+print("模块注册测试--------------------")
 print("print(cpp.test.kEnum1) => 1")
 print(cpp.test.kEnum1)
 print("print(cpp.test.IntValue) => 999")
 print(cpp.test.IntValue)
 print()
 
-print("ȫע--------------------")
+print("全局注册测试--------------------")
 
 print(IntValue)
 IntValue = 321
@@ -70,7 +70,7 @@ print("print(kEnum0, kEnum1) => 0	1")
 print(kEnum0, kEnum1)
 print()
 
-print("ע--------------------")
+print("类注册测试--------------------")
 print("local sw = Window(); print(sw) => &sw")
 local sw = Window(); print(sw)
 print()
@@ -121,7 +121,7 @@ err_call = function()  sw.ReadOnlyTitle = 'tt' end
 print(pcall(err_call))
 print()
 
-print("űԶgc")
+print("脚本变量自动gc")
 local pure_script_wnd = Window.TraceCreate()
 pure_script_wnd = Window.CreateWnd()
 pure_script_wnd = Window()
@@ -129,7 +129,7 @@ pure_script_wnd = nil
 collectgarbage()
 print()
 
-print("std::vector<Window*>")
+print("std::vector<Window*>测试")
 local svs = _G["std::vector<Window*>"].new()
 svs:resize(3)
 for i = 0, 2 do
@@ -144,19 +144,19 @@ svs = nil
 collectgarbage()
 print()
 
-print("̬/̳в--------------------")
+print("类多态/继承测试--------------------")
 print("g_ButtonAsWindow:SetTitle('button_title'); print(g_ButtonAsWindow.Title) => [Button]button_title")
 g_ButtonAsWindow:SetTitle('button_title'); print(g_ButtonAsWindow.Title)
 print()
 
-print("ʹ--------------------")
+print("类型错误测试--------------------")
 print("g_ConstWnd:SetTitle('tt') => bad argument #1 to '?' (Window expected, got const Window)" )
 print(pcall( g_ConstWnd.SetTitle, g_ConstWnd, 'tt' ))
 local chk = load("g_ConstWnd.Title = 'tt'")
 print(pcall( chk ))
 print()
 
-print("peer--------------------")
+print("peer表测试--------------------")
 local sw2 = Window()
 print("sw2.some_val = 123; print(sw2.some_val) => 123")
 sw2.some_val = 123; print(sw2.some_val)
@@ -174,4 +174,18 @@ local window_hook = {
 LuaMix.SetPeer(sw2, window_hook)
 print("sw2:ScriptSetTitle('script title'); print(sw2.Title) => script title")
 sw2:ScriptSetTitle('script title'); print(sw2.Title)
-print()
\ No newline at end of file
+print()
+print("并行内核测试--------------------")
+local dv = _G["std::vector<double>"].new()
+dv:resize_with(100000, 1.0)
+print("LuaMix.parallel_for(ScaleKernel, dv:size(), dv, 2.5); print(dv:get(99999)) => 2.5")
+LuaMix.parallel_for(ScaleKernel, dv:size(), dv, 2.5); print(dv:get(99999))
+print()
+
+print("不在调度任务中的协程里调用 parallel_for 会阻塞到计算完成 => 5.0")
+local co = coroutine.wrap(function()
+	LuaMix.parallel_for(ScaleKernel, dv:size(), dv, 2.0)
+	return dv:get(0)
+end)
+print(co())
+print()